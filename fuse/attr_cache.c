@@ -0,0 +1,232 @@
+#include "attr_cache.h"
+#include "http_policy.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define ATTR_BUCKETS 1024
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static attr_entry_t *table[ATTR_BUCKETS];
+static int n_entries;
+static uint64_t epoch;      // bumped by every invalidation, guarded by table_lock
+static long ttl_ms = ATTR_TTL_MS_DEFAULT;
+static long neg_ttl_ms = ATTR_NEG_TTL_MS_DEFAULT;
+
+static uint64_t stat_hits, stat_neg_hits, stat_misses;
+
+
+static void _entry_free(attr_entry_t *e)
+{
+    free(e->path);
+    free(e);
+}
+
+/* Drops every entry keep() rejects, caller holds table_lock */
+static void _sweep(int (*keep)(const attr_entry_t *e, const void *arg), const void *arg)
+{
+    for (int b = 0; b < ATTR_BUCKETS; b++) {
+        attr_entry_t **indirect = &table[b];
+        while (*indirect) {
+            attr_entry_t *cur = *indirect;
+            if (keep(cur, arg)) {
+                indirect = &cur->next;
+                continue;
+            }
+            *indirect = cur->next;
+            _entry_free(cur);
+            n_entries--;
+        }
+    }
+}
+
+static int _alive(const attr_entry_t *e, const void *arg)
+{
+    return e->expires > *(const long long *)arg;
+}
+
+static int _outside(const attr_entry_t *e, const void *arg)
+{
+    const char *dir = arg;
+    return !path_under(e->path, dir, strlen(dir));
+}
+
+static int _none(const attr_entry_t *e, const void *arg)
+{
+    return 0;
+}
+
+
+/* Tunables: DISFS_ATTR_TTL_MS, DISFS_ATTR_NEG_TTL_MS, 0 turns either off */
+void attr_cache_init(void)
+{
+    ttl_ms = env_long("DISFS_ATTR_TTL_MS", ATTR_TTL_MS_DEFAULT);
+    neg_ttl_ms = env_long("DISFS_ATTR_NEG_TTL_MS", ATTR_NEG_TTL_MS_DEFAULT);
+    LOGMSG("[ATTR] ttl=%ldms, negative ttl=%ldms", ttl_ms, neg_ttl_ms);
+}
+
+
+void attr_cache_exit(void)
+{
+    attr_cache_clear();
+}
+
+
+uint64_t attr_cache_epoch(void)
+{
+    pthread_mutex_lock(&table_lock);
+    uint64_t e = epoch;
+    pthread_mutex_unlock(&table_lock);
+    return e;
+}
+
+
+/* 0 and *st filled on a hit, -ENOENT for a cached miss, 1 if unknown */
+int attr_cache_get(const char *path, struct stat *st)
+{
+    long long now = mono_ms();
+    int rc = 1;
+
+    pthread_mutex_lock(&table_lock);
+    attr_entry_t **indirect = &table[path_hash(path) % ATTR_BUCKETS];
+    while (*indirect && strcmp((*indirect)->path, path) != 0)
+        indirect = &(*indirect)->next;
+
+    attr_entry_t *e = *indirect;
+    if (e && e->expires <= now) {
+        *indirect = e->next;
+        _entry_free(e);
+        n_entries--;
+    } else if (e && e->negative) {
+        rc = -ENOENT;
+    } else if (e) {
+        *st = e->st;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if (rc == 0)
+        STAT_ADD(stat_hits, 1);
+    else if (rc == -ENOENT)
+        STAT_ADD(stat_neg_hits, 1);
+    else
+        STAT_ADD(stat_misses, 1);
+    return rc;
+}
+
+
+static void _put(const char *path, const struct stat *st, long ttl, uint64_t seen)
+{
+    if (ttl <= 0)
+        return;
+    long long now = mono_ms();
+
+    pthread_mutex_lock(&table_lock);
+    if (seen != epoch) {
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+    unsigned b = path_hash(path) % ATTR_BUCKETS;
+    attr_entry_t *e = table[b];
+    while (e && strcmp(e->path, path) != 0)
+        e = e->next;
+
+    if (!e) {
+        if (n_entries >= ATTR_CACHE_MAX) {
+            _sweep(_alive, &now);
+            if (n_entries >= ATTR_CACHE_MAX)
+                _sweep(_none, NULL);
+        }
+        e = calloc(1, sizeof(*e));
+        if (!e || !(e->path = strdup(path))) {
+            free(e);
+            pthread_mutex_unlock(&table_lock);
+            return;
+        }
+        e->next = table[b];
+        table[b] = e;
+        n_entries++;
+    }
+    e->negative = st == NULL;
+    if (st)
+        e->st = *st;
+    e->expires = now + ttl;
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+void attr_cache_put(const char *path, const struct stat *st, uint64_t seen)
+{
+    _put(path, st, ttl_ms, seen);
+}
+
+
+void attr_cache_put_negative(const char *path, uint64_t seen)
+{
+    _put(path, NULL, neg_ttl_ms, seen);
+}
+
+
+/* path changed locally, along with its parent directory's mtime */
+void attr_cache_invalidate(const char *path)
+{
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *slash = strrchr(parent, '/');
+    if (slash)
+        slash[slash == parent ? 1 : 0] = '\0';
+
+    pthread_mutex_lock(&table_lock);
+    epoch++;
+    for (int i = 0; i < 2; i++) {
+        const char *key = i == 0 ? path : parent;
+        attr_entry_t **indirect = &table[path_hash(key) % ATTR_BUCKETS];
+        while (*indirect && strcmp((*indirect)->path, key) != 0)
+            indirect = &(*indirect)->next;
+        attr_entry_t *e = *indirect;
+        if (e) {
+            *indirect = e->next;
+            _entry_free(e);
+            n_entries--;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+/* A directory moved or went away, so did everything below it */
+void attr_cache_invalidate_tree(const char *path)
+{
+    attr_cache_invalidate(path);
+    pthread_mutex_lock(&table_lock);
+    epoch++;
+    _sweep(_outside, path);
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+/* Another user logged in, nothing cached applies anymore */
+void attr_cache_clear(void)
+{
+    pthread_mutex_lock(&table_lock);
+    epoch++;
+    _sweep(_none, NULL);
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+int attr_cache_stats(char *buf, size_t size)
+{
+    uint64_t hits = STAT_GET(stat_hits), neg = STAT_GET(stat_neg_hits);
+    uint64_t misses = STAT_GET(stat_misses);
+    uint64_t total = hits + neg + misses;
+    return snprintf(buf, size,
+            "[Attributes]\n"
+            "- TTL: %ldms, negative %ldms\n"
+            "- Hits: %lu, negative %lu (%.1f%%)\n"
+            "- Misses: %lu\n",
+            ttl_ms, neg_ttl_ms,
+            (unsigned long)hits, (unsigned long)neg,
+            total ? 100.0 * (hits + neg) / total : 0.0,
+            (unsigned long)misses);
+}
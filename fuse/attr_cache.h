@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+#define ATTR_TTL_MS_DEFAULT 1000        // how long a /stat answer is trusted
+#define ATTR_NEG_TTL_MS_DEFAULT 1000    // same for "no such file"
+#define ATTR_CACHE_MAX 8192             // entries before expired ones are swept
+
+
+/* /stat answers by path, so metadata heavy tools (ls -l, git status, shells
+ * probing for files) don't go to the server for every lookup. Entries die
+ * with their TTL, or right away when a local operation changes the path.
+ * Answers are only stored if nothing was invalidated since the epoch taken
+ * before asking the server, else they might predate the local change.
+ */
+typedef struct attr_entry {
+    char *path;
+    int negative;           // server said ENOENT
+    struct stat st;
+    long long expires;      // mono_ms
+    struct attr_entry *next;
+} attr_entry_t;
+
+
+void attr_cache_init(void);
+void attr_cache_exit(void);
+
+uint64_t attr_cache_epoch(void);
+int attr_cache_get(const char *path, struct stat *st);
+void attr_cache_put(const char *path, const struct stat *st, uint64_t epoch);
+void attr_cache_put_negative(const char *path, uint64_t epoch);
+
+void attr_cache_invalidate(const char *path);
+void attr_cache_invalidate_tree(const char *path);
+void attr_cache_clear(void);
+int attr_cache_stats(char *buf, size_t size);
@@ -0,0 +1,87 @@
+#include "buf_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+
+/* Free buffers are chained through their first bytes */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static void *free_list;
+static int n_free;
+static int n_total;     // allocated so far, free or handed out
+static int capacity;
+
+
+/* Tunables: DISFS_UPLOAD_MEM_MB */
+void buf_pool_init(void)
+{
+    long n = env_long("DISFS_UPLOAD_MEM_MB", UPLOAD_MEM_MB_DEFAULT) * 1024 * 1024 / CHUNK_SIZE;
+    capacity = n < BUF_POOL_MIN ? BUF_POOL_MIN : (int)n;
+    LOGMSG("[POOL] up to %d upload buffers", capacity);
+}
+
+
+/* Frees what's been handed back, uploads are done by now */
+void buf_pool_exit(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (free_list) {
+        void *next = *(void **)free_list;
+        free(free_list);
+        free_list = next;
+    }
+    n_total -= n_free;
+    n_free = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/* Hands out n buffers at once, so two callers can't each sit on half of
+ * what they need. Without wait, -EAGAIN if they aren't there right now.
+ */
+int buf_pool_get(void **out, int n, int wait)
+{
+    if (n > capacity)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&pool_lock);
+    while (n_free + (capacity - n_total) < n) {
+        if (!wait) {
+            pthread_mutex_unlock(&pool_lock);
+            return -EAGAIN;
+        }
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+
+    int got = 0;
+    for (; got < n && free_list; got++) {
+        out[got] = free_list;
+        free_list = *(void **)free_list;
+        n_free--;
+    }
+    for (; got < n; got++) {
+        if (!(out[got] = malloc(CHUNK_SIZE)))
+            break;
+        n_total++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (got < n) {
+        for (int i = 0; i < got; i++)
+            buf_pool_put(out[i]);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+
+void buf_pool_put(void *buf)
+{
+    if (!buf)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    *(void **)buf = free_list;
+    free_list = buf;
+    n_free++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
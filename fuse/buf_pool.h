@@ -0,0 +1,16 @@
+#pragma once
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+/* CHUNK_SIZE buffers shared by every upload in flight. Capped by
+ * DISFS_UPLOAD_MEM_MB in total, however many files are uploading.
+ */
+#define BUF_POOL_MIN 2  // a compressed chunk needs two at once
+
+
+void buf_pool_init(void);
+void buf_pool_exit(void);
+int buf_pool_get(void **out, int n, int wait);
+void buf_pool_put(void *buf);
@@ -1,5 +1,12 @@
 #include "cache_manage.h"
+#include "chunk_map.h"
+#include "upload_queue.h"
+#include "open_file.h"
+#include "meta_log.h"
 #include <errno.h>
+#include <inttypes.h>
+#include <sys/xattr.h>
+#include <cjson/cJSON.h>
 
 #define MUTEX_LOCK(x) pthread_mutex_lock(&x)
 #define MUTEX_UNLOCK(x) pthread_mutex_unlock(&x)
@@ -77,34 +84,252 @@ int cache_init(void)
     snprintf(cache_root, sizeof(cache_root), "%s/.cache/disfs/", getenv("HOME"));
     rmtree(cache_root);
     mkdir_p(cache_root);
+    chunk_map_init();
     return 0;
 }
 
 
-/* Fetch mtime of file located on server's endpoint */
-time_t fetch_mtime(const char *path, int user_id)
+/* Fetch size and mtime of file located on server's endpoint, 0 on success.
+ * chunking (optional) is set when the file is stored in content-defined chunks.
+ */
+int fetch_remote_stat(const char *path, int user_id, off_t *size, time_t *mtime, int *chunking)
+{
+    return fetch_remote_stat_if(path, user_id, -1, size, mtime, chunking, NULL);
+}
+
+
+/* fetch_remote_stat, plus the content generation in gen (optional).
+ * With known_gen >= 0 an unchanged file costs no body and returns 1,
+ * leaving the outputs alone.
+ */
+int fetch_remote_stat_if(const char *path, int user_id, int64_t known_gen,
+                         off_t *size, time_t *mtime, int *chunking, int64_t *gen)
 {
     char *esc = url_encode(path);
     if (!esc)
-        return (time_t)-1;
-    
+        return -EIO;
+
+    char url[URL_MAX];
+    snprintf(url, sizeof(url),
+            "%s/stat?user_id=%d&path=%s",
+            get_server_url(), user_id, esc);
+    curl_free(esc);
+
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%" PRId64 "\"", known_gen);
+
+    string_buf_t resp = {0};
+    uint32_t status = 0;
+    int rc = http_get_if(url, known_gen >= 0 ? etag : NULL, &resp, &status);
+    if (rc != 0) {
+        free(resp.ptr);
+        return -ECOMM;
+    }
+    if (status == 304) {
+        free(resp.ptr);
+        return 1;
+    }
+    if (status == 520) {
+        free(resp.ptr);
+        return -ENOENT;
+    }
+    if (status != 201) {
+        free(resp.ptr);
+        return -EIO;
+    }
+
+    cJSON *root = cJSON_Parse(resp.ptr);
+    free(resp.ptr);
+    if (!root)
+        return -EIO;
+
+    cJSON *sz = cJSON_GetObjectItemCaseSensitive(root, "size");
+    cJSON *mt = cJSON_GetObjectItemCaseSensitive(root, "mtime");
+    if (size)
+        *size = cJSON_IsNumber(sz) ? (off_t)sz->valuedouble : 0;
+    if (mtime)
+        *mtime = cJSON_IsNumber(mt) ? (time_t)mt->valuedouble : 0;
+    if (chunking) {
+        cJSON *ck = cJSON_GetObjectItemCaseSensitive(root, "chunking");
+        *chunking = cJSON_IsNumber(ck) ? ck->valueint : 0;
+    }
+    if (gen) {
+        cJSON *g = cJSON_GetObjectItemCaseSensitive(root, "gen");
+        *gen = cJSON_IsNumber(g) ? (int64_t)g->valuedouble : -1;
+    }
+
+    cJSON_Delete(root);
+    return 0;
+}
+
+
+/* The server generation a cache file's bytes belong to rides along in an
+ * xattr, so it follows the file through renames. -1 when unknown, which
+ * includes filesystems without user xattrs.
+ */
+int64_t cache_gen_get(const char *cache_path)
+{
+    char buf[32];
+    ssize_t n = getxattr(cache_path, CACHE_GEN_XATTR, buf, sizeof(buf) - 1);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return strtoll(buf, NULL, 10);
+}
+
+
+void cache_gen_set(const char *cache_path, int64_t gen)
+{
+    if (gen < 0) {
+        cache_gen_clear(cache_path);
+        return;
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%" PRId64, gen);
+    (void)setxattr(cache_path, CACHE_GEN_XATTR, buf, n, 0);
+}
+
+
+/* Local bytes are about to differ from any server generation */
+void cache_gen_clear(const char *cache_path)
+{
+    (void)removexattr(cache_path, CACHE_GEN_XATTR);
+}
+
+
+/* Chunk starts of a file as stored, needed for variable sized chunks.
+ * *offsets (malloc'd) gets n + 1 entries, the last one being the file size.
+ * crcs (optional, malloc'd) gets the CRC-32C of each chunk, -1 if unknown.
+ */
+int fetch_chunk_layout(const char *path, int user_id, off_t **offsets, int64_t **crcs, uint32_t *n)
+{
+    char *esc = url_encode(path);
+    if (!esc)
+        return -EIO;
+
     char url[URL_MAX];
     snprintf(url, sizeof(url),
-            "%s/mtime?user_id=%d&path=%s",
+            "%s/chunk_list?user_id=%d&path=%s",
             get_server_url(), user_id, esc);
     curl_free(esc);
 
     string_buf_t resp = {0};
     uint32_t status = 0;
-    int rc = http_request(url, &resp, &status);
-    if (rc != 0 || status != 201) {
+    if (http_request(url, &resp, &status) != 0) {
+        free(resp.ptr);
+        return -ECOMM;
+    }
+    if (status != 201) {
         free(resp.ptr);
-        return (time_t)-1;
+        return status == 520 ? -ENOENT : -EIO;
     }
 
-    time_t mtime = (time_t)atol(resp.ptr);
+    /* {"sizes": [4194304, 3012345, ...], "crcs": [3735928559, null, ...]} */
+    cJSON *root = cJSON_Parse(resp.ptr);
     free(resp.ptr);
-    return mtime;
+    cJSON *sizes = cJSON_GetObjectItemCaseSensitive(root, "sizes");
+    if (!cJSON_IsArray(sizes)) {
+        cJSON_Delete(root);
+        return -EIO;
+    }
+
+    int count = cJSON_GetArraySize(sizes);
+    off_t *out = malloc((count + 1) * sizeof(off_t));
+    int64_t *sums = crcs ? malloc((count ? count : 1) * sizeof(int64_t)) : NULL;
+    if (!out || (crcs && !sums)) {
+        free(out);
+        free(sums);
+        cJSON_Delete(root);
+        return -ENOMEM;
+    }
+    int i = 0;
+    cJSON *it;
+    out[0] = 0;
+    cJSON_ArrayForEach(it, sizes) {
+        out[i + 1] = out[i] + (cJSON_IsNumber(it) ? (off_t)it->valuedouble : 0);
+        i++;
+    }
+    if (sums) {
+        cJSON *list = cJSON_GetObjectItemCaseSensitive(root, "crcs");
+        for (i = 0; i < count; i++) {
+            cJSON *crc = cJSON_IsArray(list) ? cJSON_GetArrayItem(list, i) : NULL;
+            sums[i] = cJSON_IsNumber(crc) ? (int64_t)crc->valuedouble : -1;
+        }
+        *crcs = sums;
+    }
+    cJSON_Delete(root);
+
+    *offsets = out;
+    *n = count;
+    return 0;
+}
+
+
+/* Points dst at the chunks src is stored in, no bytes move.
+ * dst has to exist, whatever it held is dropped.
+ */
+int clone_remote_file(const char *src, const char *dst, int user_id)
+{
+    char *esc_src = url_encode(src);
+    char *esc_dst = url_encode(dst);
+    if (!esc_src || !esc_dst) {
+        curl_free(esc_src);
+        curl_free(esc_dst);
+        return -EIO;
+    }
+
+    char url[URL_MAX];
+    snprintf(url, sizeof(url),
+            "%s/clone?user_id=%d&src=%s&dst=%s",
+            get_server_url(), user_id, esc_src, esc_dst);
+    curl_free(esc_src);
+    curl_free(esc_dst);
+
+    uint32_t status = 0;
+    if (http_post_status(url, &status) != 0)
+        return -ECOMM;
+    LOGMSG("CLONE STATUS: %d", status);
+    if (status == 520)
+        return -ENOENT;
+    if (status == 409)
+        return -EBUSY;  // source is still being uploaded
+    return status == 201 ? 0 : -EIO;
+}
+
+
+/* Renames file src over the existing file dst in one step on the server.
+ * 0 when replaced, 1 when dst doesn't exist (nothing changed then).
+ */
+int replace_remote_file(const char *src, const char *dst, int user_id)
+{
+    char *esc_src = url_encode(src);
+    char *esc_dst = url_encode(dst);
+    if (!esc_src || !esc_dst) {
+        curl_free(esc_src);
+        curl_free(esc_dst);
+        return -EIO;
+    }
+
+    char url[URL_MAX];
+    snprintf(url, sizeof(url),
+            "%s/replace?user_id=%d&a=%s&b=%s",
+            get_server_url(), user_id, esc_src, esc_dst);
+    curl_free(esc_src);
+    curl_free(esc_dst);
+
+    uint32_t status = 0;
+    if (http_post_status(url, &status) != 0)
+        return -ECOMM;
+    LOGMSG("REPLACE STATUS: %d", status);
+    if (status == 404)
+        return 1;
+    if (status == 520)
+        return -ENOENT;
+    if (status == 400)
+        return -EISDIR;  // one side is a directory
+    if (status == 409)
+        return -EBUSY;   // source is still being uploaded
+    return status == 201 ? 0 : -EIO;
 }
 
 
@@ -223,6 +448,7 @@ void cache_exit(void)
     cached_file_count = 0;
     MUTEX_UNLOCK(cache_lock);
 
+    chunk_map_exit();
     rmtree(cache_root);
 }
 
@@ -262,32 +488,59 @@ int cache_record_append(const char *path, off_t size, int current_user_id)
 }
 
 
-/* Pop oldest cache entry from list */
-void cache_record_pop()
+/* 1 if the cache file still holds bytes the server lacks: it's open,
+ * queued for upload, or its create hasn't been confirmed yet.
+ */
+static int _cache_pinned(const char *cache_path, const char *root, size_t root_len,
+                         int current_user_id)
+{
+    if (open_file_busy(cache_path) || upload_queue_busy(cache_path))
+        return 1;
+    if (strncmp(cache_path, root, root_len) != 0)
+        return 0;
+    return meta_log_pending(current_user_id, cache_path + root_len);
+}
+
+/* Pop oldest cache entry from list, skipping pinned ones.
+ * Returns 0 if something was evicted.
+ */
+int cache_record_pop(int current_user_id)
 {
+    char root[PATH_MAX];
+    BUILD_CACHE_PATH(root, current_user_id, "");
+    size_t root_len = strlen(root);
+
     MUTEX_LOCK(cache_lock);
 
-    if (!head) {
+    cache_t *victim = head;
+    while (victim && _cache_pinned(victim->path, root, root_len, current_user_id))
+        victim = victim->next;
+
+    if (!victim) {
         MUTEX_UNLOCK(cache_lock);
-        return;
+        return -1;
     }
 
-    cache_t *next = head->next;
-    if (next)
-        next->prev = NULL;
+    if (victim->prev)
+        victim->prev->next = victim->next;
+    else
+        head = victim->next;
+    if (victim->next)
+        victim->next->prev = victim->prev;
     else
-        tail = NULL;
+        tail = victim->prev;
 
-    LOGMSG("[GC] popping cache %s", head->path);
+    LOGMSG("[GC] popping cache %s", victim->path);
 
-    used_bytes -= head->size;
+    used_bytes -= victim->size;
     cached_file_count--;
-    unlink(head->path);
-    free(head->path);
-    free(head);
-    head = next;
+    chunk_map_drop(victim->path);
+    unlink(victim->path);
+    free(victim->path);
+    free(victim);
 
     MUTEX_UNLOCK(cache_lock);
+    return 0;
 }
 
 /* Delete cache_t entry with exact path, compares only path when size < 0 */
@@ -415,6 +668,7 @@ void cache_garbage_collection(int current_user_id)
 {
     while (used_bytes > max_bytes) {
         LOGMSG("[GC] overflow detected, booting earliest cache.");
-        cache_record_pop(current_user_id);
+        if (cache_record_pop(current_user_id) != 0)
+            break;  // everything left is dirty or uploading
     }
 }
\ No newline at end of file
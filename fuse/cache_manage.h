@@ -17,6 +17,8 @@
 #define CACHE_RM_CACHELOGS (1 << 1)
 #define CACHE_RM_IGNORE_ENOENT (1 << 2)
 
+#define CACHE_GEN_XATTR "user.disfs.gen"
+
 
 extern char project_root[PATH_MAX];
 
@@ -39,14 +41,22 @@ typedef struct cache_entry_node {
 } cache_t;
 
 
-time_t fetch_mtime(const char *path, int user_id);
+int fetch_remote_stat(const char *path, int user_id, off_t *size, time_t *mtime, int *chunking);
+int fetch_remote_stat_if(const char *path, int user_id, int64_t known_gen,
+                         off_t *size, time_t *mtime, int *chunking, int64_t *gen);
+int fetch_chunk_layout(const char *path, int user_id, off_t **offsets, int64_t **crcs, uint32_t *n);
+int clone_remote_file(const char *src, const char *dst, int user_id);
+int replace_remote_file(const char *src, const char *dst, int user_id);
+int64_t cache_gen_get(const char *cache_path);
+void cache_gen_set(const char *cache_path, int64_t gen);
+void cache_gen_clear(const char *cache_path);
 
 int rmtree(const char *dir_path);
 int cache_init(void);
 void cache_exit(void);
 int cache_record_append(const char *path, off_t size, int current_user_id);
 int cache_record_delete(const char *path, int current_user_id, off_t size);
-void cache_record_pop();
+int cache_record_pop(int current_user_id);
 int cache_record_rename(const char *from_path, const char *to_path, off_t size);
 int cache_remove_subtree(const char *path, int current_user_id, unsigned flags);
 void update_cache_status(void);
@@ -0,0 +1,646 @@
+#include "chunk_map.h"
+#include "prefetch.h"
+#include "crc32c.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAP_BUCKETS 64
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t build_cond = PTHREAD_COND_INITIALIZER;  // a build finished
+static chunk_map_t *table[MAP_BUCKETS];
+
+/* Placeholders for maps being built outside table_lock, guarded by it.
+ * Opening, dropping or moving the same path waits for the build.
+ */
+typedef struct map_build {
+    const char *cache_path;
+    struct map_build *next;
+} map_build_t;
+static map_build_t *building;
+static int download_streams = DOWNLOAD_STREAMS_DEFAULT;
+
+
+static void _map_free(chunk_map_t *m)
+{
+    if (m->prefetched) {
+        uint32_t unread = 0;
+        for (uint32_t i = 0; i < (m->n_chunks + 7) / 8; i++)
+            unread += __builtin_popcount(m->prefetched[i]);
+        prefetch_account_waste(unread);
+    }
+    if (m->fd >= 0)
+        close(m->fd);
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+    free(m->present);
+    free(m->fetching);
+    free(m->prefetched);
+    free(m->offsets);
+    free(m->cache_path);
+    free(m);
+}
+
+/* Unlinks entry from table, caller must hold table_lock. Returns the entry */
+static chunk_map_t *_table_remove(const char *cache_path)
+{
+    chunk_map_t **indirect = &table[path_hash(cache_path) % MAP_BUCKETS];
+    while (*indirect) {
+        chunk_map_t *cur = *indirect;
+        if (strcmp(cur->cache_path, cache_path) == 0) {
+            *indirect = cur->next;
+            cur->next = NULL;
+            return cur;
+        }
+        indirect = &cur->next;
+    }
+    return NULL;
+}
+
+static void _table_insert(chunk_map_t *m)
+{
+    unsigned b = path_hash(m->cache_path) % MAP_BUCKETS;
+    m->next = table[b];
+    table[b] = m;
+}
+
+
+/* Tunables: DISFS_DOWNLOAD_STREAMS, parallel chunk GETs per fetch */
+void chunk_map_init(void)
+{
+    long streams = env_long("DISFS_DOWNLOAD_STREAMS", DOWNLOAD_STREAMS_DEFAULT);
+    download_streams = streams > 0 ? (int)streams : 1;
+}
+
+
+static chunk_map_t *_table_find(const char *cache_path)
+{
+    chunk_map_t *m = table[path_hash(cache_path) % MAP_BUCKETS];
+    while (m && strcmp(m->cache_path, cache_path) != 0)
+        m = m->next;
+    return m;
+}
+
+
+static int _copy_range(int from, int to, off_t offset, size_t len, char *buf)
+{
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < HASH_READ_SIZE ? len - done : HASH_READ_SIZE;
+        ssize_t n = pread(from, buf, want, offset + done);
+        if (n <= 0 || pwrite(to, buf, n, offset + done) != n)
+            return -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+
+/* Carries the chunks of the stale cache file at cache_path over into m->fd
+ * when their CRC-32C matches the remote one (crcs[i], -1 if unknown), so
+ * only the chunks that changed get downloaded. Returns how many were kept.
+ */
+static uint32_t _map_reuse(chunk_map_t *m, const char *cache_path, const int64_t *crcs)
+{
+    int old = open(cache_path, O_RDONLY);
+    if (old < 0)
+        return 0;
+
+    struct stat st;
+    char *buf = malloc(HASH_READ_SIZE);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; buf && i < m->n_chunks && fstat(old, &st) == 0; i++) {
+        off_t start = chunk_map_start(m, i);
+        size_t len = chunk_map_start(m, i + 1) - start;
+        uint32_t crc = 0;
+        if (crcs[i] < 0 || start + (off_t)len > st.st_size ||
+            crc32c_file_range(old, start, len, &crc) != 0 || crc != (uint32_t)crcs[i])
+            continue;
+        if (_copy_range(old, m->fd, start, len, buf) != 0)
+            continue;
+        BIT_SET(m->present, i);
+        kept++;
+    }
+    free(buf);
+    close(old);
+    return kept;
+}
+
+
+/* Builds a sparse `size` byte file beside cache_path, at tmp, for _map_publish
+ * to rename into place, so nobody ever sees a half set up cache file.
+ * Runs without table_lock, copying kept chunks can take a while.
+ * With crcs, unchanged chunks of the file it replaces are kept.
+ */
+static chunk_map_t *_map_build(const char *cache_path, off_t size, time_t mtime, int64_t gen,
+                               const off_t *offsets, const int64_t *crcs, uint32_t n_chunks,
+                               char *tmp, size_t tmp_size)
+{
+    chunk_map_t *m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    if (offsets) {
+        m->n_chunks = n_chunks;
+        m->offsets = malloc((n_chunks + 1) * sizeof(off_t));
+        if (!m->offsets) {
+            free(m);
+            return NULL;
+        }
+        memcpy(m->offsets, offsets, (n_chunks + 1) * sizeof(off_t));
+    } else {
+        m->n_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+    size_t bytes = (m->n_chunks + 7) / 8;
+    m->present = calloc(bytes ? bytes : 1, 1);
+    m->fetching = calloc(bytes ? bytes : 1, 1);
+    m->prefetched = calloc(bytes ? bytes : 1, 1);
+    m->cache_path = strdup(cache_path);
+    m->fd = -1;
+    if (!m->present || !m->fetching || !m->prefetched || !m->cache_path) {
+        _map_free(m);
+        return NULL;
+    }
+
+    snprintf(tmp, tmp_size, "%s.part.XXXXXX", cache_path);
+    m->fd = mkstemp(tmp);
+    if (m->fd < 0) {
+        _map_free(m);
+        return NULL;
+    }
+    m->size = size;
+
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    if (fchmod(m->fd, 0644) != 0 || ftruncate(m->fd, size) != 0) {
+        unlink(tmp);
+        _map_free(m);
+        return NULL;
+    }
+    uint32_t kept = crcs && m->n_chunks == n_chunks ? _map_reuse(m, cache_path, crcs) : 0;
+    if (kept)
+        LOGMSG("[MAP] %u/%u chunk(s) of %s unchanged, kept", kept, m->n_chunks, cache_path);
+    if (futimens(m->fd, times) != 0) {
+        unlink(tmp);
+        _map_free(m);
+        return NULL;
+    }
+
+    m->mtime = mtime;
+    m->gen = gen;
+    m->complete = (kept == m->n_chunks);
+    m->refs = 1;  // table
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    return m;
+}
+
+
+/* 1 if m was built for the remote version (size, mtime, gen). Two versions
+ * can share size and mtime second, so the generation decides when both
+ * sides know it */
+static int _map_matches(const chunk_map_t *m, off_t size, time_t mtime, int64_t gen)
+{
+    if (m->size != size)
+        return 0;
+    if (gen >= 0 && m->gen >= 0)
+        return m->gen == gen;
+    return m->mtime == mtime;
+}
+
+
+/* 1 while a map at or below dir is being built, caller holds table_lock */
+static int _building_under(const char *dir)
+{
+    size_t len = strlen(dir);
+    for (map_build_t *b = building; b; b = b->next) {
+        if (path_under(b->cache_path, dir, len))
+            return 1;
+    }
+    return 0;
+}
+
+/* Waits out builds at or below a or b (optional), caller holds table_lock */
+static void _wait_builds(const char *a, const char *b)
+{
+    while (_building_under(a) || (b && _building_under(b)))
+        pthread_cond_wait(&build_cond, &table_lock);
+}
+
+/* Puts m's file in place of its cache path and m in the table, caller holds
+ * table_lock. The map it replaced goes to old. On failure m is freed.
+ */
+static int _map_publish(chunk_map_t *m, const char *tmp, chunk_map_t **old)
+{
+    if (rename(tmp, m->cache_path) != 0) {
+        int err = -errno;
+        unlink(tmp);
+        _map_free(m);
+        return err;
+    }
+    *old = _table_remove(m->cache_path);
+    _table_insert(m);
+    return 0;
+}
+
+
+/* Map for the remote version (size, mtime, gen) of cache_path, with a reference.
+ * The first opener of a cold file sets up the sparse cache file, everyone
+ * opening the same version after that shares its map and its fetches.
+ * The build runs outside table_lock, only openers of the same path wait on it.
+ * offsets (n_chunks + 1 entries, copied) describes a variable chunk layout,
+ * NULL means CHUNK_SIZE chunks. crcs (n_chunks entries, optional) are the
+ * remote chunk checksums, chunks of an older cache file matching them are kept.
+ */
+chunk_map_t *chunk_map_open(const char *cache_path, off_t size, time_t mtime, int64_t gen,
+                            const off_t *offsets, const int64_t *crcs, uint32_t n_chunks)
+{
+    if (offsets && (n_chunks == 0 || offsets[0] != 0 || offsets[n_chunks] != size))
+        offsets = NULL;  // layout doesn't describe this version, don't trust it
+
+    pthread_mutex_lock(&table_lock);
+    _wait_builds(cache_path, NULL);
+    chunk_map_t *m = _table_find(cache_path);
+    if (m && _map_matches(m, size, mtime, gen)) {
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&table_lock);
+        return m;
+    }
+    map_build_t self = { .cache_path = cache_path, .next = building };
+    building = &self;
+    pthread_mutex_unlock(&table_lock);
+
+    char tmp[PATH_MAX];
+    m = _map_build(cache_path, size, mtime, gen, offsets, crcs, n_chunks, tmp, sizeof(tmp));
+
+    pthread_mutex_lock(&table_lock);
+    map_build_t **indirect = &building;
+    while (*indirect != &self)
+        indirect = &(*indirect)->next;
+    *indirect = self.next;
+
+    chunk_map_t *old = NULL;
+    if (m && _map_publish(m, tmp, &old) != 0)
+        m = NULL;
+    if (m)
+        m->refs++;  // caller
+    pthread_cond_broadcast(&build_cond);
+    pthread_mutex_unlock(&table_lock);
+
+    chunk_map_put(old);
+    if (m)
+        LOGMSG("[MAP] sparse cache %s, size=%jd, chunks=%u",
+               cache_path, (intmax_t)size, m->n_chunks);
+    return m;
+}
+
+
+/* Returns referenced map of cache_path, NULL means the cache file is complete */
+chunk_map_t *chunk_map_get(const char *cache_path)
+{
+    pthread_mutex_lock(&table_lock);
+    chunk_map_t *m = _table_find(cache_path);
+    if (m)
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&table_lock);
+    return m;
+}
+
+
+/* Extra reference for a map the caller already holds */
+void chunk_map_hold(chunk_map_t *map)
+{
+    __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void chunk_map_put(chunk_map_t *map)
+{
+    if (!map)
+        return;
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        _map_free(map);
+}
+
+
+/* Downloads chunks idx[0..n) straight into the cache file, rcs[i] per chunk */
+static void _fetch_many(chunk_map_t *m, const char *path, int user_id,
+                        const uint32_t *idx, int *rcs, int n)
+{
+    chunk_req_t *reqs = calloc(n, sizeof(chunk_req_t));
+    char *esc = url_encode(path);
+    if (!reqs || !esc) {
+        for (int i = 0; i < n; i++)
+            rcs[i] = -EIO;
+        free(reqs);
+        curl_free(esc);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        snprintf(reqs[i].url, sizeof(reqs[i].url),
+                "%s/download_chunk?user_id=%d&path=%s&chunk=%u",
+                get_server_url(), user_id, esc, idx[i]);
+        reqs[i].offset = chunk_map_start(m, idx[i]);
+        reqs[i].expect = chunk_map_start(m, idx[i] + 1) - reqs[i].offset;
+    }
+    curl_free(esc);
+
+    http_get_chunks_multi(reqs, n, m->fd, download_streams);
+    for (int i = 0; i < n; i++)
+        rcs[i] = reqs[i].rc;
+    LOGMSG("[MAP] fetched %d chunk(s) of %s from %u over %d stream(s)",
+           n, path, idx[0], download_streams);
+    free(reqs);
+}
+
+
+/* Makes sure every chunk covering [offset, offset + size) is present locally.
+ * Missing chunks are pulled in parallel, chunks someone else is already
+ * fetching are waited on instead of downloaded twice.
+ */
+int chunk_map_fetch(chunk_map_t *m, const char *path, int user_id, off_t offset, size_t size)
+{
+    if (!m || size == 0)
+        return 0;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->complete || offset >= m->size) {
+        pthread_mutex_unlock(&m->lock);
+        return 0;
+    }
+    off_t end = offset + (off_t)size;
+    if (end > m->size)
+        end = m->size;
+    uint32_t first = chunk_map_index(m, offset);
+    uint32_t last = chunk_map_index(m, end - 1);
+    uint32_t span = last - first + 1;
+
+    uint32_t *todo = malloc(span * sizeof(uint32_t));
+    int *rcs = malloc(span * sizeof(int));
+    if (!todo || !rcs) {
+        pthread_mutex_unlock(&m->lock);
+        free(todo);
+        free(rcs);
+        return -ENOMEM;
+    }
+
+    /* Second round picks up chunks whose other fetcher failed */
+    int returner = 0, missing = 0;
+    for (int round = 0; round < 2 && returner == 0; round++) {
+        int n = 0;
+        for (uint32_t i = first; i <= last; i++) {
+            if (!BIT_TEST(m->present, i) && !BIT_TEST(m->fetching, i)) {
+                BIT_SET(m->fetching, i);
+                todo[n++] = i;
+            }
+        }
+
+        if (n) {
+            pthread_mutex_unlock(&m->lock);
+            _fetch_many(m, path, user_id, todo, rcs, n);
+            pthread_mutex_lock(&m->lock);
+
+            for (int i = 0; i < n; i++) {
+                BIT_CLEAR(m->fetching, todo[i]);
+                if (rcs[i] == 0)
+                    BIT_SET(m->present, todo[i]);
+                else if (returner == 0)
+                    returner = rcs[i];
+            }
+            pthread_cond_broadcast(&m->cond);
+        }
+
+        missing = 0;
+        for (uint32_t i = first; i <= last; i++) {
+            while (BIT_TEST(m->fetching, i))
+                pthread_cond_wait(&m->cond, &m->lock);
+            if (!BIT_TEST(m->present, i))
+                missing = 1;
+        }
+        if (!missing)
+            break;
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    free(todo);
+    free(rcs);
+    if (returner == 0 && missing)
+        returner = -EIO;
+    return returner;
+}
+
+
+/* Cache file holds everything it needs from now on (e.g. after a truncate) */
+void chunk_map_set_complete(chunk_map_t *m)
+{
+    if (!m)
+        return;
+    pthread_mutex_lock(&m->lock);
+    m->complete = 1;
+    pthread_mutex_unlock(&m->lock);
+}
+
+
+/* Resizes a bitmap from old_n to n bits. Bits past the end are cleared on
+ * shrink, so growing again starts out with zeros.
+ */
+static int _bitmap_resize(uint8_t **bits, uint32_t old_n, uint32_t n)
+{
+    if (BITMAP_BYTES(n) > BITMAP_BYTES(old_n)) {
+        uint8_t *grown = realloc(*bits, BITMAP_BYTES(n));
+        if (!grown)
+            return -ENOMEM;
+        memset(grown + BITMAP_BYTES(old_n), 0, BITMAP_BYTES(n) - BITMAP_BYTES(old_n));
+        *bits = grown;
+    }
+    for (uint32_t i = n; i < old_n; i++)
+        BIT_CLEAR(*bits, i);
+    return 0;
+}
+
+
+/* Follows a truncate the server already applied, cutting or growing the
+ * cache file and the map with it. Kept chunks stay as they are, the one
+ * holding the new end matches the server's rewrite once cut. Chunks past
+ * the old end are holes on the server and the zeros ftruncate leaves
+ * here match them, content-defined layouts get them in CHUNK_SIZE pieces.
+ */
+int chunk_map_truncate(chunk_map_t *m, off_t size, time_t mtime)
+{
+    pthread_mutex_lock(&m->lock);
+
+    /* A fetch landing past the new end would grow the file back */
+    for (;;) {
+        int busy = 0;
+        for (uint32_t i = 0; i < BITMAP_BYTES(m->n_chunks) && !busy; i++)
+            busy = m->fetching[i] != 0;
+        if (!busy)
+            break;
+        pthread_cond_wait(&m->cond, &m->lock);
+    }
+
+    uint32_t n;
+    if (!m->offsets)
+        n = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    else if (size <= m->size)
+        n = size > 0 ? chunk_map_index(m, size - 1) + 1 : 0;
+    else
+        n = m->n_chunks + (size - m->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    int rc = 0;
+    if (m->offsets) {
+        off_t *grown = realloc(m->offsets, (n + 1) * sizeof(off_t));
+        if (!grown) {
+            rc = -ENOMEM;
+        } else {
+            m->offsets = grown;
+            for (uint32_t i = m->n_chunks; i < n; i++)
+                m->offsets[i + 1] = m->offsets[i] + CHUNK_SIZE < size ? m->offsets[i] + CHUNK_SIZE : size;
+            m->offsets[n] = size;
+        }
+    }
+    if (rc == 0)
+        rc = _bitmap_resize(&m->present, m->n_chunks, n);
+    if (rc == 0)
+        rc = _bitmap_resize(&m->fetching, m->n_chunks, n);
+    if (rc == 0)
+        rc = _bitmap_resize(&m->prefetched, m->n_chunks, n);
+    /* Old last chunk of a fixed layout was padded on the server, it keeps its bit */
+    for (uint32_t i = m->n_chunks; rc == 0 && i < n; i++)
+        BIT_SET(m->present, i);
+
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    if (rc == 0 && (ftruncate(m->fd, size) != 0 || futimens(m->fd, times) != 0))
+        rc = -errno;
+    if (rc == 0) {
+        m->size = size;
+        m->mtime = mtime;
+        m->gen = -1;  // the server's new one isn't known here
+        m->n_chunks = n;
+    }
+    pthread_mutex_unlock(&m->lock);
+    return rc;
+}
+
+
+void chunk_map_drop(const char *cache_path)
+{
+    pthread_mutex_lock(&table_lock);
+    _wait_builds(cache_path, NULL);
+    chunk_map_t *m = _table_remove(cache_path);
+    pthread_mutex_unlock(&table_lock);
+    chunk_map_put(m);
+}
+
+
+/* Pulls every map at or below dir out of the table into a list */
+static chunk_map_t *_table_take_prefix(const char *dir)
+{
+    size_t len = strlen(dir);
+    chunk_map_t *taken = NULL;
+    for (int b = 0; b < MAP_BUCKETS; b++) {
+        chunk_map_t **indirect = &table[b];
+        while (*indirect) {
+            chunk_map_t *cur = *indirect;
+            if (path_under(cur->cache_path, dir, len)) {
+                *indirect = cur->next;
+                cur->next = taken;
+                taken = cur;
+                continue;
+            }
+            indirect = &cur->next;
+        }
+    }
+    return taken;
+}
+
+/* Re-inserts maps taken from `from`, keyed under `to` instead */
+static void _table_rekey(chunk_map_t *list, const char *from, const char *to)
+{
+    size_t len = strlen(from);
+    while (list) {
+        chunk_map_t *next = list->next;
+        char moved[PATH_MAX];
+        snprintf(moved, sizeof(moved), "%s%s", to, list->cache_path + len);
+        char *dup = strdup(moved);
+        if (dup) {
+            free(list->cache_path);
+            list->cache_path = dup;
+            _table_insert(list);
+        } else {
+            chunk_map_put(list);  // can't track it, forget it
+        }
+        list = next;
+    }
+}
+
+static void _put_list(chunk_map_t *list)
+{
+    while (list) {
+        chunk_map_t *next = list->next;
+        chunk_map_put(list);
+        list = next;
+    }
+}
+
+
+/* Drops every map at or below cache_dir */
+void chunk_map_drop_prefix(const char *cache_dir)
+{
+    pthread_mutex_lock(&table_lock);
+    _wait_builds(cache_dir, NULL);
+    chunk_map_t *victims = _table_take_prefix(cache_dir);
+    pthread_mutex_unlock(&table_lock);
+    _put_list(victims);
+}
+
+
+/* Follows a file or directory rename */
+void chunk_map_rename(const char *from_cache, const char *to_cache)
+{
+    pthread_mutex_lock(&table_lock);
+    _wait_builds(from_cache, to_cache);
+    chunk_map_t *replaced = _table_take_prefix(to_cache);
+    chunk_map_t *moved = _table_take_prefix(from_cache);
+    _table_rekey(moved, from_cache, to_cache);
+    pthread_mutex_unlock(&table_lock);
+    _put_list(replaced);
+}
+
+
+void chunk_map_swap(const char *a_cache, const char *b_cache)
+{
+    pthread_mutex_lock(&table_lock);
+    _wait_builds(a_cache, b_cache);
+    chunk_map_t *a = _table_take_prefix(a_cache);
+    chunk_map_t *b = _table_take_prefix(b_cache);
+    _table_rekey(a, a_cache, b_cache);
+    _table_rekey(b, b_cache, a_cache);
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+void chunk_map_exit(void)
+{
+    pthread_mutex_lock(&table_lock);
+    for (int b = 0; b < MAP_BUCKETS; b++) {
+        chunk_map_t *cur = table[b];
+        while (cur) {
+            chunk_map_t *next = cur->next;
+            cur->next = NULL;
+            chunk_map_put(cur);
+            cur = next;
+        }
+        table[b] = NULL;
+    }
+    pthread_mutex_unlock(&table_lock);
+}
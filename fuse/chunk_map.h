@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+#define DOWNLOAD_STREAMS_DEFAULT 4
+
+/* Per cache file record of which chunks are present locally. Chunks are
+ * CHUNK_SIZE aligned, unless the file was stored by the content-defined
+ * chunker, then offsets holds where each one starts.
+ * Cache files without a map are considered complete.
+ * One reference is held by the table, one by each fh_t pointing at it.
+ */
+typedef struct chunk_map {
+    char *cache_path;
+    int fd;                 // O_RDWR, chunks are pwrite'd through this
+    off_t size;             // remote size when the map was created
+    time_t mtime;           // remote mtime when the map was created
+    int64_t gen;            // remote content generation, -1 if unknown
+    uint32_t n_chunks;
+    off_t *offsets;         // n_chunks + 1 entries, NULL for fixed chunks
+    int complete;           // nothing left to fetch
+    uint8_t *present;       // bitmap, 1 bit per chunk
+    uint8_t *fetching;      // bitmap, chunk download in flight
+    uint8_t *prefetched;    // bitmap, fetched ahead and not read yet
+    int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signaled whenever a fetch finishes
+    struct chunk_map *next;
+} chunk_map_t;
+
+/* Chunk i covers [chunk_map_start(m, i), chunk_map_start(m, i + 1)) */
+static inline off_t chunk_map_start(const chunk_map_t *m, uint32_t i)
+{
+    if (m->offsets)
+        return m->offsets[i];
+    off_t start = (off_t)i * CHUNK_SIZE;
+    return start < m->size ? start : m->size;
+}
+
+/* Index of the chunk holding byte off, off < m->size */
+static inline uint32_t chunk_map_index(const chunk_map_t *m, off_t off)
+{
+    if (!m->offsets)
+        return off / CHUNK_SIZE;
+    uint32_t lo = 0, hi = m->n_chunks - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (m->offsets[mid] <= off)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+
+void chunk_map_init(void);
+chunk_map_t *chunk_map_open(const char *cache_path, off_t size, time_t mtime, int64_t gen,
+                            const off_t *offsets, const int64_t *crcs, uint32_t n_chunks);
+chunk_map_t *chunk_map_get(const char *cache_path);
+void chunk_map_hold(chunk_map_t *map);
+void chunk_map_put(chunk_map_t *map);
+
+int chunk_map_fetch(chunk_map_t *map, const char *path, int user_id, off_t offset, size_t size);
+void chunk_map_set_complete(chunk_map_t *map);
+int chunk_map_truncate(chunk_map_t *map, off_t size, time_t mtime);
+
+void chunk_map_drop(const char *cache_path);
+void chunk_map_drop_prefix(const char *cache_dir);
+void chunk_map_rename(const char *from_cache, const char *to_cache);
+void chunk_map_swap(const char *a_cache, const char *b_cache);
+void chunk_map_exit(void);
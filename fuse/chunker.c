@@ -0,0 +1,134 @@
+#include "chunker.h"
+#include "crc32c.h"
+#include <openssl/evp.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define CDC_READ_SIZE (1024 * 1024)
+
+/* Normalized chunking: harder cut condition below the average size, easier above */
+#define CDC_MASK_S (~0ULL << (64 - (CDC_AVG_BITS + 2)))
+#define CDC_MASK_L (~0ULL << (64 - (CDC_AVG_BITS - 2)))
+
+static uint64_t gear[256];
+static int use_cdc;
+
+
+/* splitmix64, the table has to come out the same on every client */
+static uint64_t _next_gear(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Tunables: DISFS_CHUNKER=cdc switches uploads to content-defined chunks */
+void chunker_init(void)
+{
+    uint64_t state = 0x6469736673636463ULL;
+    for (int i = 0; i < 256; i++)
+        gear[i] = _next_gear(&state);
+
+    const char *mode = getenv("DISFS_CHUNKER");
+    use_cdc = mode && strcmp(mode, "cdc") == 0;
+    LOGMSG("[CDC] chunker: %s", use_cdc ? "content-defined" : "fixed");
+}
+
+
+int cdc_enabled(void)
+{
+    return use_cdc;
+}
+
+
+static void _finish_hash(EVP_MD_CTX *ctx, uint32_t *crc, chunk_hash_t *out)
+{
+    out->crc = *crc;
+    *crc = 0;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx, md, &len);
+    for (unsigned int i = 0; i < len && i < 32; i++)
+        snprintf(out->hex + 2 * i, 3, "%02x", md[i]);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+}
+
+
+/* Splits fd's first `size` bytes with a FastCDC gear hash.
+ * *offsets_out gets n + 1 chunk starts (last one == size), *hashes_out the
+ * SHA-256 (and CRC-32C) of every chunk, so unchanged chunks can be
+ * recognized wherever they moved. Both are malloc'd, 0 on success.
+ */
+int cdc_split(int fd, off_t size, off_t **offsets_out, chunk_hash_t **hashes_out, uint32_t *n_out)
+{
+    uint32_t cap = size / CDC_MIN_SIZE + 2;
+    off_t *offsets = malloc((cap + 1) * sizeof(off_t));
+    chunk_hash_t *hashes = malloc(cap * sizeof(chunk_hash_t));
+    uint8_t *buf = malloc(CDC_READ_SIZE);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!offsets || !hashes || !buf || !ctx ||
+        !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        free(offsets);
+        free(hashes);
+        free(buf);
+        EVP_MD_CTX_free(ctx);
+        return -ENOMEM;
+    }
+
+    uint32_t n = 0;
+    off_t pos = 0, start = 0;
+    uint64_t h = 0;
+    uint32_t crc = 0;
+    offsets[0] = 0;
+
+    while (pos < size) {
+        size_t want = size - pos < CDC_READ_SIZE ? size - pos : CDC_READ_SIZE;
+        ssize_t got = pread(fd, buf, want, pos);
+        if (got <= 0) {
+            free(offsets);
+            free(hashes);
+            free(buf);
+            EVP_MD_CTX_free(ctx);
+            return -EIO;
+        }
+
+        ssize_t seg = 0;  // first byte of buf not fed to the digest yet
+        for (ssize_t i = 0; i < got; i++) {
+            h = (h << 1) + gear[buf[i]];
+
+            off_t len = pos + i + 1 - start;
+            if (len < CDC_MIN_SIZE)
+                continue;
+            uint64_t mask = len < (1 << CDC_AVG_BITS) ? CDC_MASK_S : CDC_MASK_L;
+            if ((h & mask) != 0 && len < CDC_MAX_SIZE)
+                continue;
+
+            EVP_DigestUpdate(ctx, buf + seg, i + 1 - seg);
+            crc = crc32c_update(crc, buf + seg, i + 1 - seg);
+            _finish_hash(ctx, &crc, &hashes[n]);
+            seg = i + 1;
+            start += len;
+            offsets[++n] = start;
+            h = 0;
+        }
+        EVP_DigestUpdate(ctx, buf + seg, got - seg);
+        crc = crc32c_update(crc, buf + seg, got - seg);
+        pos += got;
+    }
+
+    /* Tail shorter than a cut */
+    if (start < size) {
+        _finish_hash(ctx, &crc, &hashes[n]);
+        offsets[++n] = size;
+    }
+    free(buf);
+    EVP_MD_CTX_free(ctx);
+
+    *offsets_out = offsets;
+    *hashes_out = hashes;
+    *n_out = n;
+    return 0;
+}
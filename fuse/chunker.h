@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+/* Content-defined chunk bounds, max can't exceed what one message holds */
+#define CDC_MIN_SIZE (1 * 1024 * 1024)
+#define CDC_AVG_BITS 22                 // 4 MiB average
+#define CDC_MAX_SIZE CHUNK_SIZE
+
+
+void chunker_init(void);
+int cdc_enabled(void);
+int cdc_split(int fd, off_t size, off_t **offsets_out, chunk_hash_t **hashes_out, uint32_t *n_out);
@@ -0,0 +1,60 @@
+#include "compress.h"
+#include <zstd.h>
+#include <errno.h>
+#include <stdlib.h>
+
+static int use_zstd;
+static int level;
+
+
+/* Tunables: DISFS_COMPRESS=zstd, DISFS_COMPRESS_LEVEL */
+void compress_init(void)
+{
+    const char *mode = getenv("DISFS_COMPRESS");
+    use_zstd = mode && strcmp(mode, "zstd") == 0;
+    level = (int)env_long("DISFS_COMPRESS_LEVEL", COMPRESS_LEVEL_DEFAULT);
+    LOGMSG("[ZSTD] upload compression: %s (level %d)", use_zstd ? "zstd" : "off", level);
+}
+
+
+int compress_enabled(void)
+{
+    return use_zstd;
+}
+
+
+/* Compresses one chunk into dst. Returns the compressed length, or 0 when
+ * the chunk should go raw: a quick pass over a sample says it won't
+ * shrink, or the whole of it doesn't fit in cap.
+ */
+size_t chunk_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    if (!use_zstd || len == 0)
+        return 0;
+
+    /* Already compressed media and archives bail out here cheaply */
+    if (len > COMPRESS_SAMPLE_SIZE) {
+        size_t probe = ZSTD_compress(dst, cap, src, COMPRESS_SAMPLE_SIZE, 1);
+        if (ZSTD_isError(probe) || probe * 100 >= (size_t)COMPRESS_SAMPLE_SIZE * COMPRESS_SAMPLE_RATIO)
+            return 0;
+    }
+
+    /* Anything short of saving a few percent isn't worth a decode on read */
+    size_t limit = len - len / 32;
+    size_t n = ZSTD_compress(dst, limit < cap ? limit : cap, src, len, level);
+    if (ZSTD_isError(n))
+        return 0;
+    return n;
+}
+
+
+/* 0 if src decodes to exactly raw_len bytes in dst, else -EIO */
+int chunk_decompress(const void *src, size_t len, void *dst, size_t raw_len)
+{
+    size_t n = ZSTD_decompress(dst, raw_len, src, len);
+    if (ZSTD_isError(n) || n != raw_len) {
+        LOGMSG("[ZSTD] bad chunk: %s", ZSTD_isError(n) ? ZSTD_getErrorName(n) : "short");
+        return -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stddef.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+#define COMPRESS_LEVEL_DEFAULT 3
+#define COMPRESS_SAMPLE_SIZE (64 * 1024)   // probed before a chunk is compressed whole
+#define COMPRESS_SAMPLE_RATIO 90           // sample has to shrink below this %, else raw
+
+/* Per-chunk codecs, as named on the wire and numbered in file_chunks.codec */
+#define CODEC_RAW 0
+#define CODEC_ZSTD 1
+#define CODEC_HOLE 2    // download only: no body, the chunk is all zeros
+
+
+void compress_init(void);
+int compress_enabled(void);
+size_t chunk_compress(const void *src, size_t len, void *dst, size_t cap);
+int chunk_decompress(const void *src, size_t len, void *dst, size_t raw_len);
@@ -0,0 +1,107 @@
+#include "crc32c.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#define CRC32C_POLY 0x82f63b78u   // Castagnoli, bit reflected
+
+static uint32_t table[8][256];
+static int use_hw;
+
+
+#if defined(__x86_64__)
+/* SSE4.2 crc32 instruction, 8 bytes per step */
+__attribute__((target("sse4.2")))
+static uint32_t _crc_hw(uint32_t c, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+        len--;
+    }
+    uint64_t c64 = c;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = __builtin_ia32_crc32di(c64, v);
+        p += 8;
+        len -= 8;
+    }
+    c = (uint32_t)c64;
+    while (len--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+
+/* Slicing-by-8, for CPUs without the instruction */
+static uint32_t _crc_sw(uint32_t c, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        c ^= p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        c = table[7][c & 0xff] ^ table[6][(c >> 8) & 0xff] ^
+            table[5][(c >> 16) & 0xff] ^ table[4][c >> 24] ^
+            table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+
+void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++)
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    LOGMSG("[CRC] crc32c: %s", use_hw ? "sse4.2" : "table");
+}
+
+
+/* crc of what came before, 0 to start. Same value as zlib-style crc32c() */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+    uint32_t c = ~crc;
+#if defined(__x86_64__)
+    if (use_hw)
+        return ~_crc_hw(c, buf, len);
+#endif
+    return ~_crc_sw(c, buf, len);
+}
+
+
+int crc32c_file_range(int fd, off_t offset, size_t len, uint32_t *out)
+{
+    uint8_t *buf = malloc(HASH_READ_SIZE);
+    if (!buf)
+        return -ENOMEM;
+
+    uint32_t crc = 0;
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < HASH_READ_SIZE ? len - done : HASH_READ_SIZE;
+        ssize_t n = pread(fd, buf, want, offset + done);
+        if (n <= 0) {
+            free(buf);
+            return -EIO;
+        }
+        crc = crc32c_update(crc, buf, n);
+        done += n;
+    }
+    free(buf);
+    *out = crc;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+/* CRC-32C (Castagnoli) of a chunk's decoded bytes. Stored with every chunk
+ * on the server, checked on upload and download and used to tell which
+ * chunks of a stale cache file still match the remote version.
+ */
+
+
+void crc32c_init(void);
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+int crc32c_file_range(int fd, off_t offset, size_t len, uint32_t *out);
@@ -1,4 +1,11 @@
 #include "fuse_utils.h"
+#include "chunker.h"
+#include "compress.h"
+#include "buf_pool.h"
+#include "http_policy.h"
+#include "crc32c.h"
+#include <cjson/cJSON.h>
+#include <openssl/evp.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <libgen.h>
@@ -21,11 +28,157 @@ size_t write_cb(void *data, size_t size, size_t nmemb, void *userp)
     return total;
 }
 
-static size_t write_file_cb(void *ptr, size_t sz, size_t nm, void *userdata)
+typedef struct {
+    CURL *c;
+    int fd;
+    off_t offset;   // where the next byte lands
+    size_t got;
+    int codec;      // from X-Chunk-Codec, compressed bodies are held in zbuf
+    int hold;       // raw bodies are held in zbuf too, written only by _sink_finish
+    char *zbuf;
+    size_t zlen;
+    int has_crc;    // X-Chunk-Crc32c came with the body
+    uint32_t want_crc;
+    uint32_t crc;   // of the decoded bytes so far
+} fd_sink_t;
+
+static size_t header_codec_cb(char *ptr, size_t sz, size_t nm, void *userdata)
 {
-    return fwrite(ptr, sz, nm, (FILE *)userdata);
+    fd_sink_t *sink = (fd_sink_t *)userdata;
+    size_t total = sz * nm;
+    static const char name[] = "x-chunk-codec:";
+    static const char crc_name[] = "x-chunk-crc32c:";
+    if (total > sizeof(name) - 1 && strncasecmp(ptr, name, sizeof(name) - 1) == 0) {
+        const char *v = ptr + sizeof(name) - 1;
+        while (*v == ' ')
+            v++;
+        if (strncmp(v, "zstd", 4) == 0)
+            sink->codec = CODEC_ZSTD;
+        else if (strncmp(v, "hole", 4) == 0)
+            sink->codec = CODEC_HOLE;
+    } else if (total > sizeof(crc_name) - 1 && strncasecmp(ptr, crc_name, sizeof(crc_name) - 1) == 0) {
+        sink->want_crc = (uint32_t)strtoul(ptr + sizeof(crc_name) - 1, NULL, 10);
+        sink->has_crc = 1;
+    }
+    return total;
+}
+
+static size_t write_fd_cb(void *ptr, size_t sz, size_t nm, void *userdata)
+{
+    fd_sink_t *sink = (fd_sink_t *)userdata;
+    size_t total = sz * nm, done = 0;
+
+    /* Never let an error body land in the cache file */
+    long code = 0;
+    curl_easy_getinfo(sink->c, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 201)
+        return total;
+
+    /* Compressed chunks can only be decoded whole, see _sink_finish */
+    if (sink->codec != CODEC_RAW || sink->hold) {
+        if (sink->zlen + total > CHUNK_SIZE)
+            return 0;
+        if (!sink->zbuf && !(sink->zbuf = malloc(CHUNK_SIZE)))
+            return 0;
+        memcpy(sink->zbuf + sink->zlen, ptr, total);
+        sink->zlen += total;
+        return total;
+    }
+
+    while (done < total) {
+        ssize_t n = pwrite(sink->fd, (char *)ptr + done, total - done, sink->offset + done);
+        if (n <= 0)
+            return 0;  // aborts the transfer
+        done += n;
+    }
+    sink->crc = crc32c_update(sink->crc, ptr, total);
+    sink->offset += total;
+    sink->got += total;
+    return total;
+}
+
+
+
+/* Writes len bytes of buf into the sink's range with as few pwrites as it takes */
+static int _sink_commit(fd_sink_t *sink, const char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(sink->fd, buf + done, len - done, sink->offset + done);
+        if (n <= 0)
+            return -EIO;
+        done += n;
+    }
+    sink->got = len;
+    return 0;
 }
 
+/* Decodes a compressed body into the cache file, raw bodies are written
+ * already unless held. -EBADMSG if the bytes don't match the checksum the
+ * server sent along, nothing held is written then.
+ */
+static int _sink_finish(fd_sink_t *sink, size_t expect)
+{
+    if (sink->codec == CODEC_RAW && !sink->hold)
+        return sink->has_crc && sink->crc != sink->want_crc ? -EBADMSG : 0;
+    if (sink->codec == CODEC_HOLE) {
+        int rc = zero_file_range(sink->fd, sink->offset, expect);
+        if (rc == 0)
+            sink->got = expect;
+        return rc;
+    }
+    if (sink->codec == CODEC_RAW) {
+        int rc = 0;
+        if (sink->has_crc && crc32c_update(0, sink->zbuf, sink->zlen) != sink->want_crc)
+            rc = -EBADMSG;
+        if (rc == 0)
+            rc = _sink_commit(sink, sink->zbuf, sink->zlen);
+        free(sink->zbuf);
+        sink->zbuf = NULL;
+        return rc;
+    }
+
+    char *raw = malloc(expect ? expect : 1);
+    int rc = raw ? chunk_decompress(sink->zbuf, sink->zlen, raw, expect) : -ENOMEM;
+    if (rc == 0 && sink->has_crc && crc32c_update(0, raw, expect) != sink->want_crc)
+        rc = -EBADMSG;
+    if (rc == 0)
+        rc = _sink_commit(sink, raw, expect);
+    free(raw);
+    free(sink->zbuf);
+    sink->zbuf = NULL;
+    return rc;
+}
+
+
+/* curl_easy_perform, transient failures are tried again after a backoff.
+ * Every attempt shares one deadline. Non idempotent requests are only
+ * resent when they never got through to the server.
+ */
+static CURLcode _perform(CURL *c, int idempotent, string_buf_t *resp)
+{
+    long long deadline = mono_ms() + http_timeout_ms();
+    for (int attempt = 0; ; attempt++) {
+        if (resp) {
+            resp->len = 0;
+            if (resp->ptr)
+                resp->ptr[0] = '\0';
+        }
+        long left = (long)(deadline - mono_ms());
+        curl_easy_setopt(c, CURLOPT_TIMEOUT_MS, left > 1 ? left : 1L);
+        CURLcode rc = curl_easy_perform(c);
+
+        long code = 0;
+        curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+        if (attempt + 1 >= http_tries() || !http_transient(rc, code, idempotent))
+            return rc;
+        long delay = http_backoff_ms(c, attempt);
+        if (mono_ms() + delay >= deadline)
+            return rc;
+        LOGMSG("[HTTP] retrying in %ldms (curl %d, status %ld)", delay, rc, code);
+        http_sleep_ms(delay);
+    }
+}
 
 
 /* Returns 0 on successful HTTP request, else -1.
@@ -40,8 +193,10 @@ int http_request(const char *url, string_buf_t *resp, uint32_t *status)
         return -1;
 
     curl_easy_setopt(c, CURLOPT_URL, url);
+    http_policy_apply(c, 0);
 
-    if ((uintptr_t)status & 1) {
+    int post = (uintptr_t)status & 1;
+    if (post) {
         curl_easy_setopt(c, CURLOPT_POST, 1L);  // make it POST
         status = (uint32_t*)((uintptr_t)status & ~1);
     }
@@ -56,7 +211,7 @@ int http_request(const char *url, string_buf_t *resp, uint32_t *status)
         curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, NULL);
     }
 
-    CURLcode rc = curl_easy_perform(c);
+    CURLcode rc = _perform(c, !post, resp);
 
     if (status)
         curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, status);
@@ -83,49 +238,313 @@ int http_post_status(const char *url, uint32_t *status_out)
 
 
 
-/* Gets file from http stream */
-int http_get_stream(const char *url, FILE *out)
+/* Conditional GET, etag (optional) goes out as If-None-Match.
+ * A 304 leaves resp empty. Returns 0 once the server answered.
+ */
+int http_get_if(const char *url, const char *etag, string_buf_t *resp, uint32_t *status)
 {
     CURL *c = curl_easy_init();
     if (!c)
-        return -1;
+        return -ECOMM;
 
+    char line[64];
+    struct curl_slist *headers = NULL;
+    if (etag) {
+        snprintf(line, sizeof(line), "If-None-Match: %s", etag);
+        headers = curl_slist_append(NULL, line);
+    }
     curl_easy_setopt(c, CURLOPT_URL, url);
-    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_file_cb);
-    curl_easy_setopt(c, CURLOPT_WRITEDATA, out);
+    curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+    if (resp) {
+        resp->ptr = malloc(1);
+        resp->len = 0;
+        curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_cb);
+        curl_easy_setopt(c, CURLOPT_WRITEDATA, resp);
+    }
+    http_policy_apply(c, 0);
+
+    CURLcode rc = _perform(c, 1, resp);
+    if (status)
+        curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, status);
 
-    CURLcode rc = curl_easy_perform(c);
+    curl_slist_free_all(headers);
     curl_easy_cleanup(c);
-    return (rc == CURLE_OK) ? 0 : -1;
+    return (rc == CURLE_OK) ? 0 : -ECOMM;
+}
+
+
+/* Per request state of http_get_chunks_multi */
+typedef struct {
+    int live;               // transfers in flight, two while hedged
+    int done;
+    int tries;
+    int hedged;
+    long long retry_at;     // waiting out a backoff until then, 0 if not
+} get_state_t;
+
+/* One transfer, a hedged request has a second one for the same bytes */
+typedef struct {
+    fd_sink_t sink;
+    int req;                // -1 while free
+    int hedge;
+    long long started;
+} get_xfer_t;
+
+static int _xfer_start(CURLM *multi, get_xfer_t *x, int req, const chunk_req_t *r, int fd, int hedge)
+{
+    CURL *c = curl_easy_init();
+    if (!c)
+        return -ENOMEM;
+    /* A hedge's bytes only land once it has won, the primary may still be writing */
+    x->sink = (fd_sink_t){ .c = c, .fd = fd, .offset = r->offset, .got = 0, .hold = hedge };
+    x->req = req;
+    x->hedge = hedge;
+    x->started = mono_ms();
+    curl_easy_setopt(c, CURLOPT_URL, r->url);
+    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_fd_cb);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, &x->sink);
+    curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, header_codec_cb);
+    curl_easy_setopt(c, CURLOPT_HEADERDATA, &x->sink);
+    curl_easy_setopt(c, CURLOPT_PRIVATE, (char *)x);
+    http_policy_apply(c, 1);
+    curl_multi_add_handle(multi, c);
+    return 0;
+}
+
+static void _xfer_stop(CURLM *multi, get_xfer_t *x)
+{
+    curl_multi_remove_handle(multi, x->sink.c);
+    curl_easy_cleanup(x->sink.c);
+    free(x->sink.zbuf);
+    x->sink.c = NULL;
+    x->sink.zbuf = NULL;
+    x->req = -1;
+}
+
+
+/* Gets chunks concurrently, at most `streams` requests in flight.
+ * Each body is pwrite'd into fd at its own offset, reqs[i].rc holds
+ * 0 on success, else -ECOMM / -ENOENT / -EIO. Returns 0 if every chunk made it.
+ * Transient failures are retried after a backoff. A request running past
+ * the recent p95 gets a duplicate (hedge), whichever copy lands first
+ * wins and the other is dropped. The hedge holds its body in memory and
+ * writes it in one go only if it wins, over anything the primary left, so
+ * the range never mixes two versions of a chunk rewritten in between.
+ */
+int http_get_chunks_multi(chunk_req_t *reqs, int n, int fd, int streams)
+{
+    if (n <= 0)
+        return 0;
+    if (streams <= 0)
+        streams = 1;
+
+    CURLM *multi = curl_multi_init();
+    if (!multi)
+        return -ENOMEM;
+
+    int n_xfers = streams * 2;
+    get_state_t *st = calloc(n, sizeof(get_state_t));
+    get_xfer_t *xfers = calloc(n_xfers, sizeof(get_xfer_t));
+    if (!st || !xfers) {
+        free(st);
+        free(xfers);
+        curl_multi_cleanup(multi);
+        return -ENOMEM;
+    }
+    for (int i = 0; i < n_xfers; i++)
+        xfers[i].req = -1;
+
+    int next = 0, running = 0, primaries = 0, hedges = 0, left_reqs = n, returner = 0;
+    for (int i = 0; i < n; i++)
+        reqs[i].rc = -ECOMM;
+
+    do {
+        long long now = mono_ms();
+        long hedge_after = chunk_hedge_after_ms();
+        long wait = 1000;
+
+        /* Top the window back up, retries whose backoff ran out first */
+        for (int k = 0; k < n_xfers && primaries < streams; k++) {
+            get_xfer_t *x = &xfers[k];
+            if (x->req != -1)
+                continue;
+            int i = -1;
+            for (int j = 0; j < next; j++) {
+                if (!st[j].done && st[j].retry_at && st[j].retry_at <= now) {
+                    i = j;
+                    break;
+                }
+            }
+            if (i < 0 && next < n)
+                i = next++;
+            if (i < 0)
+                break;
+            st[i].retry_at = 0;
+            st[i].hedged = 0;
+            if (_xfer_start(multi, x, i, &reqs[i], fd, 0) != 0) {
+                reqs[i].rc = -ENOMEM;
+                st[i].done = 1;
+                left_reqs--;
+                continue;
+            }
+            st[i].live++;
+            primaries++;
+        }
+
+        /* Duplicate the stragglers, one copy each */
+        for (int k = 0; hedge_after && k < n_xfers && hedges < streams; k++) {
+            get_xfer_t *x = &xfers[k];
+            if (x->req == -1 || x->hedge || st[x->req].hedged)
+                continue;
+            long long due = x->started + hedge_after;
+            if (due > now) {
+                if (due - now < wait)
+                    wait = due - now;
+                continue;
+            }
+            for (int h = 0; h < n_xfers; h++) {
+                if (xfers[h].req != -1)
+                    continue;
+                if (_xfer_start(multi, &xfers[h], x->req, &reqs[x->req], fd, 1) == 0) {
+                    LOGMSG("[MULTI] hedging chunk at %jd after %lldms",
+                           (intmax_t)reqs[x->req].offset, now - x->started);
+                    st[x->req].live++;
+                    hedges++;
+                }
+                st[x->req].hedged = 1;
+                break;
+            }
+        }
+
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            get_xfer_t *x = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&x);
+            int i = x->req;
+
+            long status = 0;
+            curl_easy_getinfo(x->sink.c, CURLINFO_RESPONSE_CODE, &status);
+            CURLcode result = msg->data.result;
+            int rc;
+            if (result != CURLE_OK)
+                rc = -ECOMM;
+            else if (status == 520)
+                rc = -ENOENT;
+            else if (status != 201)
+                rc = -EIO;
+            else if (st[i].done)
+                rc = -ECANCELED;  // its twin won, nothing of this one gets written
+            else if ((rc = _sink_finish(&x->sink, reqs[i].expect)) == 0 &&
+                     x->sink.got != reqs[i].expect)
+                rc = -EIO;
+            LOGMSG("[MULTI] chunk at %jd: status=%ld, %zu/%zu bytes%s",
+                   (intmax_t)reqs[i].offset, status, x->sink.got, reqs[i].expect,
+                   x->hedge ? " (hedge)" : "");
+
+            long delay = rc != 0 ? http_backoff_ms(x->sink.c, st[i].tries) : 0;
+            long took = (long)(mono_ms() - x->started);
+            if (x->hedge)
+                hedges--;
+            else
+                primaries--;
+            st[i].live--;
+            _xfer_stop(multi, x);
+
+            if (st[i].done)
+                continue;
+            if (rc == 0) {
+                chunk_latency_record(took);
+                reqs[i].rc = 0;
+                st[i].done = 1;
+                left_reqs--;
+                /* The other copy lost the race */
+                for (int k = 0; k < n_xfers && st[i].live > 0; k++) {
+                    if (xfers[k].req != i)
+                        continue;
+                    if (xfers[k].hedge)
+                        hedges--;
+                    else
+                        primaries--;
+                    st[i].live--;
+                    _xfer_stop(multi, &xfers[k]);
+                }
+                continue;
+            }
+            if (st[i].live > 0)
+                continue;  // its twin may still make it
+
+            /* Bytes mangled on the way are worth another try, like a dropped connection */
+            if ((rc == -EBADMSG || http_transient(result, status, 1)) && ++st[i].tries < http_tries()) {
+                st[i].retry_at = mono_ms() + delay;
+                LOGMSG("[MULTI] retrying chunk at %jd in %ldms", (intmax_t)reqs[i].offset, delay);
+                continue;
+            }
+            if (rc == -EBADMSG)
+                LOGMSG("[MULTI] chunk at %jd keeps failing its checksum", (intmax_t)reqs[i].offset);
+            reqs[i].rc = rc == -EBADMSG ? -EIO : rc;
+            st[i].done = 1;
+            left_reqs--;
+        }
+
+        /* Sleep no longer than the next retry or hedge needs */
+        now = mono_ms();
+        for (int i = 0; i < next; i++) {
+            if (st[i].done || !st[i].retry_at)
+                continue;
+            long long until = st[i].retry_at - now;
+            if (until < wait)
+                wait = until > 0 ? until : 0;
+        }
+        if (left_reqs > 0 && wait > 0)
+            curl_multi_poll(multi, NULL, 0, (int)wait, NULL);
+    } while (left_reqs > 0);
+
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].rc != 0 && returner == 0)
+            returner = reqs[i].rc;
+    }
+
+    free(st);
+    free(xfers);
+    curl_multi_cleanup(multi);
+    return returner;
 }
 
 
 
-/* Sends file through http */
-int http_post_stream(const char *url, const void *data, size_t len, uint32_t *status)
+/* POSTs a JSON body, response is kept when resp is given.
+ * Returns 0 or -ECOMM, like http_post_status.
+ */
+int http_post_json(const char *url, const char *json, string_buf_t *resp, uint32_t *status)
 {
     CURL *c = curl_easy_init();
     if (!c)
-        return -1;
-    
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
+        return -ECOMM;
 
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
     curl_easy_setopt(c, CURLOPT_URL, url);
-    curl_easy_setopt(c, CURLOPT_POST, 1L);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDS, json);
     curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
-    
-    CURLcode rc = curl_easy_perform(c);
-    curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, status);
+    if (resp) {
+        resp->ptr = malloc(1);
+        resp->len = 0;
+        curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_cb);
+        curl_easy_setopt(c, CURLOPT_WRITEDATA, resp);
+    }
+    http_policy_apply(c, 0);
+
+    CURLcode rc = _perform(c, 0, resp);
+    if (status)
+        curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, status);
 
     curl_slist_free_all(headers);
     curl_easy_cleanup(c);
-
-    if (status)
-            curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, status);
-    return (rc == CURLE_OK) ? 0 : -1;
+    return (rc == CURLE_OK) ? 0 : -ECOMM;
 }
 
 
@@ -172,6 +591,19 @@ char *url_encode(const char* path)
 
 
 
+/* Integer knob from the environment (.env gets exported by make) */
+long env_long(const char *name, long def)
+{
+    const char *v = getenv(name);
+    if (!v || !*v)
+        return def;
+    char *end;
+    long n = strtol(v, &end, 10);
+    return (*end == '\0') ? n : def;
+}
+
+
+
 int same_parent_dir(const char *a, const char *b)
 {
     char *da = strdup(a), *db = strdup(b);
@@ -187,132 +619,719 @@ int same_parent_dir(const char *a, const char *b)
 }
 
 
+/* 1 if path is dir itself or lies below it, len is strlen(dir). Everything is under "/" */
+int path_under(const char *path, const char *dir, size_t len)
+{
+    if (len == 1 && dir[0] == '/')
+        return 1;
+    return strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+
+/* FNV-1a, spreads paths over the bucket tables */
+uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    while (*path) {
+        h ^= (uint8_t)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
 
-int backend_unlink(int current_user_id, const char *path)
+/* CLOCK_REALTIME time ms from now, for pthread_cond_timedwait */
+void deadline_after(struct timespec *ts, long ms)
 {
-    char *esc = url_encode(path);
-    if (!esc) return -EIO;
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+
+
+/* One chunk POST of upload_file_chunks. Raw chunks are streamed out of
+ * the cache file, a compressed one sits in a pooled buffer kept across retries.
+ */
+typedef struct {
+    CURL *c;
+    void *buf;          // compressed body, NULL to read [off, off + len) of fd
+    int fd;
+    off_t off;
+    size_t pos;         // bytes of the body handed to curl so far
+    size_t len;
+    int chunk;          // -1 while the slot is free
+    int tries;
+    long long retry_at; // backing off before the next try, c is NULL meanwhile
     char url[URL_MAX];
-    snprintf(url, sizeof(url),
-             "%s/unlink?user_id=%d&path=%s",
-             get_server_url(), current_user_id, esc);
-    curl_free(esc);
+} upload_slot_t;
 
-    uint32_t status = 0;
-    if (http_post_status(url, &status) != 0)
-        return -ECOMM;
-    if (status == 201)
+static size_t _slot_read_cb(char *dst, size_t sz, size_t nm, void *userdata)
+{
+    upload_slot_t *slot = (upload_slot_t *)userdata;
+    size_t want = sz * nm;
+    if (want > slot->len - slot->pos)
+        want = slot->len - slot->pos;
+    if (want == 0)
         return 0;
-    if (status == 520)
-        return -ENOENT;
-    return -EIO;
+
+    /* Cache file shrank underneath us, fail the chunk rather than send it short */
+    ssize_t n = pread(slot->fd, dst, want, slot->off + slot->pos);
+    if (n <= 0)
+        return CURL_READFUNC_ABORT;
+    slot->pos += n;
+    return n;
 }
 
-/* uploads the file at cache_path to the server backend */
-int upload_file_chunks(const char *logical_path, int current_user_id, size_t size, const char *cache_path, time_t mtime)
+static int _slot_start(CURLM *multi, upload_slot_t *slot, struct curl_slist *headers)
 {
-    FILE *fp = fopen(cache_path, "rb");
-    if (!fp)
-        return -EIO;
+    slot->c = curl_easy_init();
+    if (!slot->c)
+        return -ENOMEM;
+    slot->pos = 0;
+    curl_easy_setopt(slot->c, CURLOPT_URL, slot->url);
+    curl_easy_setopt(slot->c, CURLOPT_POST, 1L);
+    if (slot->buf) {
+        curl_easy_setopt(slot->c, CURLOPT_POSTFIELDS, slot->buf);
+    } else {
+        curl_easy_setopt(slot->c, CURLOPT_READFUNCTION, _slot_read_cb);
+        curl_easy_setopt(slot->c, CURLOPT_READDATA, slot);
+    }
+    curl_easy_setopt(slot->c, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)slot->len);
+    curl_easy_setopt(slot->c, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(slot->c, CURLOPT_PRIVATE, (char *)slot);
+    http_policy_apply(slot->c, 1);
+    curl_multi_add_handle(multi, slot->c);
+    return 0;
+}
+
 
+/* POSTs body (consumed) and sets the chunks listed in {"send": [...]} */
+static int _prep_post(const char *url, cJSON *body, int total_chunks, uint8_t *send, uint32_t *status)
+{
+    char *json = cJSON_PrintUnformatted(body);
+    cJSON_Delete(body);
+    if (!json)
+        return -ENOMEM;
+
+    string_buf_t resp = {0};
+    int rc = http_post_json(url, json, &resp, status);
+    cJSON_free(json);
+
+    if (rc == 0 && *status == 201) {
+        cJSON *root = cJSON_Parse(resp.ptr ? resp.ptr : "");
+        cJSON *arr = cJSON_GetObjectItemCaseSensitive(root, "send");
+        if (!cJSON_IsArray(arr)) {
+            rc = -EIO;
+        } else {
+            cJSON *it;
+            cJSON_ArrayForEach(it, arr) {
+                int i = it->valueint;
+                if (cJSON_IsNumber(it) && i >= 0 && i < total_chunks)
+                    BIT_SET(send, i);
+            }
+        }
+        cJSON_Delete(root);
+    }
+    free(resp.ptr);
+    return rc;
+}
+
+
+/* Announces a new version of the file to the server.
+ * dirty == NULL resends the whole file, otherwise only the chunks set in
+ * dirty plus whatever the server is missing or holds at a stale size.
+ * *send_out gets a bitmap of the chunks to ship, caller frees.
+ */
+int upload_prep(const char *logical_path, int current_user_id, size_t size, time_t mtime,
+                const uint8_t *dirty, uint32_t n_dirty, uint8_t **send_out)
+{
     /* In case of empty files, somehow */
     int total_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
     int end_chunk = total_chunks > 0 ? total_chunks - 1 : 0;
 
+    uint8_t *send = calloc(1, BITMAP_BYTES(total_chunks) + 1);
+    if (!send)
+        return -ENOMEM;
 
     char *esc = url_encode(logical_path);
     if (!esc) {
-        fclose(fp);
+        free(send);
         return -EIO;
     }
 
     char url[URL_MAX];
     snprintf(url, sizeof(url),
-            "%s/prep_upload?user_id=%d&path=%s&size=%lu&end_chunk=%d&mtime=%lld",
-            get_server_url(), current_user_id, esc, (unsigned long)size, end_chunk, (long long)mtime);
+            "%s/prep_upload?user_id=%d&path=%s&size=%lu&end_chunk=%d&mtime=%lld%s",
+            get_server_url(), current_user_id, esc, (unsigned long)size, end_chunk,
+            (long long)mtime, dirty ? "&partial=1" : "");
     curl_free(esc);
 
     LOGMSG("url sent: %s", url);
 
     uint32_t status = 0;
-    if (http_post_status(url, &status) != 0) {
-        fclose(fp);
-        return -ECOMM;
+    int rc = 0;
+    if (!dirty) {
+        rc = http_post_status(url, &status);
+        if (rc == 0 && status == 201) {
+            for (int i = 0; i < total_chunks; i++)
+                BIT_SET(send, i);
+        }
+    } else {
+        /* {"dirty": [0, 4, ...]} */
+        cJSON *body = cJSON_CreateObject();
+        cJSON *list = cJSON_AddArrayToObject(body, "dirty");
+        for (uint32_t i = 0; i < n_dirty && i < (uint32_t)total_chunks; i++) {
+            if (BIT_TEST(dirty, i))
+                cJSON_AddItemToArray(list, cJSON_CreateNumber(i));
+        }
+        rc = _prep_post(url, body, total_chunks, send, &status);
+    }
+
+    if (rc == 0 && status != 201)
+        rc = status == 520 ? -ENOENT : -EIO;
+    if (rc != 0) {
+        free(send);
+        return rc;
     }
-    if (status != 201) {
-        fclose(fp);
+    *send_out = send;
+    return 0;
+}
+
+
+/* Same as upload_prep for a content-defined layout: n chunks starting at
+ * offsets[i] with SHA-256 hashes[i]. The server keeps any stored
+ * chunk of this file with a matching fingerprint, wherever it moved to.
+ */
+int upload_prep_cdc(const char *logical_path, int current_user_id, size_t size, time_t mtime,
+                    const off_t *offsets, const chunk_hash_t *hashes, uint32_t n, uint8_t **send_out)
+{
+    uint8_t *send = calloc(1, BITMAP_BYTES(n) + 1);
+    if (!send)
+        return -ENOMEM;
+
+    char *esc = url_encode(logical_path);
+    if (!esc) {
+        free(send);
         return -EIO;
     }
 
-    /* Allocate chunk buffer */
-    void *chunk_buf = malloc(CHUNK_SIZE);
-    if (!chunk_buf) {
-        fclose(fp);
+    char url[URL_MAX];
+    snprintf(url, sizeof(url),
+            "%s/prep_upload?user_id=%d&path=%s&size=%lu&end_chunk=%d&mtime=%lld&chunker=cdc",
+            get_server_url(), current_user_id, esc, (unsigned long)size,
+            n > 0 ? (int)n - 1 : 0, (long long)mtime);
+    curl_free(esc);
+
+    LOGMSG("url sent: %s (%u chunks)", url, n);
+
+    /* {"chunks": [{"size": 1234, "hash": "0123abcd..."}, ...]} */
+    cJSON *body = cJSON_CreateObject();
+    cJSON *list = cJSON_AddArrayToObject(body, "chunks");
+    for (uint32_t i = 0; i < n; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "size", (double)(offsets[i + 1] - offsets[i]));
+        cJSON_AddStringToObject(item, "hash", hashes[i].hex);
+        cJSON_AddItemToArray(list, item);
+    }
+
+    uint32_t status = 0;
+    int rc = _prep_post(url, body, n, send, &status);
+    if (rc == 0 && status != 201)
+        rc = status == 520 ? -ENOENT : -EIO;
+    if (rc != 0) {
+        free(send);
+        return rc;
+    }
+    *send_out = send;
+    return 0;
+}
+
+
+/* 1 if [offset, offset + len) of fd reads as zeros. Unwritten extents of
+ * a sparse file are skipped via SEEK_DATA, the rest is scanned and the
+ * scan stops at the first byte that isn't zero.
+ */
+int range_is_zero(int fd, off_t offset, size_t len)
+{
+    off_t end = offset + (off_t)len;
+    off_t pos = lseek(fd, offset, SEEK_DATA);
+    if (pos < 0 && errno == ENXIO)
+        return 1;  // nothing but hole up to EOF
+    if (pos < 0)
+        pos = offset;  // no SEEK_DATA here, scan it all
+    if (pos >= end)
+        return 1;
+
+    uint8_t *buf = malloc(ZERO_SCAN_SIZE);
+    if (!buf)
+        return 0;
+    int returner = 1;
+    while (pos < end) {
+        size_t want = end - pos < ZERO_SCAN_SIZE ? (size_t)(end - pos) : ZERO_SCAN_SIZE;
+        ssize_t n = pread(fd, buf, want, pos);
+        /* buf[0] == 0 and every byte equal to the next one */
+        if (n <= 0 || buf[0] != 0 || memcmp(buf, buf + 1, n - 1) != 0) {
+            returner = 0;
+            break;
+        }
+        pos += n;
+    }
+    free(buf);
+    return returner;
+}
+
+
+/* Makes [offset, offset + len) of fd read as zeros, punching a hole where
+ * the filesystem allows so the cache stays sparse too.
+ */
+int zero_file_range(int fd, off_t offset, size_t len)
+{
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+
+    uint8_t *zeros = calloc(1, ZERO_SCAN_SIZE);
+    if (!zeros)
+        return -ENOMEM;
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < ZERO_SCAN_SIZE ? len - done : ZERO_SCAN_SIZE;
+        ssize_t n = pwrite(fd, zeros, want, offset + done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    free(zeros);
+    return done == len ? 0 : -EIO;
+}
+
+
+/* SHA-256 and CRC-32C of [offset, offset + len) in one pass */
+int hash_file_range(int fd, off_t offset, size_t len, chunk_hash_t *out)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    uint8_t *buf = malloc(HASH_READ_SIZE);
+    if (!ctx || !buf || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx);
+        free(buf);
         return -ENOMEM;
     }
 
-    /* Upload chunks sequentially */
     int returner = 0;
-    int chunk = 0;
-    size_t n;
-    while ((n = fread(chunk_buf, 1, CHUNK_SIZE, fp)) > 0) {
-        LOGMSG("Uploading chunk %d/%d", chunk, end_chunk);
-        
-        esc = url_encode(logical_path);
-        if (!esc) {
+    size_t done = 0;
+    uint32_t crc = 0;
+    while (done < len) {
+        size_t want = len - done < HASH_READ_SIZE ? len - done : HASH_READ_SIZE;
+        ssize_t n = pread(fd, buf, want, offset + done);
+        if (n <= 0) {
             returner = -EIO;
             break;
         }
+        EVP_DigestUpdate(ctx, buf, n);
+        crc = crc32c_update(crc, buf, n);
+        done += n;
+    }
+    out->crc = crc;
+
+    if (returner == 0) {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int md_len = 0;
+        EVP_DigestFinal_ex(ctx, md, &md_len);
+        for (unsigned int i = 0; i < md_len && i < 32; i++)
+            snprintf(out->hex + 2 * i, 3, "%02x", md[i]);
+    }
+    EVP_MD_CTX_free(ctx);
+    free(buf);
+    return returner;
+}
+
+
+/* Handshake before any bytes go out: offers the hashes of the chunks in
+ * send, the server links the ones its chunk store already holds into the
+ * file. Those are cleared from send. Failing here just means sending more.
+ */
+static void _link_known_chunks(const char *esc, int current_user_id, uint8_t *send, int total_chunks,
+                               const off_t *offsets, size_t size, const chunk_hash_t *hashes,
+                               const uint8_t *holes)
+{
+    char url[URL_MAX];
+    snprintf(url, sizeof(url), "%s/have_chunks?user_id=%d&path=%s",
+            get_server_url(), current_user_id, esc);
+
+    /* {"chunks": [{"index": 3, "size": 1234, "hash": "..."}, {"index": 4, "size": 1234, "hole": true}]} */
+    cJSON *body = cJSON_CreateObject();
+    cJSON *list = cJSON_AddArrayToObject(body, "chunks");
+    for (int i = 0; i < total_chunks; i++) {
+        if (!BIT_TEST(send, i))
+            continue;
+        off_t off = offsets ? offsets[i] : (off_t)i * CHUNK_SIZE;
+        off_t end = offsets ? offsets[i + 1] : (off + CHUNK_SIZE < (off_t)size ? off + CHUNK_SIZE : (off_t)size);
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "index", i);
+        cJSON_AddNumberToObject(item, "size", (double)(end - off));
+        if (BIT_TEST(holes, i))
+            cJSON_AddTrueToObject(item, "hole");
+        else
+            cJSON_AddStringToObject(item, "hash", hashes[i].hex);
+        cJSON_AddItemToArray(list, item);
+    }
+    char *json = cJSON_PrintUnformatted(body);
+    cJSON_Delete(body);
+    if (!json)
+        return;
+
+    string_buf_t resp = {0};
+    uint32_t status = 0;
+    int rc = http_post_json(url, json, &resp, &status);
+    cJSON_free(json);
+
+    /* {"linked": [...]} */
+    if (rc == 0 && status == 201) {
+        cJSON *root = cJSON_Parse(resp.ptr ? resp.ptr : "");
+        cJSON *arr = cJSON_GetObjectItemCaseSensitive(root, "linked");
+        cJSON *it;
+        int linked = 0;
+        cJSON_ArrayForEach(it, arr) {
+            int i = it->valueint;
+            if (cJSON_IsNumber(it) && i >= 0 && i < total_chunks && BIT_TEST(send, i)) {
+                BIT_CLEAR(send, i);
+                linked++;
+            }
+        }
+        LOGMSG("[DEDUP] %d chunk(s) already stored or all zeros, not sent", linked);
+        cJSON_Delete(root);
+    }
+    free(resp.ptr);
+}
+
+
+/* Tunables: DISFS_UPLOAD_STREAMS
+ * Ships the chunks set in send. They go out concurrently and may land on
+ * the server in any order, each one is retried on its own before the
+ * upload gives up. offsets (n_chunks + 1 entries) gives a variable layout,
+ * NULL means CHUNK_SIZE chunks over size bytes. hashes may be NULL, they
+ * are computed here then. Chunks the server already stores are linked
+ * instead of sent, and cleared from send.
+ * Once *abort (may be NULL) goes nonzero the chunks still in flight are
+ * dropped and -ECANCELED is returned.
+ */
+int upload_send_chunks(const char *logical_path, int current_user_id, size_t size,
+                       const char *cache_path, uint8_t *send,
+                       const off_t *offsets, const chunk_hash_t *hashes, uint32_t n_chunks,
+                       const int *abort)
+{
+    int total_chunks = offsets ? (int)n_chunks : (int)((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    int end_chunk = total_chunks > 0 ? total_chunks - 1 : 0;
+
+    int to_send = 0;
+    for (int i = 0; i < total_chunks; i++)
+        to_send += BIT_TEST(send, i) ? 1 : 0;
+    if (to_send == 0)
+        return 0;
+
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+        return -EIO;
+
+    char *esc = url_encode(logical_path);
+    if (!esc) {
+        close(fd);
+        return -EIO;
+    }
+
+    /* All-zero chunks are recorded as holes, they never become messages */
+    uint8_t *holes = calloc(1, BITMAP_BYTES(total_chunks) + 1);
+    chunk_hash_t *own_hashes = NULL;
+    if (!holes || (!hashes && !(own_hashes = calloc(total_chunks, sizeof(chunk_hash_t))))) {
+        free(holes);
+        curl_free(esc);
+        close(fd);
+        return -ENOMEM;
+    }
+    for (int i = 0; i < total_chunks; i++) {
+        if (!BIT_TEST(send, i))
+            continue;
+        off_t off = offsets ? offsets[i] : (off_t)i * CHUNK_SIZE;
+        size_t len = offsets ? (size_t)(offsets[i + 1] - off)
+                   : (size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE);
+        if (range_is_zero(fd, off, len)) {
+            BIT_SET(holes, i);
+            continue;  // no hash, if it has to go after all it skips the chunk store
+        }
+        if (own_hashes && hash_file_range(fd, off, len, &own_hashes[i]) != 0) {
+            free(own_hashes);
+            free(holes);
+            curl_free(esc);
+            close(fd);
+            return -EIO;
+        }
+    }
+    if (!hashes)
+        hashes = own_hashes;
+
+    _link_known_chunks(esc, current_user_id, send, total_chunks, offsets, size, hashes, holes);
+    free(holes);
+    to_send = 0;
+    for (int i = 0; i < total_chunks; i++)
+        to_send += BIT_TEST(send, i) ? 1 : 0;
+    if (to_send == 0) {
+        free(own_hashes);
+        curl_free(esc);
+        close(fd);
+        return 0;
+    }
 
-        snprintf(url, sizeof(url),
-                "%s/upload?user_id=%d&path=%s&chunk=%d",
-                get_server_url(), current_user_id, esc, chunk);
+    /* Raw chunks stream from the file, so the window costs no memory */
+    long streams = env_long("DISFS_UPLOAD_STREAMS", UPLOAD_STREAMS_DEFAULT);
+    if (streams > to_send)
+        streams = to_send;
+    if (streams <= 0)
+        streams = 1;
+
+    CURLM *multi = curl_multi_init();
+    upload_slot_t *slots = calloc(streams, sizeof(upload_slot_t));
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/octet-stream");
+    if (!multi || !slots || !headers) {
+        if (multi)
+            curl_multi_cleanup(multi);
+        free(slots);
+        curl_slist_free_all(headers);
+        free(own_hashes);
         curl_free(esc);
+        close(fd);
+        return -ENOMEM;
+    }
+    for (int i = 0; i < streams; i++)
+        slots[i].chunk = -1;
 
-        status = 0;
-        if (http_post_stream(url, chunk_buf, n, &status) != 0) {
-            returner = -ECOMM;
-            break;
+    int returner = 0;
+    int next = 0, in_flight = 0, running = 0;
+    do {
+        /* Restart the chunks whose backoff ran out, drop them once something failed */
+        long long now = mono_ms();
+        for (int i = 0; i < streams; i++) {
+            upload_slot_t *slot = &slots[i];
+            if (slot->chunk == -1 || slot->c || (slot->retry_at > now && returner == 0))
+                continue;
+            if (returner != 0 || _slot_start(multi, slot, headers) != 0) {
+                buf_pool_put(slot->buf);
+                slot->buf = NULL;
+                slot->chunk = -1;
+                in_flight--;
+                if (returner == 0)
+                    returner = -ENOMEM;
+            }
         }
 
-        LOGMSG("Chunk %d upload status: %d", chunk, status);
-        
-        if (status != 201) {
-            returner = -EIO;
-            break;
+        /* Top the window back up, unless something already failed for good */
+        for (int i = 0; i < streams && next < total_chunks && returner == 0; i++) {
+            upload_slot_t *slot = &slots[i];
+            if (slot->chunk != -1)
+                continue;
+            while (next < total_chunks && !BIT_TEST(send, next))
+                next++;
+            if (next >= total_chunks)
+                break;
+
+            off_t off = offsets ? offsets[next] : (off_t)next * CHUNK_SIZE;
+            size_t want = offsets ? (size_t)(offsets[next + 1] - off)
+                        : (size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE);
+            slot->buf = NULL;
+            slot->fd = fd;
+            slot->off = off;
+            slot->len = want;
+            slot->chunk = next++;
+            slot->tries = 0;
+            slot->retry_at = 0;
+            snprintf(slot->url, sizeof(slot->url),
+                    "%s/upload?user_id=%d&path=%s&chunk=%d&hash=%s",
+                    get_server_url(), current_user_id, esc, slot->chunk, hashes[slot->chunk].hex);
+            if (hashes[slot->chunk].hex[0]) {
+                size_t used = strlen(slot->url);
+                snprintf(slot->url + used, sizeof(slot->url) - used,
+                        "&crc=%u", hashes[slot->chunk].crc);
+            }
+
+            /* Compression needs the chunk in memory. Only block on the pool
+             * while none of our own transfers hold buffers, else send raw. */
+            void *bufs[2];
+            if (compress_enabled() && buf_pool_get(bufs, 2, in_flight == 0) == 0) {
+                size_t packed = 0;
+                size_t got = 0;
+                while (got < want) {
+                    ssize_t n = pread(fd, (char *)bufs[0] + got, want - got, off + got);
+                    if (n <= 0)
+                        break;
+                    got += n;
+                }
+                if (got == want)
+                    packed = chunk_compress(bufs[0], want, bufs[1], CHUNK_SIZE);
+                buf_pool_put(bufs[0]);
+
+                /* Server learns the raw size, Discord only ever sees the compressed bytes */
+                if (packed > 0) {
+                    slot->buf = bufs[1];
+                    slot->len = packed;
+                    size_t used = strlen(slot->url);
+                    snprintf(slot->url + used, sizeof(slot->url) - used,
+                            "&codec=zstd&raw=%zu", want);
+                } else {
+                    buf_pool_put(bufs[1]);
+                }
+            }
+            if (_slot_start(multi, slot, headers) != 0) {
+                buf_pool_put(slot->buf);
+                slot->buf = NULL;
+                slot->chunk = -1;
+                returner = -ENOMEM;
+                break;
+            }
+            in_flight++;
         }
 
-        chunk++;
-    }
-    
-    free(chunk_buf);
-    fclose(fp);
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            upload_slot_t *slot = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+
+            long code = 0;
+            curl_easy_getinfo(slot->c, CURLINFO_RESPONSE_CODE, &code);
+            CURLcode result = msg->data.result;
+            LOGMSG("Chunk %d/%d upload status: %ld", slot->chunk, end_chunk, code);
+
+            /* Before cleanup, the delay may come from a Retry-After */
+            long delay = http_backoff_ms(slot->c, slot->tries);
+            curl_multi_remove_handle(multi, slot->c);
+            curl_easy_cleanup(slot->c);
+            slot->c = NULL;
+
+            /* A 4xx other than 408 and 429 comes back the same however often it's sent */
+            int rc = 0;
+            if (result != CURLE_OK)
+                rc = -ECOMM;
+            else if (code == 520)
+                rc = -ENOENT;
+            else if (code >= 400 && code < 500 && code != 408 && code != 429)
+                rc = -EINVAL;
+            else if (code != 201)
+                rc = -EIO;
+
+            if (rc != 0 && http_transient(result, code, 1) && returner == 0 &&
+                ++slot->tries < UPLOAD_CHUNK_TRIES) {
+                LOGMSG("Retrying chunk %d (%d/%d) in %ldms", slot->chunk, slot->tries,
+                       UPLOAD_CHUNK_TRIES, delay);
+                slot->retry_at = mono_ms() + delay;
+                continue;
+            }
+
+            if (rc != 0 && returner == 0)
+                returner = rc;
+            buf_pool_put(slot->buf);
+            slot->buf = NULL;
+            slot->chunk = -1;
+            in_flight--;
+        }
+
+        /* Superseded by a newer version of the file, don't finish this one */
+        if (abort && __atomic_load_n(abort, __ATOMIC_ACQUIRE) && returner == 0) {
+            for (int i = 0; i < streams; i++) {
+                upload_slot_t *slot = &slots[i];
+                if (slot->chunk == -1)
+                    continue;
+                if (slot->c) {
+                    curl_multi_remove_handle(multi, slot->c);
+                    curl_easy_cleanup(slot->c);
+                    slot->c = NULL;
+                }
+                buf_pool_put(slot->buf);
+                slot->buf = NULL;
+                slot->chunk = -1;
+            }
+            in_flight = 0;
+            returner = -ECANCELED;
+        }
+
+        long wait = 1000;
+        now = mono_ms();
+        for (int i = 0; i < streams; i++) {
+            if (slots[i].chunk == -1 || slots[i].c)
+                continue;
+            long long until = slots[i].retry_at - now;
+            if (until < wait)
+                wait = until > 0 ? until : 0;
+        }
+        if (in_flight > 0 && wait > 0)
+            curl_multi_poll(multi, NULL, 0, (int)wait, NULL);
+        while (next < total_chunks && !BIT_TEST(send, next))
+            next++;
+    } while (in_flight > 0 || (next < total_chunks && returner == 0));
+
+    free(slots);
+    curl_slist_free_all(headers);
+    curl_multi_cleanup(multi);
+    free(own_hashes);
+    curl_free(esc);
+    close(fd);
 
     return returner;
 }
 
 
-
-int backend_exists(int current_user_id, const char *path, int *exists_out)
+/* Cuts the cache file into content-defined chunks, ships those the server lacks */
+static int _upload_file_cdc(const char *logical_path, int current_user_id, size_t size, const char *cache_path,
+                            time_t mtime, const int *abort)
 {
-    char *esc = url_encode(path);
-    if (!esc)
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
         return -EIO;
-    char url[URL_MAX];
-    snprintf(url, sizeof(url),
-             "%s/stat?user_id=%d&path=%s",
-             get_server_url(), current_user_id, esc);
-    curl_free(esc);
 
-    uint32_t status = 0;
-    if (http_request(url, NULL, &status) != 0)
-        return -ECOMM;
-    if (exists_out)
-        *exists_out = (status == 201);
-    return 0;
+    off_t *offsets = NULL;
+    chunk_hash_t *hashes = NULL;
+    uint32_t n = 0;
+    int rc = cdc_split(fd, size, &offsets, &hashes, &n);
+    close(fd);
+    if (rc != 0)
+        return rc;
+
+    uint8_t *send = NULL;
+    rc = upload_prep_cdc(logical_path, current_user_id, size, mtime, offsets, hashes, n, &send);
+    if (rc == 0) {
+        rc = upload_send_chunks(logical_path, current_user_id, size, cache_path, send, offsets, hashes, n, abort);
+        free(send);
+    }
+    free(offsets);
+    free(hashes);
+    return rc;
+}
+
+
+/* Resends the whole file, abort as for upload_send_chunks */
+int upload_file_chunks(const char *logical_path, int current_user_id, size_t size, const char *cache_path,
+                       time_t mtime, const int *abort)
+{
+    if (cdc_enabled())
+        return _upload_file_cdc(logical_path, current_user_id, size, cache_path, mtime, abort);
+
+    uint8_t *send = NULL;
+    int rc = upload_prep(logical_path, current_user_id, size, mtime, NULL, 0, &send);
+    if (rc != 0)
+        return rc;
+    rc = upload_send_chunks(logical_path, current_user_id, size, cache_path, send, NULL, NULL, 0, abort);
+    free(send);
+    return rc;
 }
 
 
+
 int cache_swap(const char *a, const char *b) {
 #if defined(RENAME_EXCHANGE)
     if (renameat2(AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0)
@@ -14,6 +14,21 @@
 
 #define URL_MAX 512
 #define CHUNK_SIZE (10 * 1024 * 1024 - 256)  // ~10 MB with some overhead
+#define UPLOAD_STREAMS_DEFAULT 4
+#define UPLOAD_MEM_MB_DEFAULT 64    // cap on chunk buffers shared by all uploads
+#define UPLOAD_CHUNK_TRIES 3
+#define HASH_READ_SIZE (1024 * 1024)
+#define ZERO_SCAN_SIZE (64 * 1024)       // small, real data fails on its first bytes
+#define COPY_BUF_SIZE (1024 * 1024)     // copy_file_range ranges a clone can't cover
+
+#define BIT_TEST(map, i) ((map)[(i) >> 3] & (1u << ((i) & 7)))
+#define BIT_SET(map, i) ((map)[(i) >> 3] |= (1u << ((i) & 7)))
+#define BIT_CLEAR(map, i) ((map)[(i) >> 3] &= ~(1u << ((i) & 7)))
+#define BITMAP_BYTES(n) (((n) + 7) / 8)
+
+/* Counters for .command/stats */
+#define STAT_ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
 
 
 typedef struct string_buf {
@@ -23,9 +38,30 @@ typedef struct string_buf {
 
 typedef struct {
     int32_t fd;
-    int8_t dirty;
+    int8_t writer;          // opened for writing
+    struct open_file *of;   // dirty state shared with other handles of the file
+    struct chunk_map *map;  // NULL when the cache file is complete
+
+    /* readahead state, guarded by map->lock */
+    off_t ra_next;          // where a sequential read would continue
+    uint32_t ra_window;     // chunks to keep ahead, 0 = not sequential
+    uint32_t ra_issued;     // first chunk not queued for prefetch yet
 } fh_t;
 
+/* SHA-256 of a chunk's bytes as lowercase hex, names it in the chunk store */
+typedef struct {
+    char hex[65];
+    uint32_t crc;       // CRC-32C of the same bytes, checked by the server
+} chunk_hash_t;
+
+/* One ranged GET of http_get_chunks_multi */
+typedef struct {
+    char url[URL_MAX];
+    off_t offset;       // where the body lands in the file
+    size_t expect;      // body length that counts as success
+    int rc;             // out
+} chunk_req_t;
+
 size_t write_cb(void *data, size_t size, size_t nmemb, void *userp);
 
 
@@ -37,29 +73,38 @@ static inline const char* base_name(const char *p) {
     return slash ? slash + 1 : p;
 }
 
-/* Treats ANY dot-basename as a temp file, except for commands */
-static inline int is_temp_path(const char *p) {
-    if (IS_COMMAND_PATH(p))
-        return 0;
-    const char *b = base_name(p);
-    return b[0] == '.';
-}
 int same_parent_dir(const char *a, const char *b) ;
+int path_under(const char *path, const char *dir, size_t len);
+uint32_t path_hash(const char *path);
+void deadline_after(struct timespec *ts, long ms);
 
 
 
 int http_request(const char *url, string_buf_t *resp, u_int32_t *status);
 int http_post_status(const char *url, uint32_t *status_out);
-int http_get_stream(const char *url, FILE *out);
-int http_post_stream(const char *url, const void *data, size_t len, uint32_t *status);
+int http_get_if(const char *url, const char *etag, string_buf_t *resp, uint32_t *status);
+int http_get_chunks_multi(chunk_req_t *reqs, int n, int fd, int streams);
+int http_post_json(const char *url, const char *json, string_buf_t *resp, uint32_t *status);
 
 char *url_encode(const char* path);
+long env_long(const char *name, long def);
 void mkdir_p(const char *dir);
 
-int upload_file_chunks(const char *logical_path, int current_user_id, size_t size, const char *cache_path, time_t mtime);
+
+int upload_prep(const char *logical_path, int current_user_id, size_t size, time_t mtime,
+                const uint8_t *dirty, uint32_t n_dirty, uint8_t **send_out);
+int upload_prep_cdc(const char *logical_path, int current_user_id, size_t size, time_t mtime,
+                    const off_t *offsets, const chunk_hash_t *hashes, uint32_t n, uint8_t **send_out);
+int upload_send_chunks(const char *logical_path, int current_user_id, size_t size,
+                       const char *cache_path, uint8_t *send,
+                       const off_t *offsets, const chunk_hash_t *hashes, uint32_t n_chunks,
+                       const int *abort);
+int range_is_zero(int fd, off_t offset, size_t len);
+int zero_file_range(int fd, off_t offset, size_t len);
+int hash_file_range(int fd, off_t offset, size_t len, chunk_hash_t *out);
+int upload_file_chunks(const char *logical_path, int current_user_id, size_t size, const char *cache_path,
+                       time_t mtime, const int *abort);
 
 
-int backend_unlink(int current_user_id, const char *path);
-int backend_exists(int current_user_id, const char *path, int *exists_out);
 
 int cache_swap(const char *a, const char *b);
\ No newline at end of file
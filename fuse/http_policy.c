@@ -0,0 +1,160 @@
+#include "http_policy.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+static long timeout_ms = HTTP_TIMEOUT_MS_DEFAULT;
+static int tries = HTTP_TRIES_DEFAULT;
+static int hedge = 1;
+static long hedge_min_ms = HEDGE_MIN_MS_DEFAULT;
+static char user_agent[48];    // tells this mount apart in the server's change feed
+
+/* Latencies of recent chunk GETs, p95 recomputed every few samples */
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static long samples[LATENCY_SAMPLES];
+static int n_samples, next_sample;
+static long p95_ms;
+
+
+/* Tunables: DISFS_HTTP_TIMEOUT_MS, DISFS_HTTP_TRIES, DISFS_HEDGE=0 turns
+ * hedged chunk GETs off, DISFS_HEDGE_MIN_MS */
+void http_policy_init(void)
+{
+    timeout_ms = env_long("DISFS_HTTP_TIMEOUT_MS", HTTP_TIMEOUT_MS_DEFAULT);
+    if (timeout_ms <= 0)
+        timeout_ms = HTTP_TIMEOUT_MS_DEFAULT;
+    tries = env_long("DISFS_HTTP_TRIES", HTTP_TRIES_DEFAULT);
+    if (tries <= 0)
+        tries = 1;
+    hedge = env_long("DISFS_HEDGE", 1) != 0;
+    hedge_min_ms = env_long("DISFS_HEDGE_MIN_MS", HEDGE_MIN_MS_DEFAULT);
+    if (hedge_min_ms <= 0)
+        hedge_min_ms = HEDGE_MIN_MS_DEFAULT;
+
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+        id = (uint64_t)getpid() << 32 ^ (uint64_t)mono_ms();
+    snprintf(user_agent, sizeof(user_agent), "disfs/%016llx", (unsigned long long)id);
+    LOGMSG("[HTTP] deadline %ldms, %d tries, hedging %s, client %s", timeout_ms, tries,
+           hedge ? "on" : "off", user_agent);
+}
+
+
+long long mono_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Metadata calls get a hard deadline. Chunk transfers (bulk) can take
+ * long on a slow link, they are only dropped once they stall. */
+void http_policy_apply(CURL *c, int bulk)
+{
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT_MS, (long)HTTP_CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(c, CURLOPT_USERAGENT, user_agent);
+    if (bulk) {
+        curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+        curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, (long)HTTP_STALL_SECS);
+    } else {
+        curl_easy_setopt(c, CURLOPT_TIMEOUT_MS, timeout_ms);
+    }
+}
+
+
+int http_tries(void)
+{
+    return tries;
+}
+
+
+long http_timeout_ms(void)
+{
+    return timeout_ms;
+}
+
+
+/* 1 if trying again may succeed. Requests that never reached the server,
+ * or that it turned away (429, 503), are always safe to resend. Anything
+ * else only when idempotent, a POST may have been applied already. */
+int http_transient(CURLcode rc, long code, int idempotent)
+{
+    if (rc == CURLE_COULDNT_CONNECT || rc == CURLE_COULDNT_RESOLVE_HOST)
+        return 1;
+    if (rc == CURLE_OK && (code == 429 || code == 503))
+        return 1;
+    if (!idempotent)
+        return 0;
+    if (rc != CURLE_OK)
+        return rc != CURLE_WRITE_ERROR && rc != CURLE_ABORTED_BY_CALLBACK;
+    return code == 408 || code == 500 || code == 502 || code == 504;
+}
+
+
+/* Full jitter exponential backoff, a Retry-After from the server wins if longer */
+long http_backoff_ms(CURL *c, int attempt)
+{
+    static __thread unsigned seed;
+    if (!seed)
+        seed = (unsigned)mono_ms() ^ (unsigned)(uintptr_t)&seed;
+
+    long cap = HTTP_BACKOFF_BASE_MS << (attempt < 6 ? attempt : 6);
+    if (cap > HTTP_BACKOFF_MAX_MS)
+        cap = HTTP_BACKOFF_MAX_MS;
+    long delay = HTTP_BACKOFF_BASE_MS / 2 + rand_r(&seed) % cap;
+
+    curl_off_t after = 0;
+    if (c && curl_easy_getinfo(c, CURLINFO_RETRY_AFTER, &after) == CURLE_OK &&
+        after > 0 && after * 1000 > delay)
+        delay = (long)after * 1000;
+    return delay;
+}
+
+
+void http_sleep_ms(long ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+
+static int _cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Time a successful chunk GET took, from request to last byte */
+void chunk_latency_record(long ms)
+{
+    pthread_mutex_lock(&lat_lock);
+    samples[next_sample] = ms;
+    next_sample = (next_sample + 1) % LATENCY_SAMPLES;
+    if (n_samples < LATENCY_SAMPLES)
+        n_samples++;
+
+    if (n_samples >= LATENCY_MIN_SAMPLES && next_sample % 8 == 0) {
+        long sorted[LATENCY_SAMPLES];
+        memcpy(sorted, samples, n_samples * sizeof(long));
+        qsort(sorted, n_samples, sizeof(long), _cmp_long);
+        p95_ms = sorted[(n_samples * 95) / 100];
+    }
+    pthread_mutex_unlock(&lat_lock);
+}
+
+
+/* How long a chunk GET may run before a duplicate is sent, 0 = never */
+long chunk_hedge_after_ms(void)
+{
+    if (!hedge)
+        return 0;
+    pthread_mutex_lock(&lat_lock);
+    long returner = p95_ms > hedge_min_ms ? p95_ms : hedge_min_ms;
+    pthread_mutex_unlock(&lat_lock);
+    return returner;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <curl/curl.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+/* How requests to the server are timed, retried and hedged. */
+#define HTTP_TIMEOUT_MS_DEFAULT 30000   // deadline of a metadata call, retries included
+#define HTTP_CONNECT_TIMEOUT_MS 5000
+#define HTTP_TRIES_DEFAULT 4            // attempts of one request
+#define HTTP_BACKOFF_BASE_MS 100
+#define HTTP_BACKOFF_MAX_MS 5000
+#define HTTP_STALL_SECS 30              // chunk transfers under 1 KB/s this long are dropped
+#define HEDGE_MIN_MS_DEFAULT 1000       // never hedge a chunk GET sooner than this
+#define LATENCY_SAMPLES 128             // recent chunk GETs the p95 is taken over
+#define LATENCY_MIN_SAMPLES 20          // fewer than this, HEDGE_MIN_MS alone decides
+
+
+void http_policy_init(void);
+long long mono_ms(void);
+
+void http_policy_apply(CURL *c, int bulk);
+int http_tries(void);
+long http_timeout_ms(void);
+int http_transient(CURLcode rc, long code, int idempotent);
+long http_backoff_ms(CURL *c, int attempt);
+void http_sleep_ms(long ms);
+
+void chunk_latency_record(long ms);
+long chunk_hedge_after_ms(void);
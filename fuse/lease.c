@@ -0,0 +1,399 @@
+#include "lease.h"
+#include "attr_cache.h"
+#include "http_policy.h"
+#include <cjson/cJSON.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LEASE_BUCKETS 1024
+
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t user_cond = PTHREAD_COND_INITIALIZER;  // user changed or stop
+static pthread_t thread;
+static int running;
+static int stopping;            // also read by curl's progress callback
+
+/* Guarded by lease_lock */
+static int user_id;             // 0 while logged out
+static char lease_id[64];       // empty without a lease
+static char boot[64];           // server instance the lease is from
+static long long expires;       // mono_ms, 0 without a lease
+static long long renew_ms = LEASE_RENEW_MS;
+static long long since;         // last change seen on the feed
+static uint64_t epoch;          // bumped whenever trust is withdrawn
+static lease_path_t *table[LEASE_BUCKETS];
+static int n_paths;
+
+static uint64_t stat_covered, stat_changes, stat_lost;
+
+
+/* Stops trusting path (and with tree, everything below it), caller holds lease_lock */
+static void _forget(const char *path, int tree)
+{
+    epoch++;
+    size_t len = strlen(path);
+    for (int b = 0; b < LEASE_BUCKETS; b++) {
+        if (!tree && b != (int)(path_hash(path) % LEASE_BUCKETS))
+            continue;
+        lease_path_t **indirect = &table[b];
+        while (*indirect) {
+            lease_path_t *cur = *indirect;
+            if (tree ? !path_under(cur->path, path, len) : strcmp(cur->path, path) != 0) {
+                indirect = &cur->next;
+                continue;
+            }
+            *indirect = cur->next;
+            free(cur->path);
+            free(cur);
+            n_paths--;
+        }
+    }
+}
+
+/* Lease gone, nothing can be vouched for until a new one is read from its start */
+static void _lose(void)
+{
+    if (expires)
+        STAT_ADD(stat_lost, 1);
+    expires = 0;
+    lease_id[0] = '\0';
+    _forget("/", 1);
+}
+
+static void _wait_ms(long ms)
+{
+    struct timespec ts;
+    deadline_after(&ts, ms);
+    pthread_cond_timedwait(&user_cond, &lease_lock, &ts);
+}
+
+
+/* Long polls have to give way to unmount */
+static int _abort_cb(void *p, curl_off_t dltotal, curl_off_t dlnow,
+                     curl_off_t ultotal, curl_off_t ulnow)
+{
+    return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+static int _request(const char *url, int post, string_buf_t *resp, uint32_t *status)
+{
+    CURL *c = curl_easy_init();
+    if (!c)
+        return -EIO;
+    curl_easy_setopt(c, CURLOPT_URL, url);
+    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, resp);
+    if (post) {
+        curl_easy_setopt(c, CURLOPT_POST, 1L);
+        curl_easy_setopt(c, CURLOPT_POSTFIELDS, "");
+    }
+    http_policy_apply(c, 0);
+    curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(c, CURLOPT_XFERINFOFUNCTION, _abort_cb);
+
+    CURLcode rc = curl_easy_perform(c);
+    long code = 0;
+    curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_cleanup(c);
+    *status = (uint32_t)code;
+    return rc == CURLE_OK ? 0 : -ECOMM;
+}
+
+
+/* Takes (or renews) the read lease on "/" */
+static int _grant(int uid)
+{
+    pthread_mutex_lock(&lease_lock);
+    char id[sizeof(lease_id)];
+    memcpy(id, lease_id, sizeof(id));
+    pthread_mutex_unlock(&lease_lock);
+
+    char url[URL_MAX];
+    snprintf(url, sizeof(url), "%s/lease?user_id=%d&path=/&subtree=1&mode=read%s%s",
+             get_server_url(), uid, id[0] ? "&id=" : "", id);
+
+    long long started = mono_ms();
+    string_buf_t resp = {0};
+    uint32_t status = 0;
+    int rc = _request(url, 1, &resp, &status);
+    if (rc == 0 && status != 201)
+        rc = status == 409 ? -EBUSY : -EIO;
+    cJSON *root = rc == 0 ? cJSON_Parse(resp.ptr) : NULL;
+    free(resp.ptr);
+    if (rc != 0)
+        return rc;
+
+    cJSON *j_id = cJSON_GetObjectItemCaseSensitive(root, "id");
+    cJSON *j_ttl = cJSON_GetObjectItemCaseSensitive(root, "ttl");
+    cJSON *j_seq = cJSON_GetObjectItemCaseSensitive(root, "seq");
+    cJSON *j_boot = cJSON_GetObjectItemCaseSensitive(root, "boot");
+    if (!cJSON_IsString(j_id) || !cJSON_IsNumber(j_ttl) ||
+        !cJSON_IsNumber(j_seq) || !cJSON_IsString(j_boot)) {
+        cJSON_Delete(root);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&lease_lock);
+    if (uid == user_id) {
+        /* A fresh lease covers nothing validated before it, the feed is
+         * read from where the server stands now */
+        if (!expires || strcmp(boot, j_boot->valuestring) != 0) {
+            _lose();
+            since = (long long)j_seq->valuedouble;
+            snprintf(boot, sizeof(boot), "%s", j_boot->valuestring);
+        }
+        snprintf(lease_id, sizeof(lease_id), "%s", j_id->valuestring);
+        long long ttl_ms = (long long)j_ttl->valuedouble * 1000;
+        renew_ms = ttl_ms / 2 < LEASE_RENEW_MS ? ttl_ms / 2 : LEASE_RENEW_MS;
+        expires = started + ttl_ms;  // counted from before asking, errs on the safe side
+    }
+    pthread_mutex_unlock(&lease_lock);
+    cJSON_Delete(root);
+    return 0;
+}
+
+
+/* Waits for changes on the feed, drops what other clients touched */
+static int _poll(int uid)
+{
+    pthread_mutex_lock(&lease_lock);
+    long long from = since;
+    long wait = (long)((expires - mono_ms() - renew_ms) / 1000);
+    pthread_mutex_unlock(&lease_lock);
+
+    if (wait > LEASE_POLL_SECS)
+        wait = LEASE_POLL_SECS;
+    if (wait > http_timeout_ms() / 2000)
+        wait = http_timeout_ms() / 2000;
+    if (wait < 1)
+        wait = 1;
+
+    char url[URL_MAX];
+    snprintf(url, sizeof(url), "%s/changes?user_id=%d&since=%lld&wait=%ld",
+             get_server_url(), uid, from, wait);
+
+    string_buf_t resp = {0};
+    uint32_t status = 0;
+    int rc = _request(url, 0, &resp, &status);
+    if (rc == 0 && status != 201)
+        rc = -EIO;
+    cJSON *root = rc == 0 ? cJSON_Parse(resp.ptr) : NULL;
+    free(resp.ptr);
+    if (rc != 0)
+        return rc;
+
+    cJSON *j_seq = cJSON_GetObjectItemCaseSensitive(root, "seq");
+    cJSON *j_boot = cJSON_GetObjectItemCaseSensitive(root, "boot");
+    cJSON *j_reset = cJSON_GetObjectItemCaseSensitive(root, "reset");
+    cJSON *j_changes = cJSON_GetObjectItemCaseSensitive(root, "changes");
+    if (!cJSON_IsNumber(j_seq) || !cJSON_IsString(j_boot) || !cJSON_IsArray(j_changes)) {
+        cJSON_Delete(root);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&lease_lock);
+    if (uid != user_id || from != since) {
+        pthread_mutex_unlock(&lease_lock);  // logged out or lease lost meanwhile
+        cJSON_Delete(root);
+        return 0;
+    }
+    if (cJSON_IsTrue(j_reset) || strcmp(boot, j_boot->valuestring) != 0) {
+        /* Changes were missed, start over with a new lease */
+        LOGMSG("[LEASE] feed reset at %lld", from);
+        _lose();
+        pthread_mutex_unlock(&lease_lock);
+        cJSON_Delete(root);
+        attr_cache_clear();
+        return 0;
+    }
+
+    cJSON *item;
+    cJSON_ArrayForEach(item, j_changes) {
+        cJSON *j_path = cJSON_GetObjectItemCaseSensitive(item, "path");
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "own")) ||
+            !cJSON_IsString(j_path))
+            continue;
+        _forget(j_path->valuestring, cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "tree")));
+        STAT_ADD(stat_changes, 1);
+    }
+    since = (long long)j_seq->valuedouble;
+    pthread_mutex_unlock(&lease_lock);
+
+    /* Attribute answers go stale the same way */
+    cJSON_ArrayForEach(item, j_changes) {
+        cJSON *j_path = cJSON_GetObjectItemCaseSensitive(item, "path");
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "own")) ||
+            !cJSON_IsString(j_path))
+            continue;
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "tree")))
+            attr_cache_invalidate_tree(j_path->valuestring);
+        else
+            attr_cache_invalidate(j_path->valuestring);
+    }
+    cJSON_Delete(root);
+    return 0;
+}
+
+
+static void *_lease_thread(void *arg)
+{
+    long backoff = 0;
+    pthread_mutex_lock(&lease_lock);
+    while (!stopping) {
+        int uid = user_id;
+        if (!uid) {
+            pthread_cond_wait(&user_cond, &lease_lock);
+            continue;
+        }
+        int renew = expires - mono_ms() < renew_ms;
+        pthread_mutex_unlock(&lease_lock);
+
+        int rc = renew ? _grant(uid) : 0;
+        if (rc == 0)
+            rc = _poll(uid);
+
+        pthread_mutex_lock(&lease_lock);
+        if (rc == 0 || stopping || uid != user_id) {
+            backoff = 0;
+            continue;
+        }
+        _lose();
+        backoff = backoff ? backoff * 2 : 1000;
+        if (backoff > LEASE_BACKOFF_MAX_MS)
+            backoff = LEASE_BACKOFF_MAX_MS;
+        LOGMSG("[LEASE] lost (%d), retrying in %ldms", rc, backoff);
+        _wait_ms(backoff);
+    }
+    pthread_mutex_unlock(&lease_lock);
+    return NULL;
+}
+
+
+/* Tunables: DISFS_LEASES=0 revalidates every open as before */
+void lease_init(void)
+{
+    if (env_long("DISFS_LEASES", 1) == 0) {
+        LOGMSG("[LEASE] off");
+        return;
+    }
+    stopping = 0;
+    running = pthread_create(&thread, NULL, _lease_thread, NULL) == 0;
+    LOGMSG("[LEASE] %s", running ? "following /changes" : "thread failed, off");
+}
+
+
+void lease_exit(void)
+{
+    pthread_mutex_lock(&lease_lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&user_cond);
+    pthread_mutex_unlock(&lease_lock);
+    if (running)
+        pthread_join(thread, NULL);
+    running = 0;
+
+    /* Hand it back, a writer elsewhere needn't wait for it to run out */
+    pthread_mutex_lock(&lease_lock);
+    char url[URL_MAX];
+    int held = expires > mono_ms();
+    if (held)
+        snprintf(url, sizeof(url), "%s/lease?user_id=%d&id=%s&release=1",
+                 get_server_url(), user_id, lease_id);
+    _lose();
+    pthread_mutex_unlock(&lease_lock);
+    if (held) {
+        uint32_t status = 0;
+        http_post_status(url, &status);
+    }
+}
+
+
+/* Logins switch the feed over, trust doesn't carry across users */
+void lease_set_user(int uid)
+{
+    pthread_mutex_lock(&lease_lock);
+    if (uid != user_id) {
+        _lose();
+        user_id = uid;
+        boot[0] = '\0';
+        pthread_cond_broadcast(&user_cond);
+    }
+    pthread_mutex_unlock(&lease_lock);
+}
+
+
+uint64_t lease_epoch(void)
+{
+    pthread_mutex_lock(&lease_lock);
+    uint64_t e = epoch;
+    pthread_mutex_unlock(&lease_lock);
+    return e;
+}
+
+
+/* 1 if the cache of path is known current, no need to ask the server */
+int lease_covers(const char *path)
+{
+    int hit = 0;
+    pthread_mutex_lock(&lease_lock);
+    if (expires > mono_ms()) {
+        lease_path_t *p = table[path_hash(path) % LEASE_BUCKETS];
+        while (p && strcmp(p->path, path) != 0)
+            p = p->next;
+        hit = p != NULL;
+    }
+    pthread_mutex_unlock(&lease_lock);
+    if (hit)
+        STAT_ADD(stat_covered, 1);
+    return hit;
+}
+
+
+/* The cache of path was just validated against the server. Kept only if
+ * nothing was withdrawn since seen was taken, before asking. */
+void lease_note(const char *path, uint64_t seen)
+{
+    pthread_mutex_lock(&lease_lock);
+    if (seen != epoch || expires <= mono_ms() || n_paths >= LEASE_TRUST_MAX) {
+        pthread_mutex_unlock(&lease_lock);
+        return;
+    }
+    unsigned b = path_hash(path) % LEASE_BUCKETS;
+    lease_path_t *p = table[b];
+    while (p && strcmp(p->path, path) != 0)
+        p = p->next;
+    if (!p && (p = calloc(1, sizeof(*p)))) {
+        if ((p->path = strdup(path))) {
+            p->next = table[b];
+            table[b] = p;
+            n_paths++;
+        } else {
+            free(p);
+        }
+    }
+    pthread_mutex_unlock(&lease_lock);
+}
+
+
+int lease_stats(char *buf, size_t size)
+{
+    pthread_mutex_lock(&lease_lock);
+    long long left = expires - mono_ms();
+    int paths = n_paths;
+    long long seq = since;
+    pthread_mutex_unlock(&lease_lock);
+
+    return snprintf(buf, size,
+            "[Leases]\n"
+            "- Lease: %s, %llds left, feed at %lld\n"
+            "- Trusted paths: %d\n"
+            "- Opens without revalidation: %lu\n"
+            "- Changes from other clients: %lu\n"
+            "- Lost: %lu\n",
+            left > 0 ? "held" : "none", left > 0 ? left / 1000 : 0, seq, paths,
+            (unsigned long)STAT_GET(stat_covered),
+            (unsigned long)STAT_GET(stat_changes),
+            (unsigned long)STAT_GET(stat_lost));
+}
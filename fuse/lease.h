@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+#define LEASE_POLL_SECS 10          // longest a /changes poll is held open
+#define LEASE_RENEW_MS 15000        // renew once less than this is left
+#define LEASE_BACKOFF_MAX_MS 30000  // between attempts while the server is unreachable
+#define LEASE_TRUST_MAX 16384       // paths remembered as current
+
+
+/* A read lease on the user's whole tree, kept by a background thread that
+ * also follows the server's /changes feed. While it holds, a cache file
+ * validated once stays trusted until the feed says another client changed
+ * it, so opening it again costs no round trip. Losing the lease (feed
+ * down, server restarted, changes missed) forgets every path.
+ */
+typedef struct lease_path {
+    char *path;
+    struct lease_path *next;
+} lease_path_t;
+
+
+void lease_init(void);
+void lease_exit(void);
+void lease_set_user(int user_id);
+
+uint64_t lease_epoch(void);
+int lease_covers(const char *path);
+void lease_note(const char *path, uint64_t epoch);
+int lease_stats(char *buf, size_t size);
@@ -13,6 +13,18 @@
 #include "fuse_utils.h"
 #include "server_config.h"
 #include "cache_manage.h"
+#include "chunk_map.h"
+#include "prefetch.h"
+#include "upload_queue.h"
+#include "open_file.h"
+#include "chunker.h"
+#include "compress.h"
+#include "buf_pool.h"
+#include "http_policy.h"
+#include "crc32c.h"
+#include "attr_cache.h"
+#include "lease.h"
+#include "meta_log.h"
 #include "debug.h"  // Temporary
 
 static int current_user_id;
@@ -29,40 +41,68 @@ static int logged_in;
 
 
 
-static int do_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+/* Fills st from a /stat reply, or one /listdir entry */
+static int stat_from_json(const cJSON *root, struct stat *st)
 {
-    memset(st, 0, sizeof(struct stat));
-    
-    if (strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;
+    cJSON *t = cJSON_GetObjectItemCaseSensitive(root, "type");
+    if (!cJSON_IsNumber(t))
+        return -ENOENT;
+
+    int type = t->valueint;
+    if (type == 2) {
+        // Directory
+        st->st_mode  = S_IFDIR | 0755;
         st->st_nlink = 2;
-        st->st_uid = fuse_get_context()->uid;
-        st->st_gid = fuse_get_context()->gid;
-        return 0;
     }
+    else if (type == 1) {
+        // File
+        st->st_mode  = S_IFREG | 0644;
+        st->st_nlink = 1;
 
-    if (IS_COMMAND_PATH(path)) {
-        if (strcmp(path, "/.command/doggo") == 0 ||
-            strncmp(path, CSTR_LEN("/.command/ping/")) == 0 ||
-            strncmp(path, CSTR_LEN("/.command/register/")) == 0 ||
-            strncmp(path, CSTR_LEN("/.command/changeip/")) == 0 ||
-            strncmp(path, CSTR_LEN("/.command/changeurl/")) == 0 ||
-            strcmp(path, "/.command/pong") == 0) {
+        cJSON *sz = cJSON_GetObjectItemCaseSensitive(root, "size");
+        if (cJSON_IsNumber(sz))
+            st->st_size = (off_t)sz->valuedouble;
+    }
+    else {
+        return -ENOENT;
+    }
+    
+    st->st_uid = fuse_get_context()->uid;
+    st->st_gid = fuse_get_context()->gid;
 
-            st->st_mode = S_IFREG | 0644;
-            st->st_nlink = 1;
-            st->st_size = 128;
-            return 0;
-        }
+    SET_TIME(st_atime,  "atime");
+    SET_TIME(st_mtime,  "mtime");
+    SET_TIME(st_ctime,  "ctime");
+    // Not all systems support creation time
+    #ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
+        SET_TIME(st_birthtime, "crtime");
+    #endif
+    return 0;
+}
 
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
-        return 0;
+/* Local copy is ahead of the server while open handles hold unshipped
+ * writes and until its upload lands, so is an mtime still in the op log */
+static void stat_pending(const char *path, struct stat *st)
+{
+    time_t mtime;
+    if (meta_log_mtime(current_user_id, path, &mtime))
+        st->st_mtime = mtime;
+    if (!S_ISREG(st->st_mode))
+        return;
+    char cache_path[PATH_MAX];
+    BUILD_CACHE_PATH(cache_path, current_user_id, path);
+    if (!open_file_dirty(cache_path) && !upload_queue_pending(path, current_user_id))
+        return;
+    struct stat local;
+    if (stat(cache_path, &local) == 0) {
+        st->st_size = local.st_size;
+        st->st_mtime = local.st_mtime;
     }
+}
 
-    if (!logged_in)
-        return -EACCES;
-
+/* Attributes of path as the server has them */
+static int stat_remote(const char *path, struct stat *st)
+{
     char *esc = url_encode(path);
     if (!esc)
         return -EIO;
@@ -97,42 +137,103 @@ static int do_getattr(const char *path, struct stat *st, struct fuse_file_info *
     free(resp.ptr);
     if (!root) return -ENOENT;
 
-    cJSON *t = cJSON_GetObjectItemCaseSensitive(root, "type");
-    if (!cJSON_IsNumber(t)) { cJSON_Delete(root); return -ENOENT; }
+    rc = stat_from_json(root, st);
+    cJSON_Delete(root);
+    return rc;
+}
 
-    int type = t->valueint;
-    if (type == 2) {
-        // Directory
-        st->st_mode  = S_IFDIR | 0755;
-        st->st_nlink = 2;
-    }
-    else if (type == 1) {
-        // File
-        st->st_mode  = S_IFREG | 0644;
-        st->st_nlink = 1;
 
-        cJSON *sz = cJSON_GetObjectItemCaseSensitive(root, "size");
-        if (cJSON_IsNumber(sz))
-            st->st_size = (off_t)sz->valueint;
+/* Attributes of path as seen from here: ops not on the server yet first,
+ * then the attribute cache, then the server */
+static int stat_path(const char *path, struct stat *st)
+{
+    int rc = meta_log_stat(current_user_id, path, st);
+    if (rc != 1) {
+        st->st_uid = fuse_get_context()->uid;
+        st->st_gid = fuse_get_context()->gid;
+        return rc;
     }
-    else {
-        cJSON_Delete(root);
-        return -ENOENT;
+
+    /* Shells and build tools stat the same paths over and over, a
+     * fresh answer (or "no such file") is served from memory */
+    uint64_t epoch = attr_cache_epoch();
+    rc = attr_cache_get(path, st);
+    if (rc == 1) {
+        rc = stat_remote(path, st);
+        if (rc == 0)
+            attr_cache_put(path, st, epoch);
+        else if (rc == -ENOENT)
+            attr_cache_put_negative(path, epoch);
     }
+    if (rc != 0)
+        return rc;
+
+    stat_pending(path, st);
+    return 0;
+}
+
+
+static int do_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    memset(st, 0, sizeof(struct stat));
     
-    st->st_uid = fuse_get_context()->uid;
-    st->st_gid = fuse_get_context()->gid;
+    if (strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        st->st_uid = fuse_get_context()->uid;
+        st->st_gid = fuse_get_context()->gid;
+        return 0;
+    }
 
-    SET_TIME(st_atime,  "atime");
-    SET_TIME(st_mtime,  "mtime");
-    SET_TIME(st_ctime,  "ctime");
-    // Not all systems support creation time
-    #ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
-        SET_TIME(st_birthtime, "crtime");
-    #endif
+    if (IS_COMMAND_PATH(path)) {
+        if (strcmp(path, "/.command/doggo") == 0 ||
+            strncmp(path, CSTR_LEN("/.command/ping/")) == 0 ||
+            strncmp(path, CSTR_LEN("/.command/register/")) == 0 ||
+            strncmp(path, CSTR_LEN("/.command/changeip/")) == 0 ||
+            strncmp(path, CSTR_LEN("/.command/changeurl/")) == 0 ||
+            strcmp(path, "/.command/pong") == 0) {
 
-    cJSON_Delete(root);
-    return 0;
+            st->st_mode = S_IFREG | 0644;
+            st->st_nlink = 1;
+            st->st_size = 128;
+            return 0;
+        }
+
+        /* Longer than the rest, reads stop at the end of the text */
+        if (strcmp(path, "/.command/stats") == 0) {
+            st->st_mode = S_IFREG | 0444;
+            st->st_nlink = 1;
+            st->st_size = 4096;
+            return 0;
+        }
+
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    if (!logged_in)
+        return -EACCES;
+    return stat_path(path, st);
+}
+
+
+typedef struct {
+    void *buf;
+    fuse_fill_dir_t filler;
+    int plus;
+} readdir_ctx_t;
+
+static void fill_logged(const char *name, const struct stat *st, void *arg)
+{
+    readdir_ctx_t *ctx = arg;
+    struct stat full = *st;
+    full.st_uid = fuse_get_context()->uid;
+    full.st_gid = fuse_get_context()->gid;
+    if (ctx->plus)
+        ctx->filler(ctx->buf, name, &full, 0, FUSE_FILL_DIR_PLUS);
+    else
+        ctx->filler(ctx->buf, name, NULL, 0, 0);
 }
 
 
@@ -152,6 +253,7 @@ static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         filler(buf, "ping (login)", NULL, 0, 0);
         filler(buf, "pong (logout)", NULL, 0, 0);
         filler(buf, "doggo (dog gif)", NULL, 0, 0);
+        filler(buf, "stats (prefetch counters)", NULL, 0, 0);
         return 0;
     }
 
@@ -182,26 +284,56 @@ static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             get_server_url(), current_user_id, esc);
     curl_free(esc);
 
+    /* Entries come with their attributes, they go to the kernel
+     * (readdirplus) and the attribute cache, so ls -l and find don't
+     * stat every entry on their own */
+    uint64_t epoch = attr_cache_epoch();
+    int plus = flags & FUSE_READDIR_PLUS;
+    size_t dir_len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+
     string_buf_t resp = {0};
     uint32_t status = 0;
     if (http_request(url, &resp, &status) == 0) {
-        if (status != 201) {
-            free(resp.ptr);
-            return 0;
-        }
-
-        cJSON *array = cJSON_Parse(resp.ptr);
+        /* A directory only in the op log is unknown to the server */
+        cJSON *array = status == 201 ? cJSON_Parse(resp.ptr) : NULL;
         free(resp.ptr);
         if (cJSON_IsArray(array)) {
             cJSON *item;
             cJSON_ArrayForEach(item, array) {
                 cJSON *item_name = cJSON_GetObjectItemCaseSensitive(item, "name");
-                if (cJSON_IsString(item_name))
+                if (!cJSON_IsString(item_name))
+                    continue;
+
+                char child[PATH_MAX];
+                struct stat st;
+                memset(&st, 0, sizeof(st));
+                if (dir_len + 1 + strlen(item_name->valuestring) >= sizeof(child) ||
+                    stat_from_json(item, &st) != 0) {
+                    filler(buf, item_name->valuestring, NULL, 0, 0);
+                    continue;
+                }
+                memcpy(child, path, dir_len);
+                child[dir_len] = '/';
+                strcpy(child + dir_len + 1, item_name->valuestring);
+
+                /* Entries the op log made or removed are its to list */
+                struct stat logged;
+                if (meta_log_stat(current_user_id, child, &logged) != 1)
+                    continue;
+
+                attr_cache_put(child, &st, epoch);
+                stat_pending(child, &st);
+                if (plus)
+                    filler(buf, item_name->valuestring, &st, 0, FUSE_FILL_DIR_PLUS);
+                else
                     filler(buf, item_name->valuestring, NULL, 0, 0);
             }
         }
         cJSON_Delete(array);
     }
+
+    readdir_ctx_t ctx = { .buf = buf, .filler = filler, .plus = plus };
+    meta_log_children(current_user_id, path, fill_logged, &ctx);
     return 0;
 }
 
@@ -244,6 +376,8 @@ static int do_read(const char *path, char *buf, size_t size, off_t offset,
                     // making sure '\0' doesn't get overwritten
                     memcpy(current_username, name, sizeof(name)-1);
                     logged_in = 1;
+                    attr_cache_clear();  // answers were for the last user
+                    lease_set_user(id);
                     free(resp.ptr);
                     LOGMSG("Registered/logged in now! :D");
                     return snprintf(buf, size, "Registered and Logged in as \"%s\".\n", name);
@@ -271,6 +405,8 @@ static int do_read(const char *path, char *buf, size_t size, off_t offset,
                     // making sure '\0' doesn't get overwritten
                     memcpy(current_username, name, sizeof(name)-1);
                     logged_in = 1;
+                    attr_cache_clear();  // answers were for the last user
+                    lease_set_user(id);
                     free(resp.ptr);
                     LOGMSG("logged in now! :D");
                     return snprintf(buf, size, "Logged in as \"%s\".\n", name);
@@ -283,9 +419,28 @@ static int do_read(const char *path, char *buf, size_t size, off_t offset,
         if (logged_in && strncmp(path, CSTR_LEN("/.command/pong")) == 0) {
             current_user_id = 0;
             logged_in = 0;
+            attr_cache_clear();
+            lease_set_user(0);
             return snprintf(buf, size, "Successfully logged out.\n");
         }
 
+        if (strcmp(path, "/.command/stats") == 0) {
+            char text[1536];
+            int len = prefetch_stats(text, sizeof(text));
+            if (len >= 0 && (size_t)len < sizeof(text))
+                len += attr_cache_stats(text + len, sizeof(text) - len);
+            if (len >= 0 && (size_t)len < sizeof(text))
+                len += lease_stats(text + len, sizeof(text) - len);
+            if (len >= 0 && (size_t)len < sizeof(text))
+                len += meta_log_stats(text + len, sizeof(text) - len);
+            if (len < 0 || offset >= len)
+                return 0;
+            if ((size_t)(len - offset) < size)
+                size = len - offset;
+            memcpy(buf, text + offset, size);
+            return (int)size;
+        }
+
         if (strncmp(path, CSTR_LEN("/.command/doggo")) == 0) {
             char url[512];
             snprintf(url, sizeof(url), "%s/dog_gif", get_server_url());
@@ -305,6 +460,12 @@ static int do_read(const char *path, char *buf, size_t size, off_t offset,
     fh_t *fh = (fh_t*)(uintptr_t)fi->fh;
     if (!fh)
         return -EBADF;
+    if (fh->map) {
+        prefetch_on_read(fh, path, current_user_id, offset, size);
+        int rc = chunk_map_fetch(fh->map, path, current_user_id, offset, size);
+        if (rc != 0)
+            return rc;
+    }
     int fd = fh->fd;
     ssize_t written = pread(fd, buf, size, offset);
     if (written < 0)
@@ -313,12 +474,30 @@ static int do_read(const char *path, char *buf, size_t size, off_t offset,
 }
 
 
+/* With DISFS_ASYNC_META the change is only logged here, the server gets
+ * it with a later batch. 1 if it has to go to the server right away, after
+ * whatever was logged before it. */
+static int log_op(int op, const char *path, time_t mtime)
+{
+    if (meta_log_enabled() && meta_log_append(current_user_id, op, path, mtime) == 0) {
+        attr_cache_invalidate(path);
+        return 0;
+    }
+    int rc = meta_log_barrier();
+    return rc ? rc : 1;
+}
+
+
 static int do_mkdir(const char *path, mode_t mode)
 {
     LOGMSG("IN mkdir");
     if (!logged_in || path[1] == '.')
         return -EACCES;
 
+    int logged = log_op(META_MKDIR, path, 0);
+    if (logged <= 0)
+        return logged;
+
     char *esc = url_encode(path);
     if (!esc)
         return -EIO;
@@ -340,7 +519,7 @@ static int do_mkdir(const char *path, mode_t mode)
     CURLcode rc = curl_easy_perform(c);
     curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &status);
     curl_easy_cleanup(c);
-
+    attr_cache_invalidate(path);
 
     if (rc != CURLE_OK)
         return -EIO;
@@ -353,14 +532,47 @@ static int do_mkdir(const char *path, mode_t mode)
 }
 
 
-static int do_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+/* Sparse cache map for the remote version of path, pulling the chunk
+ * layout first when the file is stored in content-defined chunks.
+ * With reuse the stale cache file at cache_path keeps the chunks whose
+ * checksum still matches the server's.
+ */
+static int open_remote_map(const char *path, const char *cache_path, off_t size,
+                           time_t mtime, int64_t gen, int chunking, int reuse, chunk_map_t **out)
 {
-    // Using %jd and casting to intmax_t uses the largest safe integer
-    LOGMSG("IN TRUNCATE path=%s, &size=%jd", path, (intmax_t)size);
-    if (!logged_in)
-        return -EACCES;
+    off_t *offsets = NULL;
+    int64_t *crcs = NULL;
+    uint32_t n = 0;
+    if ((chunking || reuse) && size > 0) {
+        int rc = fetch_chunk_layout(path, current_user_id, &offsets, reuse ? &crcs : NULL, &n);
+        if (rc != 0 && chunking)
+            return rc;
+        if (rc != 0)
+            n = 0;  // just downloads everything
+    }
 
-    
+    /* Rows of a fixed layout have to be whole chunks for the sums to line up */
+    if (!chunking && crcs) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (offsets[i] != (off_t)i * CHUNK_SIZE) {
+                n = 0;
+                break;
+            }
+        }
+        if (n > 0 && offsets[n] != size)
+            n = 0;
+    }
+
+    *out = chunk_map_open(cache_path, size, mtime, gen, chunking ? offsets : NULL, n ? crcs : NULL, n);
+    free(offsets);
+    free(crcs);
+    return *out ? 0 : -EIO;
+}
+
+
+/* POSTs the truncate, reset drops every chunk instead of keeping the ones below size */
+static int truncate_remote(const char *path, off_t size, time_t mtime, int reset)
+{
     uint32_t status = 0;
     uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
 
@@ -370,42 +582,153 @@ static int do_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 
     char url[URL_MAX];
     snprintf(url, sizeof(url),
-            "%s/truncate?user_id=%d&path=%s&size=%jd",
-            get_server_url(), current_user_id, esc, (intmax_t)size);
+            "%s/truncate?user_id=%d&path=%s&size=%jd&mtime=%lld%s",
+            get_server_url(), current_user_id, esc, (intmax_t)size,
+            (long long)mtime, reset ? "&reset=1" : "");
     curl_free(esc);
 
     if (http_request(url, NULL, status_ptr) != 0)
         return -ECOMM;
 
     LOGMSG("TRUNCATE STATUS: %d", status);
-    if(status == 400)
-        return -EEXIST;
+    if (status == 409)
+        return -EBUSY;
+    if (status == 520)
+        return -ENOENT;
     if (status != 201)
-        return -EIO;
-    
-    /* Truncate local cache file */
+        return status == 400 ? -EEXIST : -EIO;
+    return 0;
+}
+
+
+static int do_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    // Using %jd and casting to intmax_t uses the largest safe integer
+    LOGMSG("IN TRUNCATE path=%s, &size=%jd", path, (intmax_t)size);
+    if (!logged_in)
+        return -EACCES;
+
     char cache_path[PATH_MAX];
     BUILD_CACHE_PATH(cache_path, current_user_id, path);
 
-    if (truncate(cache_path, size) < 0)
-        return -errno;
-
+    /* Don't race a write-back of the same file, or its create */
+    int rc = meta_log_barrier();
+    if (rc != 0)
+        return rc;
+    rc = upload_queue_wait(path, current_user_id);
+    if (rc != 0)
+        return rc;
 
-    /* Remove old cache here, do_release uploads new cache */
     struct stat st;
-    off_t file_size = 0;
-    if (stat(cache_path, &st) == 0)
-        file_size = st.st_size;
-    cache_record_delete(path, current_user_id, file_size);
+    time_t now = time(NULL);
+    chunk_map_t *map = chunk_map_get(cache_path);
+    int cached = map || stat(cache_path, &st) == 0;
+
+    /* Server keeps the chunks below size and rewrites the one holding the end */
+    int reset = 0;
+    rc = truncate_remote(path, size, now, 0);
+    attr_cache_invalidate(path);
+    if (rc == -EBUSY) {
+        /* Layout it can't cut (an upload that never finished). Whatever
+         * survives has to be local first, it all goes up again. */
+        reset = 1;
+        rc = 0;
+        if (!map && size > 0 && !cached) {
+            off_t remote_size = 0;
+            time_t remote_mtime = 0;
+            int chunking = 0;
+            rc = fetch_remote_stat(path, current_user_id, &remote_size, &remote_mtime, &chunking);
+            if (rc == 0) {
+                char *dup = strdup(cache_path);
+                mkdir_p(dirname(dup));
+                free(dup);
+                rc = open_remote_map(path, cache_path, remote_size, remote_mtime, -1, chunking, 0, &map);
+            }
+        }
+        if (rc == 0 && map)
+            rc = chunk_map_fetch(map, path, current_user_id, 0, size);
+        if (rc == 0)
+            rc = truncate_remote(path, size, now, 1);
+        attr_cache_invalidate(path);
+        cached = 1;
+    }
+    if (rc != 0) {
+        chunk_map_put(map);
+        return rc;
+    }
 
-    fh_t *fh = malloc(sizeof(fh_t));
-    int fd = open(cache_path, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
+    /* O_TRUNC open of a file never cached still needs a descriptor */
+    if (!cached && fi && !fi->fh) {
+        char *dup = strdup(cache_path);
+        mkdir_p(dirname(dup));
+        free(dup);
+        cached = 1;
+    }
+
+    /* Local copy follows, uncached files are fetched fresh on open */
+    int fd = -1;
+    if (cached) {
+        fd = open(cache_path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            chunk_map_put(map);
+            return -errno;
+        }
+    }
+    if (map && !reset && size > 0) {
+        rc = chunk_map_truncate(map, size, now);
+    } else if (fd >= 0) {
+        struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = now } };
+        if (ftruncate(fd, size) < 0 || futimens(fd, times) < 0)
+            rc = -errno;
+        /* Everything below size is local now */
+        if (map && rc == 0) {
+            chunk_map_set_complete(map);
+            chunk_map_drop(cache_path);
+        }
+    }
+    chunk_map_put(map);
+    if (rc != 0) {
+        if (fd >= 0)
+            close(fd);
+        return rc;
+    }
+
+    if (cached) {
+        /* Server took a new generation, mtime has to vouch for the cache now */
+        cache_gen_clear(cache_path);
+        cache_record_delete(path, current_user_id, -1);
+        cache_record_append(path, size, current_user_id);
+    }
+
+    if (!fi) {
+        /* truncate(2) by path, no release will follow */
+        if (fd >= 0)
+            close(fd);
+        return reset ? upload_queue_push(path, current_user_id, NULL) : 0;
+    }
+
+    fh_t *fh = (fh_t*)(uintptr_t)fi->fh;
+    if (fh) {
+        // ftruncate on an open file, keep its descriptor
+        if (fd >= 0)
+            close(fd);
+        if (reset)
+            open_file_mark_all(fh->of);  // server copy is gone
+        return 0;
+    }
+
+    fh = calloc(1, sizeof(fh_t));
+    if (!fh || !(fh->of = open_file_get(cache_path, 1))) {
         free(fh);
-        return -errno;
+        if (fd >= 0)
+            close(fd);
+        return -ENOMEM;
     }
     fh->fd = fd;
-    fh->dirty = 1;
+    fh->writer = 1;
+    fh->map = NULL;
+    if (reset)
+        open_file_mark_all(fh->of);
     fi->fh = (uint64_t)(uintptr_t)fh;
 
     return 0;
@@ -431,107 +754,113 @@ static int do_open(const char *path, struct fuse_file_info *fi)
     char cache_path[PATH_MAX];
     BUILD_CACHE_PATH(cache_path, current_user_id, path);
 
-    fh_t *fh = malloc(sizeof(fh_t));
+    fh_t *fh = calloc(1, sizeof(fh_t));
     if (!fh) {
         return -ENOMEM;
     }
 
     if (fi->flags & O_TRUNC) {
         LOGMSG("O_TRUNC detected, truncating %s", path);
-        int rc = do_truncate(path, 0, fi);
-        if (rc != 0) {
+        free(fh);
+        fi->fh = 0;
+        return do_truncate(path, 0, fi);
+    }
+
+    int flags = (fi->flags & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR;
+    if (fi->flags & O_APPEND)
+        flags |= O_APPEND;
+    fh->writer = flags != O_RDONLY;
+
+    /* Server is behind while an upload is queued, the cache is the truth */
+    int local_ahead = upload_queue_pending(path, current_user_id) ||
+                      meta_log_pending(current_user_id, path);
+
+    struct stat st;
+    int cached = stat(cache_path, &st) == 0;
+
+    /* Under the lease a cache validated before is current until the change
+     * feed says otherwise, no round trip at all */
+    uint64_t lease_seen = lease_epoch();
+    int leased = cached && !local_ahead && lease_covers(path);
+
+    /* A cache of known generation is revalidated by a 304, no body. Without
+     * one it has to go by mtime, which only has second resolution */
+    int64_t cached_gen = cached ? cache_gen_get(cache_path) : -1;
+    int64_t remote_gen = -1;
+    int unchanged = 0;
+    off_t remote_size = 0;
+    time_t remote_mtime = 0;
+    int chunking = 0;
+    if (!local_ahead && !leased) {
+        int rc = fetch_remote_stat_if(path, current_user_id, cached_gen, &remote_size,
+                                      &remote_mtime, &chunking, &remote_gen);
+        if (rc < 0) {
             free(fh);
             return rc;
         }
-        return 0;
+        unchanged = rc == 1;
     }
 
-    time_t remote_mtime = 0;
-    struct stat st;
-    /* Check if cache exists && mtime == mtime on the server's side */
-    if (access(cache_path, F_OK) == 0 &&
-        stat(cache_path, &st) == 0) {
-        remote_mtime = fetch_mtime(path, current_user_id);
-
-        if (st.st_mtime == remote_mtime) {
-            int flags = (fi->flags & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR;
-            if (fi->flags & O_APPEND)
-                flags |= O_APPEND;
-            int fd = open(cache_path, flags);
-            if (fd < 0) {
-                free(fh);
-                return -errno;
-            }
-
-            fh->fd = fd;
-            fh->dirty = 0;
-            fi->fh = (uint64_t)(uintptr_t)fh;
-            return 0;
+    if (cached && (local_ahead || leased || unchanged ||
+                   (cached_gen < 0 && st.st_mtime == remote_mtime))) {
+        int fd = open(cache_path, flags);
+        if (fd < 0) {
+            free(fh);
+            return -errno;
         }
-        LOGMSG("cache miss! (diff mtime), hitting '/download' route...");
-        LOGMSG("\"%ld\" and \"%ld\"", (long)st.st_mtime, (long)remote_mtime);
-    } else {
-        LOGMSG("cache miss! (doesn't exist), hitting '/download' route...");
+        if (!(fh->of = open_file_get(cache_path, fh->writer))) {
+            close(fd);
+            free(fh);
+            return -ENOMEM;
+        }
+
+        if (!local_ahead && !leased && !unchanged)
+            cache_gen_set(cache_path, remote_gen);
+        if (!local_ahead && !leased)
+            lease_note(path, lease_seen);
+
+        fh->fd = fd;
+        fh->map = chunk_map_get(cache_path);  // NULL if fully cached
+        fi->fh = (uint64_t)(uintptr_t)fh;
+        return 0;
     }
+    LOGMSG("cache miss! (%s), chunks are fetched on read", path);
     
-    /* Download from server otherwise */
+    /* Sparse cache file, chunks are pulled in by do_read */
     char *dup = strdup(cache_path);
     char *dir = dirname(dup);
     mkdir_p(dir);
     free(dup);
 
-    char *esc = url_encode(path);
-    if (!esc) {
-        free(fh);
-        return -EIO;
-    }
-
-    char url[URL_MAX];
-    snprintf(url, sizeof(url),
-            "%s/download?user_id=%d&path=%s",
-            get_server_url(), current_user_id, esc);
-    curl_free(esc);
-
-    FILE *fp = fopen(cache_path, "wb");
-    if (!fp) {
-        free(fh);
-        return -errno;
-    }
-
-    int rc = http_get_stream(url, fp);
-    fclose(fp);
+    /* Concurrent openers of the same cold file share one map (and mtime
+     * is set to db mtime while building it). A stale copy still has
+     * whatever chunks didn't change. */
+    chunk_map_t *map = NULL;
+    int rc = open_remote_map(path, cache_path, remote_size, remote_mtime, remote_gen, chunking,
+                             cached && S_ISREG(st.st_mode) && st.st_size > 0, &map);
     if (rc != 0) {
         free(fh);
-        unlink(cache_path);
-         if (rc == 408)
-            return -ETIMEDOUT;  // Upload stalled
-        if (rc == 410)
-            return -ECANCELED;  // Upload probably cancelled
-        if (rc == 520)
-            return -ENOENT;     // File not found
-        return -ECOMM;
+        return rc;
     }
-
-    // set mtime to db mtime
-    struct timespec times[2];
-    times[0].tv_sec = 0;
-    times[0].tv_nsec = UTIME_OMIT;
-    times[1].tv_sec = remote_mtime;
-    times[1].tv_nsec = 0;
-    utimensat(AT_FDCWD, cache_path, times, 0);
+    cache_gen_set(cache_path, remote_gen);
+    lease_note(path, lease_seen);
 
     /* stash fh_t in fi->fh */
-    int flags = (fi->flags & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR;
-    if (fi->flags & O_APPEND)
-        flags |= O_APPEND;
     int fd = open(cache_path, flags);
     if (fd < 0) {
+        int err = -errno;
+        chunk_map_put(map);
         free(fh);
-        unlink(cache_path);
-        return -errno;
+        return err;
+    }
+    if (!(fh->of = open_file_get(cache_path, fh->writer))) {
+        close(fd);
+        chunk_map_put(map);
+        free(fh);
+        return -ENOMEM;
     }
     fh->fd = fd;
-    fh->dirty = 0;
+    fh->map = map;
     fi->fh = (uint64_t)(uintptr_t)fh;
     return 0;
 }
@@ -554,11 +883,15 @@ static int do_release(const char *path, struct fuse_file_info *fi)
         close(fd);
     }
 
-    /* skip if file's clean */
-    if (!fh->dirty) {
-        free(fh);
+    /* Upload worker pulls in whatever chunks were never read */
+    chunk_map_put(fh->map);
+
+    /* What every handle wrote goes up once, when the last writer closes */
+    dirty_set_t dirty;
+    int ship = open_file_put(fh->of, fh->writer, &dirty);
+    free(fh);
+    if (!ship)
         return 0;
-    }
 
     char cache_path[PATH_MAX];
     BUILD_CACHE_PATH(cache_path, current_user_id, path);
@@ -567,19 +900,17 @@ static int do_release(const char *path, struct fuse_file_info *fi)
     struct stat st;
     off_t file_size = 0;
     if (stat(cache_path, &st) != 0 || !S_ISREG(st.st_mode)) {
-        free(fh);
-        return 0;
+        LOGMSG("Dirty cache of %s is gone, its writes are lost", path);
+        dirty_set_free(&dirty);
+        return -EIO;
     }
     file_size = st.st_size;
 
-    int returner = 0;
-    if (!is_temp_path(path)) {
-        returner = upload_file_chunks(path, current_user_id, file_size, cache_path, st.st_mtim.tv_sec);
-        if (returner != 0) {
-            free(fh);
-            return returner;
-        }
-    }
+    /* Written back in the background, fsync and unmount wait for it */
+    int returner = upload_queue_push(path, current_user_id, &dirty);
+    dirty_set_free(&dirty);
+    if (returner != 0)
+        return returner;
     
     /* Update cache records */
     cache_record_delete(path, current_user_id, -1);
@@ -587,11 +918,41 @@ static int do_release(const char *path, struct fuse_file_info *fi)
     cache_garbage_collection(current_user_id);
 
     LOGMSG("File(%s) is dirty! leaving release (%d)", path, returner);
-    free(fh);
     return returner;
 }
 
-/* Creates a temporary file (empty) in cache folder, logging onto server is handled on release */
+/* Pushes dirty data to the server and waits for it to land */
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    LOGMSG("IN fsync with path: %s", path);
+    if (IS_COMMAND_PATH(path) || !logged_in)
+        return 0;
+
+    fh_t *fh = (fh_t*)(uintptr_t)fi->fh;
+    if (!fh)
+        return -EBADF;
+    if (fsync(fh->fd) != 0)
+        return -errno;
+
+    /* Takes along what other handles of the file wrote */
+    dirty_set_t dirty;
+    if (open_file_take_dirty(fh->of, &dirty)) {
+        int rc = upload_queue_push(path, current_user_id, &dirty);
+        dirty_set_free(&dirty);
+        if (rc != 0)
+            return rc;
+    }
+
+    /* Logged namespace changes land first, one the server refused shows here */
+    int rc = meta_log_wait();
+    if (rc != 0)
+        return rc;
+    return upload_queue_wait(path, current_user_id);
+}
+
+/* Creates the file on the server (or logs the create) and an empty cache file.
+ * Its contents go up once the last writer releases it.
+ */
 static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     LOGMSG("IN CREATE path=%s mode=0%o fi->flags=0x%lx", path, mode, (unsigned long)fi->flags);
@@ -606,43 +967,35 @@ static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     mkdir_p(dirname(tmp));
     free(tmp);
 
-    /* if temp_path, just create the file without hitting up the server */
-    if(is_temp_path(path)) {
-        int fd = open(cache_path, O_RDWR | O_CREAT | O_TRUNC, mode & 0777);
-        if (fd < 0)
-            return -errno;
-        fh_t *fh = malloc(sizeof(fh_t));
-        if (!fh) {
-            close(fd);
-            return -ENOMEM;
-        }
-        fh->fd = fd;
-        fh->dirty = 0;
-        fi->fh = (uint64_t)(uintptr_t)fh;
-        return 0;
-    }
-    
+    /* Fresh file, nothing left to fetch for whatever was cached here */
+    chunk_map_drop(cache_path);
 
-    uint32_t status = 0;
-    uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
+    int logged = log_op(META_CREATE, path, 0);
+    if (logged < 0)
+        return logged;
+    if (logged) {
+        uint32_t status = 0;
+        uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
 
-    char *esc = url_encode(path);
-    if (!esc)
-        return -EIO;
-    
-    char url[URL_MAX];
-    snprintf(url, sizeof(url),
-            "%s/create?user_id=%d&path=%s",
-            get_server_url(), current_user_id, esc);
-    curl_free(esc);
+        char *esc = url_encode(path);
+        if (!esc)
+            return -EIO;
+        
+        char url[URL_MAX];
+        snprintf(url, sizeof(url),
+                "%s/create?user_id=%d&path=%s",
+                get_server_url(), current_user_id, esc);
+        curl_free(esc);
 
-    if (http_request(url, NULL, status_ptr) != 0)
-        return -ECOMM;
-    LOGMSG("CREATE STATUS: %d", status);
-    if(status == 400)
-        return -EEXIST;
-    if (status != 201)
-        return -EIO;
+        if (http_request(url, NULL, status_ptr) != 0)
+            return -ECOMM;
+        attr_cache_invalidate(path);  // most likely cached as missing
+        LOGMSG("CREATE STATUS: %d", status);
+        if(status == 400)
+            return -EEXIST;
+        if (status != 201)
+            return -EIO;
+    }
 
     cache_record_append(path, 0, current_user_id);
 
@@ -651,13 +1004,15 @@ static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     if (fd < 0)
         return -errno;
 
-    fh_t *fh = malloc(sizeof(fh_t));
-    if (!fh) {
+    fh_t *fh = calloc(1, sizeof(fh_t));
+    if (!fh || !(fh->of = open_file_get(cache_path, 1))) {
+        free(fh);
         close(fd);
         return -ENOMEM;
     }
     fh->fd = fd;
-    fh->dirty = 0;
+    fh->writer = 1;
+    fh->map = NULL;
     fi->fh = (uint64_t)(uintptr_t)fh;
 
     LOGMSG("leaving create");
@@ -677,42 +1032,186 @@ static int do_write(const char *path, const char *buf,
         return -EBADF;
     int fd = fh->fd;
     
+    /* Partially overwritten chunks need their old bytes first */
+    if (fh->map) {
+        int rc = chunk_map_fetch(fh->map, path, current_user_id, offset, size);
+        if (rc != 0)
+            return rc;
+    }
 
     ssize_t written = pwrite(fd, buf, size, offset);
-    if (written > 0)
-        fh->dirty = 1;
+    if (written > 0) {
+        /* O_APPEND ignores offset, the bytes went to the end */
+        struct stat st;
+        if ((fcntl(fd, F_GETFL) & O_APPEND) && fstat(fd, &st) == 0)
+            offset = st.st_size - written;
+        open_file_mark_dirty(fh->of, offset, written);
+        attr_cache_invalidate(path);  // size and mtime moved on
+    }
 
     return (written < 0) ? -errno : (int)written ;
 }
 
 
+
+/* Whole file copy into an empty destination, done on the server by
+ * pointing dst at src's chunks. The destination cache turns into a sparse
+ * map of the clone. Returns bytes copied, -EOPNOTSUPP if the copy doesn't
+ * qualify or the server refused it, nothing has changed then.
+ */
+static ssize_t clone_whole_file(const char *path_in, fh_t *in, off_t off_in,
+                                const char *path_out, fh_t *out, off_t off_out, size_t len)
+{
+    if (off_in != 0 || off_out != 0 || open_file_is_dirty(in->of))
+        return -EOPNOTSUPP;
+
+    struct stat st;
+    if (fstat(out->fd, &st) != 0 || st.st_size != 0)
+        return -EOPNOTSUPP;
+
+    /* The server copy has to be what the source reads like locally */
+    if (upload_queue_wait(path_in, current_user_id) != 0)
+        return -EOPNOTSUPP;
+    off_t size = 0;
+    time_t mtime = 0;
+    int chunking = 0;
+    if (fetch_remote_stat(path_in, current_user_id, &size, &mtime, &chunking) != 0)
+        return -EOPNOTSUPP;
+    if (size == 0 || (off_t)len < size)
+        return -EOPNOTSUPP;
+
+    char cache_in[PATH_MAX];
+    BUILD_CACHE_PATH(cache_in, current_user_id, path_in);
+    if (stat(cache_in, &st) == 0 && (st.st_mtime != mtime || st.st_size != size))
+        return -EOPNOTSUPP;  // written by another handle, not uploaded yet
+
+    /* A queued upload of the empty destination would undo the clone,
+     * and a logged create has to happen before it */
+    upload_queue_cancel(path_out, current_user_id);
+    if (meta_log_barrier() != 0)
+        return -EOPNOTSUPP;
+    int cloned = clone_remote_file(path_in, path_out, current_user_id);
+    attr_cache_invalidate(path_out);
+    if (cloned != 0)
+        return -EOPNOTSUPP;
+    int64_t gen = -1;
+    if (fetch_remote_stat_if(path_out, current_user_id, -1, &size, &mtime, &chunking, &gen) != 0)
+        return -EIO;
+
+    char cache_out[PATH_MAX];
+    BUILD_CACHE_PATH(cache_out, current_user_id, path_out);
+    chunk_map_t *map = NULL;
+    int rc = open_remote_map(path_out, cache_out, size, mtime, gen, chunking, 0, &map);
+    if (rc != 0)
+        return rc;
+
+    /* The map put a new file in place, the old descriptor is stale */
+    int fd = open(cache_out, fcntl(out->fd, F_GETFL) & (O_ACCMODE | O_APPEND));
+    if (fd < 0) {
+        int err = -errno;
+        chunk_map_put(map);
+        return err;
+    }
+    close(out->fd);
+    out->fd = fd;
+    chunk_map_put(out->map);
+    out->map = map;
+    out->ra_next = 0;
+    out->ra_window = 0;
+    out->ra_issued = 0;
+    dirty_set_t stale;
+    if (open_file_take_dirty(out->of, &stale))
+        dirty_set_free(&stale);
+
+    cache_record_delete(path_out, current_user_id, -1);
+    cache_record_append(path_out, size, current_user_id);
+    LOGMSG("cloned %s -> %s (%jd bytes)", path_in, path_out, (intmax_t)size);
+    return size;
+}
+
+
+static ssize_t do_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+                                  const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+                                  size_t len, int flags)
+{
+    LOGMSG("IN copy_file_range %s@%jd -> %s@%jd len=%zu", path_in, (intmax_t)off_in,
+           path_out, (intmax_t)off_out, len);
+    if (!logged_in || IS_COMMAND_PATH(path_in) || IS_COMMAND_PATH(path_out))
+        return -EACCES;
+    fh_t *in = (fh_t*)(uintptr_t)fi_in->fh;
+    fh_t *out = (fh_t*)(uintptr_t)fi_out->fh;
+    if (!in || !out)
+        return -EBADF;
+
+    ssize_t cloned = clone_whole_file(path_in, in, off_in, path_out, out, off_out, len);
+    if (cloned != -EOPNOTSUPP)
+        return cloned;
+
+    /* Anything else goes through the cache like read + write would */
+    char *buf = malloc(COPY_BUF_SIZE);
+    if (!buf)
+        return -ENOMEM;
+    ssize_t copied = 0;
+    while ((size_t)copied < len) {
+        size_t want = len - copied < COPY_BUF_SIZE ? len - copied : COPY_BUF_SIZE;
+        int got = do_read(path_in, buf, want, off_in + copied, fi_in);
+        if (got <= 0) {
+            if (copied == 0)
+                copied = got;
+            break;
+        }
+        int put = do_write(path_out, buf, got, off_out + copied, fi_out);
+        if (put < 0) {
+            if (copied == 0)
+                copied = put;
+            break;
+        }
+        copied += put;
+        if (put < got)
+            break;
+    }
+    free(buf);
+    return copied;
+}
+
 static int do_unlink(const char *path)
 {
     if (!logged_in)
         return -EACCES;
+
+    /* No point in finishing the upload of a file about to go */
+    upload_queue_cancel(path, current_user_id);
     
-    uint32_t status = 0;
-    uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
-    char *esc = url_encode(path);
-    if (!esc)
-        return -EIO;
+    int logged = log_op(META_UNLINK, path, 0);
+    if (logged < 0)
+        return logged;
+    if (logged) {
+        uint32_t status = 0;
+        uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
+        char *esc = url_encode(path);
+        if (!esc)
+            return -EIO;
 
-    char url[URL_MAX];
-    snprintf(url, sizeof(url),
-            "%s/unlink?user_id=%d&path=%s",
-            get_server_url(), current_user_id, esc);
-    curl_free(esc);
+        char url[URL_MAX];
+        snprintf(url, sizeof(url),
+                "%s/unlink?user_id=%d&path=%s",
+                get_server_url(), current_user_id, esc);
+        curl_free(esc);
 
-    if (http_request(url, NULL, status_ptr) != 0)
-        return -ECOMM;
-    
-    if (status != 201) {
-        LOGMSG("unlink error: returned %d for path \"%s\"", status, path);
-        return -ENOENT;
+        if (http_request(url, NULL, status_ptr) != 0)
+            return -ECOMM;
+        attr_cache_invalidate(path);
+        
+        if (status != 201) {
+            LOGMSG("unlink error: returned %d for path \"%s\"", status, path);
+            return -ENOENT;
+        }
     }
 
     char cache_path[PATH_MAX];
     BUILD_CACHE_PATH(cache_path, current_user_id, path);
+    chunk_map_drop(cache_path);
+    open_file_forget(cache_path);
 
     /* Remove from cache history */
     struct stat st;
@@ -735,35 +1234,54 @@ static int do_rmdir(const char *path)
         return -EACCES;
     if (strcmp(path, "/") == 0)
         return -EPERM;
-    
-    uint32_t status = 0;
-    uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
 
-    char *esc = url_encode(path);
-    if (!esc)
-        return -EIO;
+    /* Only a directory the op log made is known to be empty without
+     * asking, the server decides for the rest */
+    struct stat st;
+    int logged;
+    if (meta_log_stat(current_user_id, path, &st) == 0) {
+        if (meta_log_children(current_user_id, path, NULL, NULL) > 0)
+            return -ENOTEMPTY;
+        logged = log_op(META_RMDIR, path, 0);
+    } else {
+        logged = meta_log_barrier();
+        if (logged == 0)
+            logged = 1;
+    }
+    if (logged < 0)
+        return logged;
+    if (logged) {
+        uint32_t status = 0;
+        uint32_t* status_ptr = (uint32_t*)((uintptr_t)&status | 1);
 
-    char url[URL_MAX];
-    snprintf(url, sizeof(url),
-            "%s/rmdir?user_id=%d&path=%s",
-            get_server_url(), current_user_id, esc);
-    curl_free(esc);
+        char *esc = url_encode(path);
+        if (!esc)
+            return -EIO;
 
-    if (http_request(url, NULL, status_ptr) != 0)
-        return -ECOMM;
-    
-    if (status == 404) {
-        LOGMSG("rmdir not empty for path \"%s\"", path);
-        return -ENOTEMPTY;
-    }
-    
-    if (status != 201) {
-        LOGMSG("rmdir error: returned %d for path \"%s\"", status, path);
-        return -ENOENT;
+        char url[URL_MAX];
+        snprintf(url, sizeof(url),
+                "%s/rmdir?user_id=%d&path=%s",
+                get_server_url(), current_user_id, esc);
+        curl_free(esc);
+
+        if (http_request(url, NULL, status_ptr) != 0)
+            return -ECOMM;
+        attr_cache_invalidate_tree(path);
+        
+        if (status == 404) {
+            LOGMSG("rmdir not empty for path \"%s\"", path);
+            return -ENOTEMPTY;
+        }
+        
+        if (status != 201) {
+            LOGMSG("rmdir error: returned %d for path \"%s\"", status, path);
+            return -ENOENT;
+        }
     }
 
     char cache_path[PATH_MAX];
     BUILD_CACHE_PATH(cache_path, current_user_id, path);
+    chunk_map_drop_prefix(cache_path);
     
     cache_remove_subtree(path, current_user_id, 
         CACHE_RM_FILESYSTEM | CACHE_RM_CACHELOGS | CACHE_RM_IGNORE_ENOENT);
@@ -771,14 +1289,12 @@ static int do_rmdir(const char *path)
     return 0;
 }
 
-/* Suprisingly complicated, outlined into 4 cases:
- *   1) exchange flag set -> exchange files "from_path", "to_path"
+/* Suprisingly complicated, outlined into 3 cases:
  *   1) exchange flag set -> exchange files "from_path", "to_path"
- *   2) replace "to_path" with "from_path" (same parent dir)
- *   3) replace "to_path" with "from_path" (diff parent dir)
- *   4) replacing file is TEMP, handle uploading to back-end
- * NOREPLACE only checks back-end for collision, as locally shouldn't have
- * files present if not in back-end.
+ *   2) "to_path" exists -> server moves from_path's chunks onto it in one
+ *      step (atomic save), nothing is uploaded again
+ *   3) otherwise rename, or move when the parent dir differs
+ * NOREPLACE skips 2), the server reports the collision in 3).
  */
 static int do_rename(const char *from_path,
                      const char *to_path,
@@ -807,27 +1323,18 @@ static int do_rename(const char *from_path,
     mkdir_p(dirname(dup));
     free(dup);
 
-    const int from_is_temp = is_temp_path(from_path);
-
-    /* Wouldn't make sense if files locally and back-end didn't match */
-    int source_exists = 0;
-    if (backend_exists(current_user_id, from_path, &source_exists) != 0)
-        return -ECOMM;
-    if (!source_exists)
-        return -EIO;
-
-    int dest_exists = 0;
-    if (backend_exists(current_user_id, to_path, &dest_exists) != 0)
-        return -ECOMM;
+    /* Both sides have to be settled on the server before moving them */
+    int rc = meta_log_barrier();
+    if (rc == 0)
+        rc = upload_queue_wait(from_path, current_user_id);
+    if (rc == 0)
+        rc = upload_queue_wait(to_path, current_user_id);
+    if (rc != 0)
+        return rc;
 
 
     /* swap two files */
     if (flags & RENAME_EXCHANGE) {
-        if (!dest_exists || !source_exists)
-            return -EEXIST;
-        if (from_is_temp || is_temp_path(to_path))
-            return -ENOENT;
-
         char *a = url_encode(from_path), *b = url_encode(to_path);
         if (!a || !b) {
             curl_free(a);
@@ -843,7 +1350,9 @@ static int do_rename(const char *from_path,
         curl_free(b);
 
         uint32_t status = 0;
-        int rc = http_post_status(url, &status);
+        rc = http_post_status(url, &status);
+        attr_cache_invalidate_tree(from_path);
+        attr_cache_invalidate_tree(to_path);
         if (rc)
             return rc;
         if (status == 520)
@@ -862,38 +1371,39 @@ static int do_rename(const char *from_path,
 
         if ((rc = cache_swap(oldc, newc)) != 0)
             return rc;
+        chunk_map_swap(oldc, newc);
+        open_file_swap(oldc, newc);
         cache_record_rename(from_path, to_path, from_size);
         cache_record_rename(to_path, from_path, to_size);
 
         return 0;
     }
 
-    /* Replace logic below! Note: rename() replaces automatically */
-
-    /* exit if RENAME_NOREPLACE is set and destination exists */
-    if ((flags & RENAME_NOREPLACE) && dest_exists)
-        return -EEXIST;
-
     struct stat st;
     off_t source_size = 0;
     if (stat(oldc, &st) == 0)
         source_size = st.st_size;
 
-
-    /* Remove file in backend & cache records if exists */ 
-    if (dest_exists) {
-        int rc = backend_unlink(current_user_id, to_path);
-        if (rc)
+    /* Replace logic, one round trip when to_path exists */
+    if (!(flags & RENAME_NOREPLACE)) {
+        rc = replace_remote_file(from_path, to_path, current_user_id);
+        attr_cache_invalidate_tree(from_path);
+        attr_cache_invalidate_tree(to_path);
+        if (rc < 0)
             return rc;
-
-        struct stat st;
-        off_t delete_size = 0;
-        if (stat(newc, &st) == 0)
-            delete_size = st.st_size;
-
-        cache_record_delete(to_path, current_user_id, delete_size);
-
-        dest_exists = 0;  // not used currently, but kept anyways   
+        if (rc == 0) {
+            off_t delete_size = 0;
+            if (stat(newc, &st) == 0)
+                delete_size = st.st_size;
+            cache_record_delete(to_path, current_user_id, delete_size);
+
+            if (rename(oldc, newc) != 0 && errno != ENOENT)
+                LOGMSG("cache rename %s -> %s: %m", oldc, newc);
+            chunk_map_rename(oldc, newc);
+            open_file_rename(oldc, newc);
+            cache_record_rename(from_path, to_path, source_size);
+            return 0;
+        }
     }
 
     /* Same parent dir -> simple rename
@@ -921,7 +1431,9 @@ static int do_rename(const char *from_path,
 
 
     uint32_t status = 0;
-    int rc = http_post_status(url, &status);
+    rc = http_post_status(url, &status);
+    attr_cache_invalidate_tree(from_path);
+    attr_cache_invalidate_tree(to_path);
     if (rc) return rc;
     if (status == 409)
         return -EEXIST;
@@ -934,34 +1446,9 @@ static int do_rename(const char *from_path,
     /* local cache rename ↓ */
     if (rename(oldc, newc) != 0 && errno != ENOENT)
         LOGMSG("cache rename %s -> %s: %m", oldc, newc);  // log on failure
-    
-    
-    /* cache updates:
-       - TEMP source: it never had a record -> append new record at to_path
-       - NON-TEMP: rename existing record from from_path -> to_path
-    */
-    if (from_is_temp) {
-        FILE *fp = fopen(from_path, "rb");
-        if (!fp)
-            return -EIO;
-
-        struct stat st;
-        if (fstat(fileno(fp), &st) != 0) {
-            fclose(fp);
-            return -EIO;
-        }
-
-        rc = upload_file_chunks(to_path, current_user_id, source_size, newc, st.st_mtim.tv_sec);
-        if (rc)
-            return rc;
-
-        // only touch cache if it's a file
-        if (stat(newc, &st) == 0 && S_ISREG(st.st_mode))
-        cache_record_append(to_path, source_size, current_user_id);
-        cache_garbage_collection(current_user_id);
-    } else {
-        cache_record_rename(from_path, to_path, source_size);
-    }
+    chunk_map_rename(oldc, newc);
+    open_file_rename(oldc, newc);
+    cache_record_rename(from_path, to_path, source_size);
 
     return 0;
 }
@@ -990,7 +1477,10 @@ static int do_utimens(const char *path, const struct timespec tv[2], struct fuse
         mtime_sec = tv[1].tv_sec;
     }
 
-    if (push_backend) {
+    int logged = push_backend ? log_op(META_UTIMENS, path, mtime_sec) : 0;
+    if (logged < 0)
+        return logged;
+    if (logged) {
         char *esc = url_encode(path);
         if (!esc)
             return -EIO;
@@ -1003,6 +1493,7 @@ static int do_utimens(const char *path, const struct timespec tv[2], struct fuse
 
         uint32_t status = 0;
         int rc = http_post_status(url, &status);
+        attr_cache_invalidate(path);
         if (rc)
             return rc;
         if (status != 200 && status != 201)
@@ -1014,15 +1505,31 @@ static int do_utimens(const char *path, const struct timespec tv[2], struct fuse
 void *do_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
     LOGMSG("STARTING do_init");
+    http_policy_init();
+    crc32c_init();
     if(cache_init() != 0) {
         fprintf(stderr, "Cache failed to initialized.\n");
         abort();
     }
+    chunker_init();
+    compress_init();
+    prefetch_init();
+    buf_pool_init();
+    attr_cache_init();
+    meta_log_init();
+    upload_queue_init();
+    lease_init();
     return NULL;
 }
 
 void do_destroy(void *private_data)
 {
+    upload_queue_exit();  // drains pending write-backs
+    meta_log_exit();
+    lease_exit();
+    buf_pool_exit();
+    attr_cache_exit();
+    prefetch_exit();
     cache_exit();
 }
 
@@ -1035,6 +1542,7 @@ static struct fuse_operations ops = {
     .mkdir = do_mkdir,
     .open = do_open,
     .release = do_release,
+    .fsync = do_fsync,
     .create = do_create,
     .write = do_write,
     .truncate = do_truncate,
@@ -1042,6 +1550,7 @@ static struct fuse_operations ops = {
     .rmdir = do_rmdir,
     .rename = do_rename,
     .utimens = do_utimens,
+    .copy_file_range = do_copy_file_range,
 };
 
 int main(int argc, char *argv[])
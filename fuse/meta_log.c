@@ -0,0 +1,638 @@
+#include "meta_log.h"
+#include "attr_cache.h"
+#include "http_policy.h"
+#include <cjson/cJSON.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <libgen.h>
+
+#define META_BUCKETS 4096
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;  // ops appended, someone waits, or stop
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;  // a batch was sent (or failed to)
+static pthread_t flusher;
+static int enabled;             // new ops are logged, else they go to the server directly
+static int running;             // flusher alive, guarded by log_lock
+static int stopping;
+static long linger_ms = META_LINGER_MS_DEFAULT;
+
+/* Guarded by log_lock */
+static int log_fd = -1;
+static char log_path[PATH_MAX];
+static meta_op_t *head, *tail;
+static int n_ops;
+static uint64_t next_seq = 1;
+static uint64_t confirmed_seq;  // ops up to here are done with
+static uint64_t send_failures;  // ever, waiters count the ones since they started
+static int hurry;               // someone waits, no lingering
+static int first_error;         // rejected op, for the next meta_log_wait
+static meta_node_t *nodes[META_BUCKETS];
+static int n_nodes;             // also read unlocked, as a shortcut when empty
+
+static uint64_t stat_ops, stat_batches, stat_rejected;
+
+static const char *op_names[] = { "mkdir", "create", "unlink", "rmdir", "utimens" };
+
+
+static meta_node_t **_node_slot(int user_id, const char *path)
+{
+    meta_node_t **indirect = &nodes[path_hash(path) % META_BUCKETS];
+    while (*indirect && ((*indirect)->user_id != user_id || strcmp((*indirect)->path, path) != 0))
+        indirect = &(*indirect)->next;
+    return indirect;
+}
+
+static void _node_drop(meta_node_t **slot)
+{
+    meta_node_t *n = *slot;
+    *slot = n->next;
+    free(n->path);
+    free(n);
+    __atomic_store_n(&n_nodes, n_nodes - 1, __ATOMIC_RELAXED);
+}
+
+/* Records what op does to path, caller holds log_lock */
+static int _shadow(const meta_op_t *o)
+{
+    meta_node_t **slot = _node_slot(o->user_id, o->path);
+    meta_node_t *n = *slot;
+    if (!n) {
+        n = calloc(1, sizeof(*n));
+        if (!n || !(n->path = strdup(o->path))) {
+            free(n);
+            return -ENOMEM;
+        }
+        n->user_id = o->user_id;
+        n->state = META_TOUCHED;
+        *slot = n;
+        __atomic_store_n(&n_nodes, n_nodes + 1, __ATOMIC_RELAXED);
+    }
+
+    switch (o->op) {
+    case META_MKDIR:
+        n->state = META_DIR;
+        n->mtime = time(NULL);
+        n->has_mtime = 1;
+        break;
+    case META_CREATE:
+        n->state = META_FILE;
+        n->mtime = time(NULL);
+        n->has_mtime = 1;
+        break;
+    case META_UNLINK:
+    case META_RMDIR:
+        n->state = META_GONE;
+        n->has_mtime = 0;
+        break;
+    case META_UTIMENS:
+        n->mtime = o->mtime;
+        n->has_mtime = 1;
+        break;
+    }
+    n->pending++;
+    return 0;
+}
+
+static void _enqueue(meta_op_t *o)
+{
+    if (tail)
+        tail->next = o;
+    else
+        head = o;
+    tail = o;
+    n_ops++;
+}
+
+static void _op_free(meta_op_t *o)
+{
+    free(o->path);
+    free(o);
+}
+
+static int _write_op(const meta_op_t *o)
+{
+    if (dprintf(log_fd, "O %llu %d %d %lld %s\n", (unsigned long long)o->seq, o->user_id,
+                o->op, (long long)o->mtime, o->path) < 0)
+        return -errno;
+    return 0;
+}
+
+/* What the op's own route would have failed with */
+static int _errno_of(int op, int status)
+{
+    if (status == 201)
+        return 0;
+    switch (op) {
+    case META_MKDIR:
+        return status == 404 ? -ENOENT : -EIO;
+    case META_CREATE:
+        return status == 400 || status == 420 ? -EEXIST : -EIO;
+    case META_RMDIR:
+        if (status == 404)
+            return -ENOTEMPTY;
+        // fall through
+    default:
+        return status == 520 ? -ENOENT : -EIO;
+    }
+}
+
+/* 1 if err only says an op sent before already took effect, a batch the
+ * server applied right before a crash or a lost answer comes back like this */
+static int _already_done(const meta_op_t *o, int err)
+{
+    if (!o->resent)
+        return 0;
+    if (o->op == META_CREATE)
+        return err == -EEXIST;
+    return (o->op == META_UNLINK || o->op == META_RMDIR) && err == -ENOENT;
+}
+
+/* The server answered for o, caller holds log_lock */
+static void _confirm(const meta_op_t *o, int status)
+{
+    int err = _errno_of(o->op, status);
+    attr_cache_invalidate(o->path);  // the server's answer is the one that counts now
+    if (err && _already_done(o, err)) {
+        LOGMSG("[META] %s %s was applied already", op_names[o->op], o->path);
+        err = 0;
+    }
+
+    meta_node_t **slot = _node_slot(o->user_id, o->path);
+    if (err) {
+        LOGMSG("[META] %s %s rejected (%d)", op_names[o->op], o->path, status);
+        STAT_ADD(stat_rejected, 1);
+        if (!first_error && !o->replayed)
+            first_error = err;
+        if (*slot)
+            _node_drop(slot);  // the path is what the server says again
+        return;
+    }
+    if (*slot && --(*slot)->pending <= 0)
+        _node_drop(slot);
+}
+
+
+/* POSTs the ops as one batch, results[i] is the status of the i-th */
+static int _send(int user_id, const char *json, int *results, int n)
+{
+    char url[URL_MAX];
+    snprintf(url, sizeof(url), "%s/batch?user_id=%d", get_server_url(), user_id);
+
+    string_buf_t resp = {0};
+    uint32_t status = 0;
+    int rc = http_post_json(url, json, &resp, &status);
+    if (rc == 0 && status != 201)
+        rc = -EIO;
+    cJSON *root = rc == 0 ? cJSON_Parse(resp.ptr) : NULL;
+    free(resp.ptr);
+    if (rc != 0)
+        return rc;
+
+    cJSON *arr = cJSON_GetObjectItemCaseSensitive(root, "results");
+    if (!cJSON_IsArray(arr) || cJSON_GetArraySize(arr) != n) {
+        cJSON_Delete(root);
+        return -EIO;
+    }
+    int i = 0;
+    cJSON *item;
+    cJSON_ArrayForEach(item, arr)
+        results[i++] = cJSON_IsNumber(item) ? item->valueint : 0;
+    cJSON_Delete(root);
+    return 0;
+}
+
+/* Sends the log from the head, one user and at most META_BATCH_MAX ops a
+ * request. Ops stay queued (and shadowing) until the server answered. */
+static void *_flusher(void *arg)
+{
+    int failures = 0;
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        while (!head && !stopping)
+            pthread_cond_wait(&work_cond, &log_lock);
+        if (!head)
+            break;
+
+        /* Bursts (untar, rm -r) fill a batch in far less than a round trip */
+        struct timespec ts;
+        deadline_after(&ts, linger_ms);
+        while (linger_ms > 0 && n_ops < META_BATCH_MAX && !hurry && !stopping &&
+               pthread_cond_timedwait(&work_cond, &log_lock, &ts) == 0)
+            ;
+        hurry = 0;
+
+        int user_id = head->user_id, n = 0;
+        cJSON *body = cJSON_CreateObject();
+        cJSON *ops = cJSON_AddArrayToObject(body, "ops");
+        for (meta_op_t *o = head; o && n < META_BATCH_MAX && o->user_id == user_id; o = o->next, n++) {
+            cJSON *op = cJSON_CreateObject();
+            cJSON_AddStringToObject(op, "op", op_names[o->op]);
+            cJSON_AddStringToObject(op, "path", o->path);
+            if (o->op == META_UTIMENS)
+                cJSON_AddNumberToObject(op, "mtime", (double)o->mtime);
+            cJSON_AddItemToArray(ops, op);
+        }
+        char *json = cJSON_PrintUnformatted(body);
+        cJSON_Delete(body);
+        int fd = log_fd;
+        pthread_mutex_unlock(&log_lock);
+
+        fdatasync(fd);  // nothing reaches the server that a crash could lose
+        int *results = calloc(n, sizeof(int));
+        int rc = json && results ? _send(user_id, json, results, n) : -ENOMEM;
+        cJSON_free(json);
+
+        if (rc != 0) {
+            free(results);
+            failures++;
+            pthread_mutex_lock(&log_lock);
+            send_failures++;
+            /* The batch may have gone through with only its answer lost */
+            meta_op_t *o = head;
+            for (int i = 0; i < n && o; i++, o = o->next)
+                o->resent = 1;
+            pthread_cond_broadcast(&done_cond);
+            if (stopping && failures >= META_WAIT_TRIES) {
+                LOGMSG("[META] server unreachable, %d ops stay in %s", n_ops, log_path);
+                break;
+            }
+            pthread_mutex_unlock(&log_lock);
+            http_sleep_ms(http_backoff_ms(NULL, failures));
+            pthread_mutex_lock(&log_lock);
+            continue;
+        }
+        failures = 0;
+
+        pthread_mutex_lock(&log_lock);
+        uint64_t last = 0;
+        for (int i = 0; i < n; i++) {
+            meta_op_t *o = head;
+            head = o->next;
+            if (!head)
+                tail = NULL;
+            n_ops--;
+            _confirm(o, results[i]);
+            last = o->seq;
+            _op_free(o);
+        }
+        free(results);
+        confirmed_seq = last;
+        if (head)
+            dprintf(log_fd, "A %llu\n", (unsigned long long)last);
+        else if (ftruncate(log_fd, 0) != 0)  // all done, O_APPEND starts over
+            dprintf(log_fd, "A %llu\n", (unsigned long long)last);
+        STAT_ADD(stat_batches, 1);
+        pthread_cond_broadcast(&done_cond);
+    }
+    running = 0;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+
+/* Ops a previous mount logged but never got confirmed, in order.
+ * Caller holds log_lock. */
+static void _replay(void)
+{
+    FILE *f = fopen(log_path, "r");
+    if (!f)
+        return;
+
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        unsigned long long seq;
+        if (line[0] == 'A' && sscanf(line, "A %llu", &seq) == 1) {
+            while (head && head->seq <= seq) {
+                meta_op_t *o = head;
+                head = o->next;
+                n_ops--;
+                _op_free(o);
+            }
+            if (!head)
+                tail = NULL;
+            continue;
+        }
+
+        int user_id, op, off = 0;
+        long long mtime;
+        if (sscanf(line, "O %llu %d %d %lld %n", &seq, &user_id, &op, &mtime, &off) != 4 ||
+            !off || op < META_MKDIR || op > META_UTIMENS)
+            continue;
+        meta_op_t *o = calloc(1, sizeof(*o));
+        if (!o || !(o->path = strdup(line + off))) {
+            free(o);
+            continue;
+        }
+        o->seq = seq;
+        o->user_id = user_id;
+        o->op = op;
+        o->mtime = (time_t)mtime;
+        o->resent = 1;  // the last mount may have sent it, only the A line got lost
+        o->replayed = 1;
+        _enqueue(o);
+        if (seq >= next_seq)
+            next_seq = seq + 1;
+    }
+    fclose(f);
+
+    for (meta_op_t *o = head; o; o = o->next) {
+        _shadow(o);
+        if (o->op != META_CREATE)
+            continue;
+        /* The cache went with the last mount, created files start out empty */
+        char cache_path[PATH_MAX];
+        BUILD_CACHE_PATH(cache_path, o->user_id, o->path);
+        char *dup = strdup(cache_path);
+        if (dup) {
+            mkdir_p(dirname(dup));
+            free(dup);
+        }
+        int fd = open(cache_path, O_WRONLY | O_CREAT, 0644);
+        if (fd >= 0)
+            close(fd);
+    }
+    if (head)
+        LOGMSG("[META] %d ops left from the last mount", n_ops);
+}
+
+
+/* Tunables: DISFS_ASYNC_META=1 logs namespace changes instead of waiting
+ * on the server, DISFS_META_LINGER_MS. Leftover ops are sent either way. */
+void meta_log_init(void)
+{
+    enabled = env_long("DISFS_ASYNC_META", 0) != 0;
+    linger_ms = env_long("DISFS_META_LINGER_MS", META_LINGER_MS_DEFAULT);
+    if (linger_ms < 0)
+        linger_ms = 0;
+    snprintf(log_path, sizeof(log_path), "%s/oplog", project_root);
+
+    pthread_mutex_lock(&log_lock);
+    _replay();
+    if (!enabled && !head) {
+        pthread_mutex_unlock(&log_lock);
+        unlink(log_path);
+        LOGMSG("[META] synchronous");
+        return;
+    }
+
+    /* Rewritten with only what is left */
+    log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    for (meta_op_t *o = head; o && log_fd >= 0; o = o->next)
+        _write_op(o);
+    stopping = 0;
+    running = log_fd >= 0 && pthread_create(&flusher, NULL, _flusher, NULL) == 0;
+    if (!running)
+        enabled = 0;
+    pthread_mutex_unlock(&log_lock);
+    LOGMSG("[META] %s, log at %s", enabled ? "asynchronous" : "synchronous", log_path);
+}
+
+
+/* Sends what is left, a server out of reach leaves it for the next mount */
+void meta_log_exit(void)
+{
+    pthread_mutex_lock(&log_lock);
+    int joinable = running;
+    stopping = 1;
+    hurry = 1;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&log_lock);
+    if (joinable)
+        pthread_join(flusher, NULL);
+
+    pthread_mutex_lock(&log_lock);
+    enabled = 0;
+    if (log_fd >= 0) {
+        fdatasync(log_fd);
+        close(log_fd);
+        log_fd = -1;
+        if (!head)
+            unlink(log_path);
+    }
+    while (head) {
+        meta_op_t *o = head;
+        head = o->next;
+        _op_free(o);
+    }
+    tail = NULL;
+    n_ops = 0;
+    for (int b = 0; b < META_BUCKETS; b++)
+        while (nodes[b])
+            _node_drop(&nodes[b]);
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+int meta_log_enabled(void)
+{
+    return enabled;
+}
+
+
+/* Logs op on path, it is in effect for everyone asking this module from
+ * now on. 0 or -errno if it couldn't be logged. */
+int meta_log_append(int user_id, int op, const char *path, time_t mtime)
+{
+    if (strchr(path, '\n'))
+        return -EINVAL;  // one op per line
+    meta_op_t *o = calloc(1, sizeof(*o));
+    if (!o || !(o->path = strdup(path))) {
+        free(o);
+        return -ENOMEM;
+    }
+    o->user_id = user_id;
+    o->op = op;
+    o->mtime = mtime;
+
+    pthread_mutex_lock(&log_lock);
+    if (!running) {
+        pthread_mutex_unlock(&log_lock);
+        _op_free(o);
+        return -EIO;
+    }
+    o->seq = next_seq++;
+    int rc = _write_op(o);
+    if (rc == 0)
+        rc = _shadow(o);
+    if (rc != 0) {
+        pthread_mutex_unlock(&log_lock);
+        _op_free(o);
+        return rc;
+    }
+    _enqueue(o);
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&log_lock);
+    STAT_ADD(stat_ops, 1);
+    return 0;
+}
+
+
+static void _fill_stat(int user_id, const char *path, int state, time_t mtime, struct stat *st)
+{
+    if (state == META_DIR) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        char cache_path[PATH_MAX];
+        BUILD_CACHE_PATH(cache_path, user_id, path);
+        struct stat local;
+        if (stat(cache_path, &local) == 0) {
+            st->st_size = local.st_size;
+            if (local.st_mtime > mtime)
+                mtime = local.st_mtime;  // written since
+        }
+    }
+    st->st_atime = st->st_mtime = st->st_ctime = mtime;
+}
+
+/* 0 and *st filled if unconfirmed ops made path, -ENOENT if they removed
+ * it, 1 if the server knows best */
+int meta_log_stat(int user_id, const char *path, struct stat *st)
+{
+    if (!__atomic_load_n(&n_nodes, __ATOMIC_RELAXED))
+        return 1;
+
+    pthread_mutex_lock(&log_lock);
+    meta_node_t *n = *_node_slot(user_id, path);
+    int state = n ? n->state : META_TOUCHED;
+    time_t mtime = n ? n->mtime : 0;
+    pthread_mutex_unlock(&log_lock);
+
+    if (state == META_TOUCHED)
+        return 1;
+    if (state == META_GONE)
+        return -ENOENT;
+    _fill_stat(user_id, path, state, mtime, st);
+    return 0;
+}
+
+
+/* 1 and *mtime if an unconfirmed utimens set it */
+int meta_log_mtime(int user_id, const char *path, time_t *mtime)
+{
+    if (!__atomic_load_n(&n_nodes, __ATOMIC_RELAXED))
+        return 0;
+
+    pthread_mutex_lock(&log_lock);
+    meta_node_t *n = *_node_slot(user_id, path);
+    int has = n && n->has_mtime;
+    if (has)
+        *mtime = n->mtime;
+    pthread_mutex_unlock(&log_lock);
+    return has;
+}
+
+
+/* 1 if path is a file the server doesn't have yet */
+int meta_log_pending(int user_id, const char *path)
+{
+    if (!__atomic_load_n(&n_nodes, __ATOMIC_RELAXED))
+        return 0;
+
+    pthread_mutex_lock(&log_lock);
+    meta_node_t *n = *_node_slot(user_id, path);
+    int pending = n && n->state == META_FILE;
+    pthread_mutex_unlock(&log_lock);
+    return pending;
+}
+
+
+/* Calls fn for each entry unconfirmed ops made in dir, returns how many */
+int meta_log_children(int user_id, const char *dir, meta_child_fn fn, void *arg)
+{
+    if (!__atomic_load_n(&n_nodes, __ATOMIC_RELAXED))
+        return 0;
+
+    size_t len = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+    struct child { char *path; int state; time_t mtime; } *found = NULL;
+    int n_found = 0, cap = 0;
+
+    pthread_mutex_lock(&log_lock);
+    for (int b = 0; b < META_BUCKETS; b++) {
+        for (meta_node_t *n = nodes[b]; n; n = n->next) {
+            if (n->user_id != user_id || (n->state != META_DIR && n->state != META_FILE))
+                continue;
+            if (strncmp(n->path, dir, len) != 0 || n->path[len] != '/' ||
+                strchr(n->path + len + 1, '/'))
+                continue;
+            if (n_found == cap) {
+                cap = cap ? cap * 2 : 16;
+                struct child *grown = realloc(found, cap * sizeof(*found));
+                if (!grown)
+                    break;
+                found = grown;
+            }
+            if (!(found[n_found].path = strdup(n->path)))
+                continue;
+            found[n_found].state = n->state;
+            found[n_found].mtime = n->mtime;
+            n_found++;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    for (int i = 0; i < n_found; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        _fill_stat(user_id, found[i].path, found[i].state, found[i].mtime, &st);
+        if (fn)
+            fn(found[i].path + len + 1, &st, arg);
+        free(found[i].path);
+    }
+    free(found);
+    return n_found;
+}
+
+
+/* Waits until everything logged so far is on the server. Operations that
+ * don't go through the log call this first, so they see its effects.
+ * 0, or -ECOMM once sending failed META_WAIT_TRIES times. */
+int meta_log_barrier(void)
+{
+    pthread_mutex_lock(&log_lock);
+    uint64_t target = next_seq - 1;
+    uint64_t failed_before = send_failures;
+    while (running && confirmed_seq < target && send_failures - failed_before < META_WAIT_TRIES) {
+        hurry = 1;
+        pthread_cond_signal(&work_cond);
+        pthread_cond_wait(&done_cond, &log_lock);
+    }
+    int rc = confirmed_seq >= target || !head ? 0 : -ECOMM;
+    pthread_mutex_unlock(&log_lock);
+    return rc;
+}
+
+
+/* Barrier for fsync, also reports the first op the server rejected since */
+int meta_log_wait(void)
+{
+    int rc = meta_log_barrier();
+    pthread_mutex_lock(&log_lock);
+    int err = first_error;
+    first_error = 0;
+    pthread_mutex_unlock(&log_lock);
+    return rc ? rc : err;
+}
+
+
+int meta_log_stats(char *buf, size_t size)
+{
+    pthread_mutex_lock(&log_lock);
+    int queued = n_ops;
+    pthread_mutex_unlock(&log_lock);
+    return snprintf(buf, size,
+            "[Metadata log]\n"
+            "- Mode: %s\n"
+            "- Queued: %d\n"
+            "- Logged: %lu, sent in %lu batches\n"
+            "- Rejected by server: %lu\n",
+            enabled ? "asynchronous" : "synchronous", queued,
+            (unsigned long)STAT_GET(stat_ops), (unsigned long)STAT_GET(stat_batches),
+            (unsigned long)STAT_GET(stat_rejected));
+}
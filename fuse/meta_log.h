@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+#define META_BATCH_MAX 512          // ops per /batch request, the server takes up to 1024
+#define META_LINGER_MS_DEFAULT 5    // a batch waits this long for more ops to join
+#define META_WAIT_TRIES 3           // failed sends a waiter (or unmount) sits through
+
+enum meta_op { META_MKDIR, META_CREATE, META_UNLINK, META_RMDIR, META_UTIMENS };
+enum meta_state { META_DIR, META_FILE, META_GONE, META_TOUCHED };
+
+
+/* Optional (DISFS_ASYNC_META=1) write-behind of namespace changes. mkdir,
+ * create, unlink, rmdir and utimens return once the op is appended to an
+ * op log on disk. A flusher thread sends the log in order to /batch, many
+ * ops per request and transaction. Until the server confirms them, what
+ * the ops did is kept per path and shadows the server's answers.
+ * Ops the server rejects are logged, counted and reported by the next
+ * fsync (unless an earlier mount logged them), and their path falls back
+ * to what the server has. A resent op finding its work done counts as done.
+ */
+typedef struct meta_op_entry {
+    uint64_t seq;
+    int user_id;
+    int op;
+    char *path;
+    time_t mtime;               // META_UTIMENS
+    int resent;                 // sent before, the server may have applied it already
+    int replayed;               // logged by an earlier mount, nobody here waits on it
+    struct meta_op_entry *next;
+} meta_op_t;
+
+/* Path as the unconfirmed ops left it */
+typedef struct meta_node {
+    char *path;
+    int user_id;
+    int state;                  // enum meta_state, TOUCHED only had its mtime set
+    time_t mtime;
+    int has_mtime;
+    int pending;                // ops on it not confirmed yet
+    struct meta_node *next;
+} meta_node_t;
+
+typedef void (*meta_child_fn)(const char *name, const struct stat *st, void *arg);
+
+
+void meta_log_init(void);
+void meta_log_exit(void);
+int meta_log_enabled(void);
+
+int meta_log_append(int user_id, int op, const char *path, time_t mtime);
+int meta_log_stat(int user_id, const char *path, struct stat *st);
+int meta_log_mtime(int user_id, const char *path, time_t *mtime);
+int meta_log_pending(int user_id, const char *path);
+int meta_log_children(int user_id, const char *dir, meta_child_fn fn, void *arg);
+
+int meta_log_barrier(void);
+int meta_log_wait(void);
+int meta_log_stats(char *buf, size_t size);
@@ -0,0 +1,260 @@
+#include "open_file.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* A handful of files are open at once, a list does */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static open_file_t *table;
+
+
+/* Unlinks of from the table if it's still there, caller holds table_lock */
+static void _table_remove(open_file_t *of)
+{
+    for (open_file_t **indirect = &table; *indirect; indirect = &(*indirect)->next) {
+        if (*indirect == of) {
+            *indirect = of->next;
+            of->next = NULL;
+            return;
+        }
+    }
+}
+
+/* Pulls every entry at or below dir out of the table into a list */
+static open_file_t *_table_take_prefix(const char *dir)
+{
+    size_t len = strlen(dir);
+    open_file_t *taken = NULL;
+    open_file_t **indirect = &table;
+    while (*indirect) {
+        open_file_t *cur = *indirect;
+        if (path_under(cur->cache_path, dir, len)) {
+            *indirect = cur->next;
+            cur->next = taken;
+            taken = cur;
+            continue;
+        }
+        indirect = &cur->next;
+    }
+    return taken;
+}
+
+/* Puts entries taken from `from` back, keyed under `to` instead.
+ * One that can't be renamed stays out, its handles keep working.
+ */
+static void _table_rekey(open_file_t *list, const char *from, const char *to)
+{
+    size_t len = strlen(from);
+    while (list) {
+        open_file_t *next = list->next;
+        char moved[PATH_MAX];
+        snprintf(moved, sizeof(moved), "%s%s", to, list->cache_path + len);
+        char *dup = strdup(moved);
+        list->next = NULL;
+        if (dup) {
+            free(list->cache_path);
+            list->cache_path = dup;
+            list->next = table;
+            table = list;
+        }
+        list = next;
+    }
+}
+
+/* Detaches a list of entries, their handles keep them alive */
+static void _orphan_list(open_file_t *list)
+{
+    while (list) {
+        open_file_t *next = list->next;
+        list->next = NULL;
+        list = next;
+    }
+}
+
+
+void dirty_set_free(dirty_set_t *ds)
+{
+    free(ds->bits);
+    memset(ds, 0, sizeof(*ds));
+}
+
+
+/* Shared state of cache_path, created on first open. NULL on ENOMEM */
+open_file_t *open_file_get(const char *cache_path, int writer)
+{
+    pthread_mutex_lock(&table_lock);
+    open_file_t *of = table;
+    while (of && strcmp(of->cache_path, cache_path) != 0)
+        of = of->next;
+
+    if (!of) {
+        of = calloc(1, sizeof(*of));
+        if (!of || !(of->cache_path = strdup(cache_path))) {
+            free(of);
+            pthread_mutex_unlock(&table_lock);
+            return NULL;
+        }
+        pthread_mutex_init(&of->lock, NULL);
+        of->next = table;
+        table = of;
+    }
+    of->refs++;
+    if (writer)
+        of->writers++;
+    pthread_mutex_unlock(&table_lock);
+    return of;
+}
+
+
+/* Drops a handle's reference. Returns 1 when no writer is left and
+ * something is dirty, the set moved to out then and is the caller's to ship.
+ */
+int open_file_put(open_file_t *of, int writer, dirty_set_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!of)
+        return 0;
+
+    pthread_mutex_lock(&table_lock);
+    if (writer)
+        of->writers--;
+    int returner = of->writers == 0 ? open_file_take_dirty(of, out) : 0;
+    int last = --of->refs == 0;
+    if (last)
+        _table_remove(of);
+    pthread_mutex_unlock(&table_lock);
+
+    if (last) {
+        pthread_mutex_destroy(&of->lock);
+        free(of->cache_path);
+        free(of);
+    }
+    return returner;
+}
+
+
+/* 1 while some handle has cache_path open, GC must leave it alone */
+int open_file_busy(const char *cache_path)
+{
+    pthread_mutex_lock(&table_lock);
+    open_file_t *of = table;
+    while (of && strcmp(of->cache_path, cache_path) != 0)
+        of = of->next;
+    pthread_mutex_unlock(&table_lock);
+    return of != NULL;
+}
+
+
+/* 1 if an open handle of cache_path wrote something not shipped yet */
+int open_file_dirty(const char *cache_path)
+{
+    pthread_mutex_lock(&table_lock);
+    open_file_t *of = table;
+    while (of && strcmp(of->cache_path, cache_path) != 0)
+        of = of->next;
+    int returner = of ? open_file_is_dirty(of) : 0;
+    pthread_mutex_unlock(&table_lock);
+    return returner;
+}
+
+
+/* Records [offset, offset + size) as rewritten */
+void open_file_mark_dirty(open_file_t *of, off_t offset, size_t size)
+{
+    pthread_mutex_lock(&of->lock);
+    dirty_set_t *ds = &of->dirty;
+    ds->any = 1;
+    if (ds->all || size == 0) {
+        pthread_mutex_unlock(&of->lock);
+        return;
+    }
+
+    uint32_t first = offset / CHUNK_SIZE;
+    uint32_t last = (offset + size - 1) / CHUNK_SIZE;
+    if (last >= ds->n) {
+        uint32_t n = ds->n ? ds->n : 64;
+        while (n <= last)
+            n *= 2;
+        uint8_t *bits = realloc(ds->bits, BITMAP_BYTES(n));
+        if (!bits) {
+            ds->all = 1;  // still correct, just ships more
+            pthread_mutex_unlock(&of->lock);
+            return;
+        }
+        memset(bits + BITMAP_BYTES(ds->n), 0, BITMAP_BYTES(n) - BITMAP_BYTES(ds->n));
+        ds->bits = bits;
+        ds->n = n;
+    }
+    for (uint32_t i = first; i <= last; i++)
+        BIT_SET(ds->bits, i);
+    pthread_mutex_unlock(&of->lock);
+}
+
+
+/* The server copy is gone, everything has to go up again */
+void open_file_mark_all(open_file_t *of)
+{
+    pthread_mutex_lock(&of->lock);
+    free(of->dirty.bits);
+    of->dirty.bits = NULL;
+    of->dirty.n = 0;
+    of->dirty.all = 1;
+    of->dirty.any = 1;
+    pthread_mutex_unlock(&of->lock);
+}
+
+
+int open_file_is_dirty(open_file_t *of)
+{
+    pthread_mutex_lock(&of->lock);
+    int returner = of->dirty.any;
+    pthread_mutex_unlock(&of->lock);
+    return returner;
+}
+
+
+/* Moves the dirty set into out and starts a fresh one. 1 if it held anything */
+int open_file_take_dirty(open_file_t *of, dirty_set_t *out)
+{
+    pthread_mutex_lock(&of->lock);
+    *out = of->dirty;
+    memset(&of->dirty, 0, sizeof(of->dirty));
+    pthread_mutex_unlock(&of->lock);
+    if (!out->any)
+        dirty_set_free(out);
+    return out->any;
+}
+
+
+/* Unlinked, a file created there later starts out with state of its own */
+void open_file_forget(const char *cache_path)
+{
+    pthread_mutex_lock(&table_lock);
+    _orphan_list(_table_take_prefix(cache_path));
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+/* Follows a file or directory rename. Whatever was open at the
+ * destination was replaced, later opens there don't share with it.
+ */
+void open_file_rename(const char *from_cache, const char *to_cache)
+{
+    pthread_mutex_lock(&table_lock);
+    open_file_t *replaced = _table_take_prefix(to_cache);
+    open_file_t *moved = _table_take_prefix(from_cache);
+    _table_rekey(moved, from_cache, to_cache);
+    _orphan_list(replaced);
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+void open_file_swap(const char *a_cache, const char *b_cache)
+{
+    pthread_mutex_lock(&table_lock);
+    open_file_t *a = _table_take_prefix(a_cache);
+    open_file_t *b = _table_take_prefix(b_cache);
+    _table_rekey(a, a_cache, b_cache);
+    _table_rekey(b, b_cache, a_cache);
+    pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "debug.h"
+
+
+/* Chunks rewritten since the last upload */
+typedef struct dirty_set {
+    int any;
+    int all;                // server copy is gone, every chunk has to go
+    uint8_t *bits;          // else 1 bit per CHUNK_SIZE chunk
+    uint32_t n;             // chunks bits has room for
+} dirty_set_t;
+
+/* State shared by every handle open on one cache file. Writes through any
+ * of them collect in one dirty set, shipped once the last writer closes.
+ * Each fh_t holds a reference, an entry leaves the table with its last one.
+ */
+typedef struct open_file {
+    char *cache_path;
+    int refs;               // handles open, guarded by the table lock
+    int writers;            // of those, opened for writing
+    dirty_set_t dirty;      // guarded by lock
+    pthread_mutex_t lock;
+    struct open_file *next;
+} open_file_t;
+
+
+open_file_t *open_file_get(const char *cache_path, int writer);
+int open_file_put(open_file_t *of, int writer, dirty_set_t *out);
+int open_file_busy(const char *cache_path);
+int open_file_dirty(const char *cache_path);
+
+void open_file_mark_dirty(open_file_t *of, off_t offset, size_t size);
+void open_file_mark_all(open_file_t *of);
+int open_file_is_dirty(open_file_t *of);
+int open_file_take_dirty(open_file_t *of, dirty_set_t *out);
+void dirty_set_free(dirty_set_t *ds);
+
+void open_file_forget(const char *cache_path);
+void open_file_rename(const char *from_cache, const char *to_cache);
+void open_file_swap(const char *a_cache, const char *b_cache);
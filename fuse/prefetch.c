@@ -0,0 +1,192 @@
+#include "prefetch.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+static thread_pool_t *pool;
+static uint32_t readahead_max = READAHEAD_MAX_DEFAULT;
+
+/* Counters for .command/stats */
+static uint64_t stat_issued;    // chunks queued for prefetch
+static uint64_t stat_failed;    // prefetches that errored out
+static uint64_t stat_hits;      // reads landing on a prefetched chunk
+static uint64_t stat_waste;     // prefetched chunks never read
+
+typedef struct {
+    chunk_map_t *map;
+    char *path;
+    int user_id;
+    uint32_t chunk;
+} prefetch_job_t;
+
+
+/* Tunables: DISFS_READAHEAD_MAX (0 disables), DISFS_PREFETCH_THREADS */
+void prefetch_init(void)
+{
+    long max = env_long("DISFS_READAHEAD_MAX", READAHEAD_MAX_DEFAULT);
+    readahead_max = max > 0 ? (uint32_t)max : 0;
+    if (readahead_max > READAHEAD_LIMIT)
+        readahead_max = READAHEAD_LIMIT;
+    if (readahead_max)
+        pool = thread_pool_create(env_long("DISFS_PREFETCH_THREADS", PREFETCH_THREADS_DEFAULT));
+    LOGMSG("[RA] readahead max=%u chunks, pool=%p", readahead_max, (void *)pool);
+}
+
+
+static void _job_free(prefetch_job_t *job)
+{
+    chunk_map_put(job->map);
+    free(job->path);
+    free(job);
+}
+
+
+/* Readahead still queued at unmount is dropped, the cache goes right after */
+static void _prefetch_discard(void *arg)
+{
+    prefetch_job_t *job = arg;
+    chunk_map_t *m = job->map;
+
+    pthread_mutex_lock(&m->lock);
+    BIT_CLEAR(m->prefetched, job->chunk);
+    pthread_mutex_unlock(&m->lock);
+    _job_free(job);
+}
+
+
+void prefetch_exit(void)
+{
+    thread_pool_t *p = pool;
+    pool = NULL;
+    thread_pool_destroy(p, _prefetch_discard);
+}
+
+
+static void _prefetch_job(void *arg)
+{
+    prefetch_job_t *job = arg;
+    chunk_map_t *m = job->map;
+
+    int rc = chunk_map_fetch(m, job->path, job->user_id,
+                             chunk_map_start(m, job->chunk), 1);
+    if (rc != 0) {
+        LOGMSG("[RA] prefetch of chunk %u (%s) failed: %d", job->chunk, job->path, rc);
+        pthread_mutex_lock(&m->lock);
+        BIT_CLEAR(m->prefetched, job->chunk);
+        pthread_mutex_unlock(&m->lock);
+        STAT_ADD(stat_failed, 1);
+    }
+    _job_free(job);
+}
+
+
+/* Called by do_read before fetching [offset, offset + size).
+ * Sequential readers get the next `window` chunks queued in the background,
+ * the window doubles every time the reader lands on a prefetched chunk.
+ */
+void prefetch_on_read(fh_t *fh, const char *path, int user_id, off_t offset, size_t size)
+{
+    chunk_map_t *m = fh->map;
+    if (!m || !pool || size == 0)
+        return;
+
+    uint32_t queue[READAHEAD_LIMIT];
+    int n_queue = 0;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->complete || offset >= m->size) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    uint32_t first = chunk_map_index(m, offset);
+    off_t end = offset + (off_t)size > m->size ? m->size : offset + (off_t)size;
+    uint32_t last = chunk_map_index(m, end - 1);
+
+    int hit = 0;
+    for (uint32_t i = first; i <= last; i++) {
+        if (BIT_TEST(m->prefetched, i)) {
+            BIT_CLEAR(m->prefetched, i);
+            STAT_ADD(stat_hits, 1);
+            hit = 1;
+        }
+    }
+
+    int sequential = (offset == fh->ra_next);
+    fh->ra_next = offset + (off_t)size;
+    if (!sequential) {
+        fh->ra_window = 0;
+        fh->ra_issued = last + 1;
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    if (fh->ra_window == 0)
+        fh->ra_window = READAHEAD_INIT;
+    else if (hit && fh->ra_window < readahead_max)
+        fh->ra_window = fh->ra_window * 2 > readahead_max ? readahead_max : fh->ra_window * 2;
+
+    uint32_t from = fh->ra_issued > last + 1 ? fh->ra_issued : last + 1;
+    uint32_t to = last + fh->ra_window;
+    if (to >= m->n_chunks)
+        to = m->n_chunks - 1;
+
+    for (uint32_t i = from; i <= to && n_queue < READAHEAD_LIMIT; i++) {
+        if (BIT_TEST(m->present, i) || BIT_TEST(m->fetching, i))
+            continue;
+        BIT_SET(m->prefetched, i);
+        queue[n_queue++] = i;
+    }
+    if (to + 1 > fh->ra_issued)
+        fh->ra_issued = to + 1;
+    pthread_mutex_unlock(&m->lock);
+
+    for (int i = 0; i < n_queue; i++) {
+        prefetch_job_t *job = malloc(sizeof(*job));
+        char *dup = strdup(path);
+        if (!job || !dup) {
+            free(job);
+            free(dup);
+            break;
+        }
+        chunk_map_hold(m);
+        job->map = m;
+        job->path = dup;
+        job->user_id = user_id;
+        job->chunk = queue[i];
+        if (thread_pool_submit(pool, _prefetch_job, job) != 0) {
+            chunk_map_put(m);
+            free(job->path);
+            free(job);
+            break;
+        }
+        STAT_ADD(stat_issued, 1);
+    }
+    if (n_queue)
+        LOGMSG("[RA] %s: window=%u, queued %d chunk(s) from %u",
+               path, fh->ra_window, n_queue, queue[0]);
+}
+
+
+void prefetch_account_waste(uint32_t chunks)
+{
+    STAT_ADD(stat_waste, chunks);
+}
+
+
+/* Human readable counters, returns bytes written like snprintf */
+int prefetch_stats(char *buf, size_t size)
+{
+    uint64_t issued = STAT_GET(stat_issued), hits = STAT_GET(stat_hits);
+    uint64_t waste = STAT_GET(stat_waste), failed = STAT_GET(stat_failed);
+    return snprintf(buf, size,
+            "[Prefetch]\n"
+            "- Readahead max: %u chunks\n"
+            "- Issued: %lu\n"
+            "- Hits: %lu (%.1f%%)\n"
+            "- Wasted: %lu (%.1f%%)\n"
+            "- Failed: %lu\n",
+            readahead_max, (unsigned long)issued,
+            (unsigned long)hits, issued ? 100.0 * hits / issued : 0.0,
+            (unsigned long)waste, issued ? 100.0 * waste / issued : 0.0,
+            (unsigned long)failed);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fuse_utils.h"
+#include "chunk_map.h"
+#include "thread_pool.h"
+#include "debug.h"
+
+/* Readahead window bounds, in chunks */
+#define READAHEAD_INIT 1
+#define READAHEAD_MAX_DEFAULT 4
+#define READAHEAD_LIMIT 64
+#define PREFETCH_THREADS_DEFAULT 4
+
+
+void prefetch_init(void);
+void prefetch_exit(void);
+void prefetch_on_read(fh_t *fh, const char *path, int user_id, off_t offset, size_t size);
+void prefetch_account_waste(uint32_t chunks);
+int prefetch_stats(char *buf, size_t size);
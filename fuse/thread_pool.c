@@ -0,0 +1,126 @@
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <errno.h>
+
+
+static void *_worker(void *arg)
+{
+    thread_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        /* Whatever is still queued at stop is run, unless destroy took it */
+        if (!pool->head)
+            break;
+
+        pool_job_t *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+thread_pool_t *thread_pool_create(int n_threads)
+{
+    if (n_threads <= 0)
+        return NULL;
+
+    thread_pool_t *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->threads = calloc(n_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, _worker, pool) != 0)
+            break;
+        pool->n_threads++;
+    }
+    if (pool->n_threads == 0) {
+        thread_pool_destroy(pool, NULL);
+        return NULL;
+    }
+    return pool;
+}
+
+
+/* 0 on success, job is owned by the pool from here on */
+int thread_pool_submit(thread_pool_t *pool, void (*fn)(void *arg), void *arg)
+{
+    if (!pool)
+        return -EINVAL;
+
+    pool_job_t *job = malloc(sizeof(*job));
+    if (!job)
+        return -ENOMEM;
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop) {
+        pthread_mutex_unlock(&pool->lock);
+        free(job);
+        return -ESHUTDOWN;
+    }
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+
+/* Joins every worker. Jobs still queued are run first, or with discard
+ * handed to it instead (it frees their arg), for work that is only worth
+ * doing while the pool lives */
+void thread_pool_destroy(thread_pool_t *pool, void (*discard)(void *arg))
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pool_job_t *left = NULL;
+    if (discard) {
+        left = pool->head;
+        pool->head = pool->tail = NULL;
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    while (left) {
+        pool_job_t *job = left;
+        left = job->next;
+        discard(job->arg);
+        free(job);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <pthread.h>
+
+
+typedef struct pool_job {
+    void (*fn)(void *arg);
+    void *arg;
+    struct pool_job *next;
+} pool_job_t;
+
+/* Fixed set of workers draining a FIFO of jobs */
+typedef struct thread_pool {
+    pthread_t *threads;
+    int n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pool_job_t *head, *tail;
+    int stop;
+} thread_pool_t;
+
+
+thread_pool_t *thread_pool_create(int n_threads);
+int thread_pool_submit(thread_pool_t *pool, void (*fn)(void *arg), void *arg);
+void thread_pool_destroy(thread_pool_t *pool, void (*discard)(void *arg));
@@ -0,0 +1,428 @@
+#include "upload_queue.h"
+#include "attr_cache.h"
+#include "meta_log.h"
+#include "chunk_map.h"
+#include "chunker.h"
+#include "cache_manage.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;  // new work or stop
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;  // an upload finished
+static upload_entry_t *head, *tail;
+static pthread_t *workers;
+static int n_workers;
+static int stopping;
+static int64_t debounce_ms;
+static int64_t defer_max_ms;
+
+
+static int64_t _now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static upload_entry_t *_find(const char *path, int user_id)
+{
+    for (upload_entry_t *e = head; e; e = e->next) {
+        if (e->user_id == user_id && strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void _unlink_entry(upload_entry_t *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        tail = e->prev;
+    free(e->path);
+    free(e->cache_path);
+    free(e->dirty);
+    free(e);
+}
+
+/* Holds e back until saves stop for debounce_ms, but no longer than
+ * defer_max_ms after it first went dirty
+ */
+static void _debounce(upload_entry_t *e, int64_t now)
+{
+    if (!e->first_dirty)
+        e->first_dirty = now;
+    int64_t at = now + debounce_ms;
+    int64_t cap = e->first_dirty + defer_max_ms;
+    e->not_before = at < cap ? at : cap;
+}
+
+/* ORs a set of dirty chunks into e, falls back to a full upload on ENOMEM */
+static void _merge_dirty(upload_entry_t *e, int all, const uint8_t *dirty, uint32_t n)
+{
+    if (e->dirty_all)
+        return;
+    if (!all && n > e->n_dirty) {
+        uint8_t *bits = realloc(e->dirty, BITMAP_BYTES(n));
+        if (bits) {
+            memset(bits + BITMAP_BYTES(e->n_dirty), 0, BITMAP_BYTES(n) - BITMAP_BYTES(e->n_dirty));
+            e->dirty = bits;
+            e->n_dirty = n;
+        } else {
+            all = 1;
+        }
+    }
+    if (all) {
+        free(e->dirty);
+        e->dirty = NULL;
+        e->n_dirty = 0;
+        e->dirty_all = 1;
+        return;
+    }
+    for (uint32_t i = 0; i < BITMAP_BYTES(n); i++)
+        e->dirty[i] |= dirty[i];
+}
+
+
+/* Ships only the dirty chunks and those the server is missing.
+ * Chunks that have to go but were never fetched come from the old copy
+ * on the server, which stays in place until each one is replaced. The
+ * server hands this mount the copy as stored, without waiting on the
+ * upload that is about to replace it.
+ */
+static int _upload_partial(upload_entry_t *e, const uint8_t *dirty, uint32_t n_dirty)
+{
+    static const uint8_t none = 0;
+    struct stat st;
+    if (stat(e->cache_path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -ENOENT;
+
+    uint8_t *send = NULL;
+    int rc = upload_prep(e->path, e->user_id, st.st_size, st.st_mtim.tv_sec,
+                         dirty ? dirty : &none, n_dirty, &send);
+    if (rc != 0)
+        return rc;
+
+    uint32_t total = (st.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    chunk_map_t *map = chunk_map_get(e->cache_path);
+    for (uint32_t i = 0; map && i < total && rc == 0; i++) {
+        if (BIT_TEST(send, i))
+            rc = chunk_map_fetch(map, e->path, e->user_id, (off_t)i * CHUNK_SIZE, CHUNK_SIZE);
+    }
+    chunk_map_put(map);
+
+    if (rc == 0)
+        rc = upload_send_chunks(e->path, e->user_id, st.st_size, e->cache_path, send, NULL, NULL, 0, &e->abort);
+    free(send);
+    return rc;
+}
+
+
+/* Pulls in chunks never fetched, then ships the whole cache file */
+static int _upload_entry(upload_entry_t *e)
+{
+    chunk_map_t *map = chunk_map_get(e->cache_path);
+    if (map) {
+        int rc = chunk_map_fetch(map, e->path, e->user_id, 0, map->size);
+        if (rc == 0) {
+            chunk_map_set_complete(map);
+            chunk_map_drop(e->cache_path);
+        }
+        chunk_map_put(map);
+        if (rc != 0)
+            return rc;
+    }
+
+    struct stat st;
+    if (stat(e->cache_path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -ENOENT;  // gone locally, nothing left to upload
+
+    return upload_file_chunks(e->path, e->user_id, st.st_size,
+                              e->cache_path, st.st_mtim.tv_sec, &e->abort);
+}
+
+
+static void *_worker(void *arg)
+{
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        int64_t now = _now_ms();
+        int64_t earliest = 0;
+        upload_entry_t *e = head;
+        for (; e; e = e->next) {
+            if (e->in_flight)
+                continue;
+            int64_t due = e->next_try > e->not_before ? e->next_try : e->not_before;
+            if (due <= now)
+                break;
+            if (!earliest || due < earliest)
+                earliest = due;
+        }
+
+        if (!e) {
+            if (stopping && !head)
+                break;
+            if (earliest) {
+                struct timespec ts = { .tv_sec = earliest / 1000,
+                                       .tv_nsec = (earliest % 1000) * 1000000 };
+                pthread_cond_timedwait(&work_cond, &queue_lock, &ts);
+            } else {
+                pthread_cond_wait(&work_cond, &queue_lock);
+            }
+            continue;
+        }
+
+        /* Pushes from here on collect into a fresh set */
+        int all = e->dirty_all;
+        uint8_t *dirty = e->dirty;
+        uint32_t n_dirty = e->n_dirty;
+        e->dirty_all = 0;
+        e->dirty = NULL;
+        e->n_dirty = 0;
+        e->in_flight = 1;
+        e->redo = 0;
+        e->abort = 0;
+        int64_t started = now;
+        pthread_mutex_unlock(&queue_lock);
+
+        LOGMSG("[UPQ] uploading %s (attempt %d, %s)", e->path, e->attempts + 1,
+               all ? "whole file" : "dirty chunks");
+        /* Content-defined chunks are cut over the whole file, it all has to be local */
+        meta_log_barrier();  // a logged create of the file goes first
+        int rc = all || cdc_enabled() ? _upload_entry(e) : _upload_partial(e, dirty, n_dirty);
+        attr_cache_invalidate(e->path);  // server size and mtime moved with it
+
+        pthread_mutex_lock(&queue_lock);
+        e->in_flight = 0;
+        e->last_rc = rc;
+        if (rc != 0 && rc != -ENOENT)
+            _merge_dirty(e, all, dirty, n_dirty);
+        free(dirty);
+        if (rc == -ECANCELED && !e->cancelled) {
+            /* A newer save took over, it goes out once things calm down */
+            LOGMSG("[UPQ] upload of %s superseded", e->path);
+            e->next_try = 0;
+        } else if (rc == 0 || rc == -ENOENT || e->cancelled || stopping) {
+            if (rc != 0 && rc != -ENOENT && !e->cancelled)
+                LOGMSG("[UPQ] giving up on %s while unmounting: %d", e->path, rc);
+            if (e->redo && !e->cancelled && rc == 0) {
+                /* What's left dirty dates from during the upload at most */
+                e->attempts = 0;
+                e->next_try = 0;
+                e->first_dirty = started;
+            } else {
+                _unlink_entry(e);
+            }
+        } else {
+            /* Stays queued, retried with exponential backoff */
+            e->attempts++;
+            int backoff = 1 << (e->attempts < 5 ? e->attempts : 5);
+            if (backoff > UPLOAD_BACKOFF_MAX)
+                backoff = UPLOAD_BACKOFF_MAX;
+            e->next_try = _now_ms() + (int64_t)backoff * 1000;
+            LOGMSG("[UPQ] upload of %s failed (%d), retry in %ds", e->path, rc, backoff);
+        }
+        pthread_cond_broadcast(&done_cond);
+        pthread_cond_broadcast(&work_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+
+/* Tunables: DISFS_UPLOAD_WORKERS, DISFS_UPLOAD_DEBOUNCE_MS, DISFS_UPLOAD_DEFER_MAX_MS */
+void upload_queue_init(void)
+{
+    long n = env_long("DISFS_UPLOAD_WORKERS", UPLOAD_WORKERS_DEFAULT);
+    if (n <= 0)
+        n = 1;
+    debounce_ms = env_long("DISFS_UPLOAD_DEBOUNCE_MS", UPLOAD_DEBOUNCE_MS_DEFAULT);
+    if (debounce_ms < 0)
+        debounce_ms = 0;
+    defer_max_ms = env_long("DISFS_UPLOAD_DEFER_MAX_MS", UPLOAD_DEFER_MAX_MS_DEFAULT);
+    if (defer_max_ms < debounce_ms)
+        defer_max_ms = debounce_ms;
+
+    stopping = 0;
+    workers = calloc(n, sizeof(pthread_t));
+    if (!workers)
+        return;
+    for (n_workers = 0; n_workers < n; n_workers++) {
+        if (pthread_create(&workers[n_workers], NULL, _worker, NULL) != 0)
+            break;
+    }
+    LOGMSG("[UPQ] %d upload worker(s)", n_workers);
+}
+
+
+/* Drains the queue (unmount), then joins the workers */
+void upload_queue_exit(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    for (upload_entry_t *e = head; e; e = e->next) {
+        e->next_try = 0;
+        e->not_before = 0;
+        __atomic_store_n(&e->abort, 0, __ATOMIC_RELEASE);  // let the last version finish
+    }
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < n_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    n_workers = 0;
+}
+
+
+/* Queues path for upload, returns right away. 0 on success.
+ * dirty holds the chunks rewritten, NULL resends the whole file.
+ */
+int upload_queue_push(const char *path, int user_id, const dirty_set_t *dirty)
+{
+    int all = !dirty || dirty->all;
+    char cache_path[PATH_MAX];
+    BUILD_CACHE_PATH(cache_path, user_id, path);
+
+    /* The upload moves the server to a new generation, until then the
+     * cache is simply ahead. Its mtime vouches for it afterwards. */
+    cache_gen_clear(cache_path);
+
+    pthread_mutex_lock(&queue_lock);
+    int64_t now = _now_ms();
+    upload_entry_t *e = _find(path, user_id);
+    if (e) {
+        /* Already queued, the worker reads the newest cache file anyways.
+         * One in flight is stale now, drop it unless the file has been
+         * waiting too long already. */
+        if (e->in_flight) {
+            e->redo = 1;
+            if (!e->cancelled && !stopping && now - e->first_dirty < defer_max_ms)
+                __atomic_store_n(&e->abort, 1, __ATOMIC_RELEASE);
+        }
+        e->cancelled = 0;
+        _merge_dirty(e, all, all ? NULL : dirty->bits, all ? 0 : dirty->n);
+        _debounce(e, now);
+        pthread_mutex_unlock(&queue_lock);
+        return 0;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e || !(e->path = strdup(path)) || !(e->cache_path = strdup(cache_path))) {
+        if (e) {
+            free(e->path);
+            free(e);
+        }
+        pthread_mutex_unlock(&queue_lock);
+        return -ENOMEM;
+    }
+    e->user_id = user_id;
+    _merge_dirty(e, all, all ? NULL : dirty->bits, all ? 0 : dirty->n);
+    _debounce(e, now);
+    e->prev = tail;
+    if (tail)
+        tail->next = e;
+    else
+        head = e;
+    tail = e;
+
+    LOGMSG("[UPQ] queued %s", path);
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+
+/* Blocks until nothing at or below path is queued or uploading (fsync,
+ * rename, ...). Failing uploads are waited on for a few attempts only,
+ * their error is returned then.
+ */
+int upload_queue_wait(const char *path, int user_id)
+{
+    int returner = 0;
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        upload_entry_t *e = head;
+        for (; e; e = e->next) {
+            if (e->user_id == user_id && path_under(e->path, path, strlen(path)))
+                break;
+        }
+        if (!e)
+            break;
+        if (e->attempts >= UPLOAD_WAIT_ATTEMPTS) {
+            returner = e->last_rc;
+            break;
+        }
+
+        /* Don't sit out a backoff or debounce someone is waiting on */
+        if (!e->in_flight && (e->next_try || e->not_before)) {
+            e->next_try = 0;
+            e->not_before = 0;
+            pthread_cond_broadcast(&work_cond);
+        }
+        pthread_cond_wait(&done_cond, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return returner;
+}
+
+
+/* Forgets queued uploads at or below path (unlink), waits out one in flight */
+void upload_queue_cancel(const char *path, int user_id)
+{
+    pthread_mutex_lock(&queue_lock);
+    upload_entry_t *e = head;
+    while (e) {
+        upload_entry_t *next = e->next;
+        if (e->user_id == user_id && path_under(e->path, path, strlen(path))) {
+            if (e->in_flight) {
+                e->cancelled = 1;
+                __atomic_store_n(&e->abort, 1, __ATOMIC_RELEASE);
+            }
+            else
+                _unlink_entry(e);
+        }
+        e = next;
+    }
+
+    for (;;) {
+        for (e = head; e; e = e->next) {
+            if (e->user_id == user_id && e->in_flight && path_under(e->path, path, strlen(path)))
+                break;
+        }
+        if (!e)
+            break;
+        pthread_cond_wait(&done_cond, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+/* 1 if path has an upload queued or in flight */
+int upload_queue_pending(const char *path, int user_id)
+{
+    pthread_mutex_lock(&queue_lock);
+    int returner = _find(path, user_id) != NULL;
+    pthread_mutex_unlock(&queue_lock);
+    return returner;
+}
+
+
+/* Same as above but by cache path, for eviction */
+int upload_queue_busy(const char *cache_path)
+{
+    pthread_mutex_lock(&queue_lock);
+    upload_entry_t *e = head;
+    while (e && strcmp(e->cache_path, cache_path) != 0)
+        e = e->next;
+    pthread_mutex_unlock(&queue_lock);
+    return e != NULL;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fuse_utils.h"
+#include "open_file.h"
+#include "debug.h"
+
+#define UPLOAD_WORKERS_DEFAULT 2
+#define UPLOAD_BACKOFF_MAX 30   // seconds between retries of a failing upload
+#define UPLOAD_WAIT_ATTEMPTS 3  // failed tries a waiter sits through
+#define UPLOAD_DEBOUNCE_MS_DEFAULT 500      // quiet time after the last save before uploading
+#define UPLOAD_DEFER_MAX_MS_DEFAULT 10000   // a file saved nonstop still goes out this often
+
+
+/* One dirty cache file waiting to go back to the server.
+ * At most one entry per path, pushing again while in flight sets redo
+ * and aborts the upload, unless the file has been dirty for too long.
+ * Times are in milliseconds.
+ */
+typedef struct upload_entry {
+    char *path;             // logical path
+    char *cache_path;
+    int user_id;
+    int dirty_all;          // resend everything
+    uint8_t *dirty;         // else only these chunks (plus what the server lacks)
+    uint32_t n_dirty;       // chunks dirty has room for
+    int in_flight;
+    int redo;               // dirtied again while in flight
+    int abort;              // superseded, tells the upload in flight to stop
+    int cancelled;
+    int attempts;           // consecutive failures
+    int last_rc;
+    int64_t next_try;       // backoff after a failure
+    int64_t not_before;     // debounce, pushed back by every save
+    int64_t first_dirty;    // oldest change not on the server yet
+    struct upload_entry *next, *prev;
+} upload_entry_t;
+
+
+void upload_queue_init(void);
+void upload_queue_exit(void);
+
+int upload_queue_push(const char *path, int user_id, const dirty_set_t *dirty);
+int upload_queue_wait(const char *path, int user_id);
+void upload_queue_cancel(const char *path, int user_id);
+int upload_queue_pending(const char *path, int user_id);
+int upload_queue_busy(const char *cache_path);
@@ -6,6 +6,10 @@ CREATE TABLE IF NOT EXISTS users (
 
 
 
+-- Content generations, a node takes a new one whenever its bytes change.
+-- Drawn from one sequence so a recreated path never repeats an old value.
+CREATE SEQUENCE IF NOT EXISTS node_generation_seq;
+
 -- Nodes for files & folders
 CREATE TABLE IF NOT EXISTS nodes (
   id         SERIAL PRIMARY KEY,
@@ -18,8 +22,12 @@ CREATE TABLE IF NOT EXISTS nodes (
   i_atime    BIGINT,
   i_mtime    BIGINT NOT NULL DEFAULT 0,
   i_ctime    BIGINT,
-  i_crtime   BIGINT
+  i_crtime   BIGINT,
+  chunking   SMALLINT NOT NULL DEFAULT 0,  -- 0=fixed CHUNK_SIZE, 1=content-defined
+  generation BIGINT NOT NULL DEFAULT nextval('node_generation_seq')
 );
+ALTER TABLE nodes ADD COLUMN IF NOT EXISTS chunking SMALLINT NOT NULL DEFAULT 0;
+ALTER TABLE nodes ADD COLUMN IF NOT EXISTS generation BIGINT NOT NULL DEFAULT nextval('node_generation_seq');
 
 -- Enfore unique names per directory, user
 -- DEFERRABLE INITIALLY IMMEDIATE for swaps
@@ -56,8 +64,36 @@ CREATE TABLE IF NOT EXISTS file_chunks (
   chunk_index INT    NOT NULL,
   chunk_size  INT,
   message_id  BIGINT, 
+  hash        TEXT,  -- content fingerprint, set for content-defined chunks
+  codec       SMALLINT NOT NULL DEFAULT 0,  -- 0=raw, 1=zstd
+  stored_size INT,   -- bytes in the message, chunk_size is what they decode to
+  hole        BOOLEAN NOT NULL DEFAULT FALSE,  -- all zeros, no message
+  crc32c      BIGINT,  -- CRC-32C of the decoded bytes, NULL if unknown
   PRIMARY KEY (node_id, chunk_index)
 );
+ALTER TABLE file_chunks ADD COLUMN IF NOT EXISTS hash TEXT;
+ALTER TABLE file_chunks ADD COLUMN IF NOT EXISTS codec SMALLINT NOT NULL DEFAULT 0;
+ALTER TABLE file_chunks ADD COLUMN IF NOT EXISTS stored_size INT;
+ALTER TABLE file_chunks ADD COLUMN IF NOT EXISTS hole BOOLEAN NOT NULL DEFAULT FALSE;
+ALTER TABLE file_chunks ADD COLUMN IF NOT EXISTS crc32c BIGINT;
+
+
+-- Content-addressed chunk store, one Discord message per distinct chunk of a user.
+-- file_chunks rows pointing at message_id hold one reference each.
+-- Chunks uploaded before this table existed have no entry, their single row owns them.
+CREATE TABLE IF NOT EXISTS chunk_blobs (
+  message_id  BIGINT PRIMARY KEY,
+  user_id     INT    NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+  hash        TEXT   NOT NULL,  -- sha256 hex
+  chunk_size  INT    NOT NULL,
+  refcount    INT    NOT NULL DEFAULT 0,
+  codec       SMALLINT NOT NULL DEFAULT 0,
+  stored_size INT,
+  crc32c      BIGINT
+);
+ALTER TABLE chunk_blobs ADD COLUMN IF NOT EXISTS codec SMALLINT NOT NULL DEFAULT 0;
+ALTER TABLE chunk_blobs ADD COLUMN IF NOT EXISTS stored_size INT;
+ALTER TABLE chunk_blobs ADD COLUMN IF NOT EXISTS crc32c BIGINT;
 
 
 -- Indexes for queries
@@ -76,3 +112,6 @@ CREATE INDEX IF NOT EXISTS idx_cl_anc
 
 CREATE INDEX IF NOT EXISTS idx_chunks_node
   ON file_chunks (node_id);
+
+CREATE UNIQUE INDEX IF NOT EXISTS idx_blobs_hash
+  ON chunk_blobs (user_id, hash);
@@ -12,7 +12,33 @@ NOTIFICATIONS_ID = 1385864919085219860
 
 FILE_CHUNK_TIMEOUT = 10
 
-rate_limited_paths = ["/upload", "/download", "/prep_upload", "/truncate", "/unlink", "/dog_gif"]
+# Seconds a reader waits for a chunk of a file that is still being uploaded
+CHUNK_WAIT_TIMEOUT = int(os.getenv("CHUNK_WAIT_TIMEOUT", "60"))
+
+# Must match CHUNK_SIZE in fuse/fuse_utils.h
+CHUNK_SIZE = 10 * 1024 * 1024 - 256
+
+# Per-chunk codecs the client may upload with, values of file_chunks.codec
+CHUNK_CODECS = {"zstd": 1}
+
+# Discord fetches /download keeps in flight ahead of the chunk being streamed
+DOWNLOAD_LOOKAHEAD = int(os.getenv("DOWNLOAD_LOOKAHEAD", "3"))
+
+# Seconds a lease lasts unless renewed
+LEASE_TTL = int(os.getenv("LEASE_TTL", "30"))
+
+# Longest a /changes long-poll is held open, and changes kept per user for
+# clients that fall behind
+CHANGES_WAIT_MAX = 25
+CHANGE_LOG_MAX = 4096
+
+# Ops one /batch request may carry
+BATCH_OPS_MAX = 1024
+
+# Times /truncate plans its chunk cuts again when the file changed under them
+TRUNCATE_ATTEMPTS = 3
+
+rate_limited_paths = ["/upload", "/download", "/download_chunk", "/prep_upload", "/have_chunks", "/clone", "/replace", "/truncate", "/unlink", "/dog_gif"]
 
 
 RATE_LIMIT_REQUESTS = int(os.getenv("RATE_LIMIT_REQUESTS", "100"))
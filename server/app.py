@@ -1,15 +1,18 @@
 import asyncio
 import time
 import os
-from collections import defaultdict
+from collections import defaultdict, deque
+from functools import lru_cache
 from quart import Quart, request, jsonify, Response
-from server._config import DATABASE_URL, TOKEN, NOTIFICATIONS_ID, DATABASE_URL, VAULT_IDS, FILE_CHUNK_TIMEOUT, RATE_LIMIT_WINDOW, RATE_LIMIT_REQUESTS, rate_limited_paths
+from server._config import DATABASE_URL, TOKEN, NOTIFICATIONS_ID, DATABASE_URL, VAULT_IDS, FILE_CHUNK_TIMEOUT, CHUNK_WAIT_TIMEOUT, CHUNK_SIZE, CHUNK_CODECS, RATE_LIMIT_WINDOW, RATE_LIMIT_REQUESTS, DOWNLOAD_LOOKAHEAD, LEASE_TTL, CHANGES_WAIT_MAX, CHANGE_LOG_MAX, BATCH_OPS_MAX, TRUNCATE_ATTEMPTS, rate_limited_paths
 from server.discord_api import get_client, delete_messages
 import asyncpg
 import tempfile
+import zstandard
+from crc32c import crc32c
 from asyncpg.exceptions import UniqueViolationError
 
-from server.app_utils import validate_user, dispatch_upload, admin_console, create_closure, resolve_node, split_parent_and_name, node_info, is_descendant, get_parent_id, rewire_closure_for_move
+from server.app_utils import validate_user, dispatch_upload, rewrite_chunk, store_blob, acquire_blobs, release_blobs, adopt_blobs, admin_console, create_closure, resolve_node, split_parent_and_name, node_info, is_descendant, get_parent_id, rewire_closure_for_move
 
 
 import sys
@@ -88,6 +91,25 @@ async def rate_limit_middleware():
         return resp
 
 
+@app.after_request
+async def change_feed_middleware(response):
+    """Publishes what a successful mutation touched to the user's change feed"""
+    route = CHANGE_ROUTES.get(request.path)
+    if route is None or response.status_code not in (200, 201):
+        return response
+    try:
+        user_id = int(request.args.get("user_id", ""))
+    except ValueError:
+        return response
+
+    args, tree = route
+    for arg in args:
+        path = request.args.get(arg)
+        if path:
+            note_change(user_id, path, tree)
+    return response
+
+
 
 
 
@@ -181,21 +203,147 @@ async def login():
     return f"{row['id']}:{username}\n", 201, {"Content-Type": "text/plain"}
 
 
-# Track upload completion: {node_id: (end_chunk_index, event)}
+def drop_messages(message_ids):
+    """Deletes chunk messages in the background, callers have released them already"""
+    if message_ids:
+        channel = discord_client.get_channel(discord_client.channel_id)
+        asyncio.create_task(delete_messages(channel, list(message_ids)))
+
+
+# Track upload completion: {node_id: (chunk indices still missing, event)}
+# Chunks arrive in any order, the file is ready once the set runs empty.
 # Keeps an asyncio.Event to avoid busy waiting
-upload_tracking: dict[int, tuple[int, asyncio.Event]] = {}
+upload_tracking: dict[int, tuple[set[int], asyncio.Event]] = {}
+
+# Client that started each node's latest upload: {node_id: client}
+upload_clients: dict[int, str] = {}
+
+# Pulsed whenever chunks of a node commit, so readers of a file still being
+# uploaded can go ahead with the chunks already stored: {node_id: event}
+chunk_events: dict[int, asyncio.Event] = {}
+
+
+def notify_chunks(node_id: int):
+    """Wakes readers waiting on chunks of node_id, they recheck what's pending"""
+    event = chunk_events.pop(node_id, None)
+    if event:
+        event.set()
+
+
+async def wait_chunk(node_id: int, index: int, timeout: float = CHUNK_WAIT_TIMEOUT) -> bool:
+    """True once chunk index of node_id is stored (or no upload covers it), False on timeout"""
+    loop = asyncio.get_running_loop()
+    deadline = loop.time() + timeout
+    while node_id in upload_tracking and index in upload_tracking[node_id][0]:
+        left = deadline - loop.time()
+        if left <= 0:
+            return False
+        event = chunk_events.setdefault(node_id, asyncio.Event())
+        try:
+            await asyncio.wait_for(event.wait(), timeout=left)
+        except asyncio.TimeoutError:
+            return False
+    return True
+
+
+def supersede_upload(node_id: int):
+    """The file's content was replaced server side, whatever was pending is moot"""
+    if node_id in upload_tracking:
+        pending, event = upload_tracking[node_id]
+        pending.clear()
+        event.set()
+    notify_chunks(node_id)
+
+
+# Change feed, every successful mutation is logged per user as
+# (seq, path, tree, client). seq only grows, BOOT_ID changes with every
+# restart so clients notice the numbering started over. Clients are told
+# apart by their User-Agent.
+BOOT_ID = os.urandom(8).hex()
+change_logs: dict[int, deque] = defaultdict(lambda: deque(maxlen=CHANGE_LOG_MAX))
+change_seq: dict[int, int] = defaultdict(int)
+change_events: dict[int, asyncio.Event] = {}
+
+# Routes that change the tree: query args naming the touched paths, and
+# whether everything below them changed too
+CHANGE_ROUTES = {
+    "/prep_upload": (("path",), False),
+    "/mkdir": (("path",), False),
+    "/create": (("path",), False),
+    "/truncate": (("path",), False),
+    "/unlink": (("path",), False),
+    "/modi_mtime": (("path",), False),
+    "/clone": (("dst",), False),
+    "/replace": (("a", "b"), False),
+    "/rmdir": (("path",), True),
+    "/rename": (("a", "b"), True),
+    "/rename_move": (("a", "b"), True),
+    "/swap": (("a", "b"), True),
+}
+
+# Leases by user: {lease id: (client, path, subtree, mode, expires)}.
+# A holder trusts its cache of the path while the lease lasts and it
+# follows /changes. Write leases exclude every other client's lease.
+leases: dict[int, dict[str, tuple]] = defaultdict(dict)
+
+
+def request_client() -> str:
+    return request.headers.get("User-Agent", "")
+
+
+def note_change(user_id: int, path: str, tree: bool):
+    change_seq[user_id] += 1
+    change_logs[user_id].append((change_seq[user_id], "/" + path.strip("/"), tree, request_client()))
+    event = change_events.pop(user_id, None)
+    if event:
+        event.set()
+
+
+def lease_overlaps(a: str, a_tree: bool, b: str, b_tree: bool) -> bool:
+    if a == b:
+        return True
+    if a_tree and (a == "/" or b.startswith(a + "/")):
+        return True
+    return b_tree and (b == "/" or a.startswith(b + "/"))
+
+
+def lease_conflict(user_id: int, client: str, path: str, subtree: bool, mode: str) -> float:
+    """Seconds until the leases of other clients in the way run out, 0 if none"""
+    now = time.monotonic()
+    wait = 0.0
+    held = leases[user_id]
+    for lid, (holder, l_path, l_tree, l_mode, expires) in list(held.items()):
+        if expires <= now:
+            del held[lid]
+            continue
+        if holder == client or not lease_overlaps(path, subtree, l_path, l_tree):
+            continue
+        if mode == "write" or l_mode == "write":
+            wait = max(wait, expires - now)
+    return wait
+
 
 @app.route("/prep_upload", methods=["POST"])
 async def prep_upload():
     """
     Called by do_release to prepare for upload.
     POST /prep_upload?user_id=22&path=foo/bar.txt&size=1048576&end_chunk=2&mtime=123
+
+    With partial=1 the body is {"dirty": [chunk indices]}. Chunks that are
+    not dirty and already stored at the right size are kept, the response
+    {"send": [...]} lists the chunks the client has to upload.
+
+    With chunker=cdc the body is {"chunks": [{"size": n, "hash": h}, ...]},
+    the new content-defined layout. Stored chunks of the file with the same
+    hash and size are reused under their new index, answered like partial=1.
     """
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
     size = request.args.get("size", "0")
     end_chunk = request.args.get("end_chunk", "0")
     true_mtime = request.args.get("mtime", "0");
+    partial = request.args.get("partial") == "1"
+    cdc = request.args.get("chunker") == "cdc"
     
     if not raw_path:
         return "Missing path", 400
@@ -207,6 +355,23 @@ async def prep_upload():
     except ValueError:
         return "Invalid size or end_chunk", 400
 
+    dirty = set()
+    layout = []
+    if partial:
+        body = await request.get_json(silent=True) or {}
+        try:
+            dirty = {int(i) for i in body.get("dirty", [])}
+        except (TypeError, ValueError):
+            return "Invalid dirty list", 400
+    elif cdc:
+        body = await request.get_json(silent=True) or {}
+        try:
+            layout = [(int(c["size"]), str(c["hash"])) for c in body.get("chunks", [])]
+        except (TypeError, ValueError, KeyError):
+            return "Invalid chunk list", 400
+        if sum(sz for sz, _ in layout) != size or any(sz <= 0 or sz > CHUNK_SIZE for sz, _ in layout):
+            return "Chunk list doesn't add up to size", 400
+
     async with POOL.acquire() as conn, conn.transaction():
         node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
         if not node_id:
@@ -215,48 +380,217 @@ async def prep_upload():
 
        # Overwrite on-going uploads of same file and delete stale chunks
        # Current reader's will timeout
-        if node_id in upload_tracking:
-            old_end_chunk, old_event = upload_tracking[node_id]
-            
+        if node_id in upload_tracking and upload_tracking[node_id][0]:
             print(f"Interrupting ongoing upload for node_id={node_id}"
-                  f"(old end_chunk={old_end_chunk}, new end_chunk={end_chunk})")
-            
-            old_chunks = await conn.fetch("SELECT message_id FROM file_chunks WHERE node_id=$1",node_id)
-            
-            await conn.execute("DELETE FROM file_chunks WHERE node_id=$1", node_id)
-            message_ids = [r["message_id"] for r in old_chunks if r["message_id"] is not None]
-            channel = discord_client.get_channel(discord_client.channel_id)
-            delete_messages(channel, message_ids)
-            
-        
+                  f"({len(upload_tracking[node_id][0])} chunks left, new end_chunk={end_chunk})")
+
+        last_chunk = end_chunk if size > 0 else -1
+        chunking = await conn.fetchval("SELECT chunking FROM nodes WHERE id=$1", node_id)
+        if cdc:
+            last_chunk = len(layout) - 1
+            old_chunks = await conn.fetch(
+                """
+                DELETE FROM file_chunks WHERE node_id=$1
+                RETURNING chunk_size, message_id, hash, codec, stored_size, crc32c
+                """,
+                node_id
+            )
+            by_hash = {(r["hash"], r["chunk_size"]): r
+                       for r in old_chunks if r["hash"] and r["message_id"] is not None}
+
+            # Chunks still waiting for their bytes get a row without message,
+            # so the layout is complete from the start
+            pending = set()
+            rows = []
+            for i, (sz, h) in enumerate(layout):
+                old = by_hash.get((h, sz))
+                if old is None:
+                    pending.add(i)
+                    rows.append((node_id, i, sz, None, h, 0, None, None))
+                else:
+                    rows.append((node_id, i, sz, old["message_id"], h, old["codec"],
+                                 old["stored_size"], old["crc32c"]))
+            await conn.executemany(
+                """
+                INSERT INTO file_chunks(node_id, chunk_index, chunk_size, message_id, hash,
+                                        codec, stored_size, crc32c)
+                VALUES($1,$2,$3,$4,$5,$6,$7,$8)
+                """,
+                rows
+            )
+            await acquire_blobs(conn, [r[3] for r in rows])
+        elif partial and chunking == 0:
+            # Keep chunks below the new end, drop the ones past it
+            old_chunks = await conn.fetch(
+                "DELETE FROM file_chunks WHERE node_id=$1 AND chunk_index>$2 RETURNING message_id",
+                node_id, last_chunk
+            )
+            kept = await conn.fetch(
+                "SELECT chunk_index, chunk_size FROM file_chunks WHERE node_id=$1", node_id
+            )
+            stored = {r["chunk_index"]: r["chunk_size"] for r in kept}
+
+            # Missing rows, or a previous last chunk that now has to grow/shrink
+            pending = set()
+            for i in range(last_chunk + 1):
+                want = CHUNK_SIZE if i < last_chunk else size - last_chunk * CHUNK_SIZE
+                if i in dirty or stored.get(i) != want:
+                    pending.add(i)
+            await conn.execute(
+                "UPDATE file_chunks SET hash=NULL, crc32c=NULL WHERE node_id=$1 AND chunk_index = ANY($2::int[])",
+                node_id, list(pending)
+            )
+        else:
+            # Whole file is resent, old chunks would otherwise survive past a shrink.
+            # Also taken by partial uploads over content-defined chunks, whose
+            # offsets don't line up with CHUNK_SIZE
+            old_chunks = await conn.fetch(
+                "DELETE FROM file_chunks WHERE node_id=$1 RETURNING message_id", node_id
+            )
+            # Nothing to wait for on empty files
+            pending = set(range(last_chunk + 1))
+
+        doomed = await release_blobs(conn, [r["message_id"] for r in old_chunks])
+
+        # Untracked messages may still back another chunk of this layout
+        still_used = {r["message_id"] for r in await conn.fetch(
+            "SELECT message_id FROM file_chunks WHERE node_id=$1 AND message_id IS NOT NULL", node_id)}
+        drop_messages([m for m in doomed if m not in still_used])
+
         # Set size and mark as not ready
         await conn.execute(
             """
             UPDATE nodes 
             SET size = $1, 
-                ready = FALSE,
-                i_mtime = $2
-            WHERE id = $3
+                ready = $2,
+                i_mtime = $3,
+                chunking = $4,
+                generation = nextval('node_generation_seq')
+            WHERE id = $5
             """,
-            size, true_mtime, node_id
+            size, not pending, true_mtime, 1 if cdc else 0, node_id
         )
         
 
         if node_id not in upload_tracking:
-            upload_tracking[node_id] = (end_chunk, asyncio.Event())
+            upload_tracking[node_id] = (pending, asyncio.Event())
         else:
             old_event = upload_tracking[node_id][1]
             old_event.clear()
-            upload_tracking[node_id] = (end_chunk, old_event)
-    
+            upload_tracking[node_id] = (pending, old_event)
+        if not pending:
+            upload_tracking[node_id][1].set()
+        upload_clients[node_id] = request_client()
+        notify_chunks(node_id)  # chunks left out of the new pending set are final
+
+    if partial or cdc:
+        return jsonify({"send": sorted(pending)}), 201
     return "", 201
 
 
+async def chunks_committed(conn, node_id: int, indices):
+    """
+    Marks chunks of an upload as stored, readers blocked on them go ahead.
+    The file turns ready with the last one.
+    """
+    if node_id not in upload_tracking:
+        return
+    pending, event = upload_tracking[node_id]
+    if not pending:
+        return
+    pending.difference_update(indices)
+    notify_chunks(node_id)
+    if not pending:
+        await conn.execute("UPDATE nodes SET ready = TRUE WHERE id = $1", node_id)
+        event.set()  # set the asyncio.Event
+
+
+@app.route("/have_chunks", methods=["POST"])
+async def have_chunks():
+    """
+    Dedup handshake before an upload sends any bytes.
+    POST /have_chunks?user_id=22&path=foo/bar.txt
+    body {"chunks": [{"index": 3, "size": 1234, "hash": "<sha256>"},
+                     {"index": 4, "size": 1234, "hole": true}, ...]}
+
+    Chunks the user's chunk store already holds are linked into the file
+    right away, all-zero chunks are recorded as holes without a message.
+    {"linked": [indices]} tells the client not to send either.
+    """
+    user_id = await validate_user(POOL)
+    raw_path = request.args.get("path", "").lstrip("/")
+    if not raw_path:
+        return "Missing path", 400
+
+    body = await request.get_json(silent=True) or {}
+    try:
+        offers = [(int(c["index"]), int(c["size"]), None if c.get("hole") else str(c["hash"]))
+                  for c in body.get("chunks", [])]
+    except (TypeError, ValueError, KeyError, AttributeError):
+        return "Invalid chunk list", 400
+    if any(index < 0 or size <= 0 or size > CHUNK_SIZE for index, size, _ in offers):
+        return "Invalid chunk list", 400
+
+    linked = []
+    doomed = []
+    async with POOL.acquire() as conn, conn.transaction():
+        node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+        if not node_id:
+            return "File not found", 520
+
+        for index, size, chunk_hash in offers:
+            if chunk_hash is None:
+                blob = {"message_id": None, "codec": 0, "stored_size": 0, "crc32c": None}
+            else:
+                blob = await conn.fetchrow(
+                    """
+                    UPDATE chunk_blobs SET refcount = refcount + 1
+                    WHERE user_id=$1 AND hash=$2 AND chunk_size=$3
+                    RETURNING message_id, codec, stored_size, crc32c
+                    """,
+                    user_id, chunk_hash, size
+                )
+                if blob is None:
+                    continue
+
+            old_id = await conn.fetchval(
+                "SELECT message_id FROM file_chunks WHERE node_id=$1 AND chunk_index=$2 FOR UPDATE",
+                node_id, index
+            )
+            await conn.execute(
+                """
+                INSERT INTO file_chunks(node_id, chunk_index, chunk_size, message_id, hash,
+                                        codec, stored_size, hole, crc32c)
+                VALUES($1,$2,$3,$4,$5,$6,$7,$8,$9)
+                ON CONFLICT (node_id, chunk_index)
+                DO UPDATE SET chunk_size = EXCLUDED.chunk_size, message_id = EXCLUDED.message_id,
+                              hash = EXCLUDED.hash, codec = EXCLUDED.codec,
+                              stored_size = EXCLUDED.stored_size, hole = EXCLUDED.hole,
+                              crc32c = EXCLUDED.crc32c
+                """,
+                node_id, index, size, blob["message_id"], chunk_hash, blob["codec"], blob["stored_size"],
+                chunk_hash is None, blob["crc32c"]
+            )
+            if old_id is not None:
+                doomed += await release_blobs(conn, [old_id])
+            linked.append(index)
+
+        await chunks_committed(conn, node_id, linked)
+
+    drop_messages(doomed)
+    return jsonify({"linked": linked}), 201
+
+
 @app.route("/upload", methods=["POST"])
 async def upload():
     """
     POST /upload?user_id=22&path=foo/bar.txt&chunk=0
     form-file field 'file'
+
+    With codec=zstd&raw=<bytes> the body is the chunk compressed,
+    raw is its decoded size.
+    crc=<CRC-32C of the decoded bytes> is checked before anything is stored,
+    422 if the bytes got mangled on the way.
     """
     user_id = await validate_user(POOL)
 
@@ -268,38 +602,58 @@ async def upload():
         chunk = int(request.args.get("chunk"))
     except ValueError:
         return "Invalid chunk index", 400
+    chunk_hash = request.args.get("hash") or None
+    codec_name = request.args.get("codec")
+    codec = CHUNK_CODECS.get(codec_name, 0) if codec_name else 0
+    if codec_name and not codec:
+        return "Unknown codec", 400
     
     data = await request.get_data()
     if not data:
         return "No data", 400
+    if codec:
+        try:
+            raw_size = int(request.args.get("raw", ""))
+        except ValueError:
+            return "Missing raw size", 400
+        if raw_size <= 0 or raw_size > CHUNK_SIZE:
+            return "Invalid raw size", 400
+    try:
+        want_crc = int(request.args["crc"]) if "crc" in request.args else None
+    except ValueError:
+        return "Invalid crc", 400
+
+    try:
+        raw = zstandard.ZstdDecompressor().decompress(data, max_output_size=raw_size) if codec else data
+    except zstandard.ZstdError:
+        return "Corrupt chunk", 422
+    chunk_crc = crc32c(raw)
+    if (codec and len(raw) != raw_size) or (want_crc is not None and want_crc != chunk_crc):
+        return "Checksum mismatch", 422
 
     tmp = tempfile.NamedTemporaryFile(delete=False)
     tmp.write(data)
     tmp.flush()
     tmp.close()
 
-    chunk_size = os.path.getsize(tmp.name)
+    chunk_size = raw_size if codec else os.path.getsize(tmp.name)
 
     try:
         await dispatch_upload(
             POOL, discord_client,
             user_id, file_path,
             chunk, chunk_size,
-            tmp.name
+            tmp.name, chunk_hash, codec, chunk_crc
         )
 
-         # Check if this is the end chunk
+         # Ready once the last missing chunk lands, whatever its index
         async with POOL.acquire() as conn:
             node_id = await resolve_node(conn, user_id, file_path, expected_type=1)
             if not node_id:
                 return "File not found", 520
             
 
-            if node_id in upload_tracking:
-                end_chunk, event = upload_tracking[node_id]
-                if chunk == end_chunk:
-                    await conn.execute("UPDATE nodes SET ready = TRUE WHERE id = $1", node_id)
-                    event.set()  # set the asyncio.Event
+            await chunks_committed(conn, node_id, [chunk])
 
     except Exception:
         app.logger.exception("dispatch_upload failed")
@@ -311,6 +665,12 @@ async def upload():
 
 @app.route("/stat", methods=["GET"])
 async def stat():
+    """
+    GET /stat?user_id=22&path=foo/bar.txt
+
+    Files carry "gen", their content generation, also sent as ETag.
+    With If-None-Match: "<gen>" an unchanged file answers 304 without a body.
+    """
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
     if raw_path == "":
@@ -327,10 +687,14 @@ async def stat():
         node_row = await conn.fetchrow(
             """
             SELECT type, i_atime, i_mtime, i_ctime, i_crtime, 
-                   size, ready
+                   size, ready, chunking, generation
             FROM nodes WHERE id=$1
             """, node_id)
 
+        etag = f'"{node_row["generation"]}"'
+        if node_row["type"] == 1 and request.headers.get("If-None-Match") == etag:
+            return "", 304, {"ETag": etag}
+
         result = {
             "type": node_row["type"],
             "atime": node_row["i_atime"],
@@ -342,6 +706,9 @@ async def stat():
         if node_row["type"] == 1:
             result["size"] = node_row["size"]
             result["ready"] = node_row["ready"]
+            result["chunking"] = node_row["chunking"]
+            result["gen"] = node_row["generation"]
+            return jsonify(result), 201, {"ETag": etag}
 
     return jsonify(result), 201
 
@@ -380,6 +747,9 @@ async def mtime():
 async def listdir():
     """
     GET /listdir?user_id=22&path=foo/
+
+    Entries carry what /stat would say about them, so the client can answer
+    readdirplus without a lookup per entry.
     """
     user_id = await validate_user(POOL)
     dir_path = request.args.get("path", "/")
@@ -409,7 +779,7 @@ async def listdir():
 
         rows = await conn.fetch(
             """
-            SELECT name, type, i_mtime
+            SELECT name, type, size, i_atime, i_mtime, i_ctime, i_crtime
               FROM nodes
              WHERE user_id=$1
                AND parent_id=$2
@@ -420,7 +790,16 @@ async def listdir():
 
     result = []
     for r in rows:
-        entry = {"name": r["name"], "type": r["type"], "mtime": r["i_mtime"]}
+        entry = {
+            "name": r["name"],
+            "type": r["type"],
+            "atime": r["i_atime"],
+            "mtime": r["i_mtime"],
+            "ctime": r["i_ctime"],
+            "crtime": r["i_crtime"]
+        }
+        if r["type"] == 1:
+            entry["size"] = r["size"]
         result.append(entry)
 
     return jsonify(result), 201
@@ -431,8 +810,16 @@ async def mkdir():
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
 
+    async with POOL.acquire() as conn, conn.transaction():
+        status = await apply_mkdir(conn, user_id, raw_path)
+    return "", status
+
+
+async def apply_mkdir(conn, user_id: int, raw_path: str) -> int:
+    """Body of /mkdir, also run by /batch. Returns the route's status"""
+    raw_path = raw_path.lstrip("/")
     if raw_path == "":
-        return "", 404
+        return 404
     
 
     parts = raw_path.split("/")
@@ -441,48 +828,46 @@ async def mkdir():
 
 
     now = int(time.time())
-    async with POOL.acquire() as conn, conn.transaction():
-        if parent_raw == "":
-            # empty path = root folder
+    if parent_raw == "":
+        # empty path = root folder
+        parent_id = await conn.fetchval(
+            "SELECT id FROM nodes WHERE user_id=$1 AND parent_id IS NULL",
+            user_id
+        )
+        if parent_id is None:
             parent_id = await conn.fetchval(
-                "SELECT id FROM nodes WHERE user_id=$1 AND parent_id IS NULL",
-                user_id
+                """
+                INSERT INTO nodes(user_id, name, parent_id, type,
+                                  i_atime, i_mtime, i_ctime, i_crtime)
+                VALUES ($1, '', NULL, 2, $2, $2, $2, $2)
+                RETURNING id
+                """,
+                user_id, now
             )
-            if parent_id is None:
-                parent_id = await conn.fetchval(
-                    """
-                    INSERT INTO nodes(user_id, name, parent_id, type,
-                                      i_atime, i_mtime, i_ctime, i_crtime)
-                    VALUES ($1, '', NULL, 2, $2, $2, $2, $2)
-                    RETURNING id
-                    """,
-                    user_id, now
-                )
-                await create_closure(conn, parent_id, None)
-        else:
-          parent_id = await resolve_node(conn, user_id, parent_raw, expected_type=2)
-
-        if parent_id is None:
-            return "", 404
-
-        exists = await conn.fetchval(
-            "SELECT 1 FROM nodes WHERE user_id=$1 AND parent_id=$2 AND name=$3 AND type=2",
-            user_id, parent_id, filename)
-        if exists:
-            return "", 201
-
-        node_id = await conn.fetchval(
-            """
-            INSERT INTO nodes(user_id, name, parent_id, type,
-                              i_atime, i_mtime, i_ctime, i_crtime)
-            VALUES ($1,$2,$3, 2, $4,$4,$4,$4)
-            RETURNING id
-            """,
-            user_id, filename, parent_id, now
-        )
-        await create_closure(conn, node_id, parent_id)
-
-    return "", 201
+            await create_closure(conn, parent_id, None)
+    else:
+      parent_id = await resolve_node(conn, user_id, parent_raw, expected_type=2)
+
+    if parent_id is None:
+        return 404
+
+    exists = await conn.fetchval(
+        "SELECT 1 FROM nodes WHERE user_id=$1 AND parent_id=$2 AND name=$3 AND type=2",
+        user_id, parent_id, filename)
+    if exists:
+        return 201
+
+    node_id = await conn.fetchval(
+        """
+        INSERT INTO nodes(user_id, name, parent_id, type,
+                          i_atime, i_mtime, i_ctime, i_crtime)
+        VALUES ($1,$2,$3, 2, $4,$4,$4,$4)
+        RETURNING id
+        """,
+        user_id, filename, parent_id, now
+    )
+    await create_closure(conn, node_id, parent_id)
+    return 201
 
 @app.route("/wait_ready", methods=["GET"])
 async def wait_ready():
@@ -520,6 +905,15 @@ async def wait_ready():
 
 @app.route("/download", methods=["GET"])
 async def download():
+    """
+    Whole file in one stream.
+    GET /download?user_id=22&path=foo/bar.txt
+
+    A file still being uploaded streams as far as its chunks are stored,
+    then waits for each missing one as it's reached.
+    The content generation comes back as ETag, If-None-Match with the one
+    the client holds answers 304 instead of the bytes.
+    """
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
     if not raw_path:
@@ -527,27 +921,171 @@ async def download():
 
     async with POOL.acquire() as conn:
         node_id = await resolve_node(conn, user_id, raw_path, 1)
+        if not node_id:
+            return "File not found", 520
+        node = await conn.fetchrow("SELECT size, chunking, generation FROM nodes WHERE id=$1", node_id)
+        etag = f'"{node["generation"]}"'
+        if request.headers.get("If-None-Match") == etag:
+            return "", 304, {"ETag": etag}
 
-        # Get chunks in order
+        # Rows of chunks pending now may be stale (or missing), those are reread
+        pending_at_start = set(upload_tracking.get(node_id, (set(), None))[0])
         rows = await conn.fetch(
             """
-            SELECT chunk_index, message_id
+            SELECT chunk_index, chunk_size, message_id, codec, hole, crc32c
             FROM file_chunks
             WHERE node_id=$1
             ORDER BY chunk_index
             """,
             node_id
         )
-        if not rows:
-            return "no chunks", 500
+
+    # Content-defined layouts have a row per chunk from the start,
+    # fixed ones may not have the rows of chunks still pending yet
+    n_chunks = len(rows) if node["chunking"] else (node["size"] + CHUNK_SIZE - 1) // CHUNK_SIZE
+    if n_chunks == 0:
+        return "no chunks", 500
+    known = {r["chunk_index"]: r for r in rows}
+
+    async def fetch_chunk(index):
+        if not await wait_chunk(node_id, index):
+            raise TimeoutError(f"chunk {index} of node {node_id} never arrived")
+        row = None if index in pending_at_start else known.get(index)
+        if row is None:
+            async with POOL.acquire() as conn:
+                row = await conn.fetchrow(
+                    """
+                    SELECT chunk_size, message_id, codec, hole, crc32c FROM file_chunks
+                    WHERE node_id=$1 AND chunk_index=$2
+                    """,
+                    node_id, index
+                )
+            if row is None or (row["message_id"] is None and not row["hole"]):
+                raise RuntimeError(f"chunk {index} of node {node_id} is missing")
+        if row["hole"]:
+            return bytes(row["chunk_size"])
+        data = await discord_client.download_attachment(row["message_id"])
+        if row["codec"]:
+            # Whole-file readers don't speak codecs, hand them plain bytes
+            data = zstandard.ZstdDecompressor().decompress(
+                data, max_output_size=row["chunk_size"])
+        # Cutting the stream short beats handing out bytes Discord mangled
+        if row["crc32c"] is not None and crc32c(data) != row["crc32c"]:
+            raise RuntimeError(f"chunk {index} of node {node_id} fails its checksum")
+        return data
 
     async def streamer():
-        for r in rows:
-            chunk = await discord_client.download_attachment(r["message_id"])
-            yield chunk
+        # Keep a few chunk fetches in flight ahead of the chunk being sent
+        tasks = []
+        try:
+            for i in range(n_chunks):
+                while len(tasks) < n_chunks and len(tasks) <= i + DOWNLOAD_LOOKAHEAD:
+                    tasks.append(asyncio.create_task(fetch_chunk(len(tasks))))
+                yield await tasks[i]
+        finally:
+            for t in tasks:
+                t.cancel()
 
     # stream the file over in waves of chunks
-    return Response(streamer(), status=201, mimetype="application/octet-stream")
+    return Response(streamer(), status=201, mimetype="application/octet-stream",
+                    headers={"ETag": etag})
+
+
+@app.route("/download_chunk", methods=["GET"])
+async def download_chunk():
+    """
+    Single chunk of a file, lets the client fetch lazily on read.
+    GET /download_chunk?user_id=22&path=foo/bar.txt&chunk=3
+
+    Compressed chunks are sent as stored, X-Chunk-Codec names the codec.
+    Holes come back empty with X-Chunk-Codec: hole, the client fills in zeros.
+    X-Chunk-Crc32c carries the CRC-32C of the decoded bytes when it is known.
+    A chunk an upload in progress hasn't stored yet is waited for, 408 if
+    it doesn't show up within CHUNK_WAIT_TIMEOUT. The client running that
+    upload gets the chunk as stored right away: its cache is built on the
+    stored bytes, and only it can commit the pending ones.
+    """
+    user_id = await validate_user(POOL)
+    raw_path = request.args.get("path", "").lstrip("/")
+    if not raw_path:
+        return "Missing path", 400
+
+    try:
+        chunk = int(request.args.get("chunk", ""))
+    except ValueError:
+        return "Invalid chunk index", 400
+
+    async with POOL.acquire() as conn:
+        node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+        if not node_id:
+            return "File not found", 520
+
+    client = request_client()
+    uploader = client != "" and upload_clients.get(node_id) == client
+    if not uploader and not await wait_chunk(node_id, chunk):
+        return "Chunk still uploading", 408
+
+    async with POOL.acquire() as conn:
+        row = await conn.fetchrow(
+            """
+            SELECT message_id, codec, hole, crc32c FROM file_chunks
+            WHERE node_id=$1 AND chunk_index=$2
+            """,
+            node_id, chunk
+        )
+    if row is not None and row["hole"]:
+        return Response(b"", status=201, mimetype="application/octet-stream",
+                        headers={"X-Chunk-Codec": "hole"})
+    if row is None or row["message_id"] is None:
+        return "No such chunk", 404
+
+    data = await discord_client.download_attachment(row["message_id"])
+    headers = {}
+    codec_name = next((k for k, v in CHUNK_CODECS.items() if v == row["codec"]), None)
+    if codec_name:
+        headers["X-Chunk-Codec"] = codec_name
+    if row["crc32c"] is not None:
+        headers["X-Chunk-Crc32c"] = str(row["crc32c"])
+    return Response(data, status=201, mimetype="application/octet-stream", headers=headers)
+
+
+
+@lru_cache(maxsize=64)
+def zero_crc(size):
+    """
+    CRC-32C of size zero bytes, what a hole reads back as. Holes are mostly
+    full chunks, so a few sizes cover nearly all of them.
+    """
+    return crc32c(bytes(size))
+
+
+@app.route("/chunk_list", methods=["GET"])
+async def chunk_list():
+    """
+    Sizes and CRC-32Cs of a file's chunks in order. Clients need the sizes
+    for files stored in content-defined chunks, the checksums let a stale
+    cache keep the chunks that didn't change. Unknown checksums are null.
+    GET /chunk_list?user_id=22&path=foo/bar.txt
+    """
+    user_id = await validate_user(POOL)
+    raw_path = request.args.get("path", "").lstrip("/")
+    if not raw_path:
+        return "Missing path", 400
+
+    async with POOL.acquire() as conn:
+        node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+        if not node_id:
+            return "File not found", 520
+
+        rows = await conn.fetch(
+            """
+            SELECT chunk_size, hole, crc32c FROM file_chunks
+            WHERE node_id=$1 ORDER BY chunk_index
+            """,
+            node_id
+        )
+    crcs = [zero_crc(r["chunk_size"]) if r["hole"] else r["crc32c"] for r in rows]
+    return jsonify({"sizes": [r["chunk_size"] for r in rows], "crcs": crcs}), 201
 
 
 
@@ -556,121 +1094,288 @@ async def create_file():
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
 
+    async with POOL.acquire() as conn, conn.transaction():
+        status = await apply_create(conn, user_id, raw_path)
+    return "", status
+
+
+async def apply_create(conn, user_id: int, raw_path: str) -> int:
+    """Body of /create, also run by /batch. Returns the route's status"""
+    raw_path = raw_path.lstrip("/")
     if not raw_path:
-        return "", 400
+        return 400
     parts = raw_path.split("/")
     file_name = parts.pop()
     now = int(time.time())
 
-    async with POOL.acquire() as conn, conn.transaction():
-        parent = await conn.fetchval(
-            "SELECT id FROM nodes WHERE user_id=$1 AND parent_id IS NULL",
-            user_id
-        )
+    parent = await conn.fetchval(
+        "SELECT id FROM nodes WHERE user_id=$1 AND parent_id IS NULL",
+        user_id
+    )
 
-        for comp in parts:
+    for comp in parts:
+        node_id = await conn.fetchval(
+            """
+            SELECT id FROM nodes
+            WHERE user_id=$1 AND parent_id=$2 AND name=$3
+            """,
+            user_id, parent, comp
+        )
+        if node_id is None:
             node_id = await conn.fetchval(
                 """
-                SELECT id FROM nodes
-                WHERE user_id=$1 AND parent_id=$2 AND name=$3
+                INSERT INTO nodes(user_id, name, parent_id, type,
+                i_atime, i_mtime, i_ctime, i_crtime)
+                VALUES($1,$2,$3, 2 ,$4,$4,$4,$4)
+                RETURNING id
                 """,
-                user_id, parent, comp
+                user_id, comp, parent, now
             )
-            if node_id is None:
-                node_id = await conn.fetchval(
-                    """
-                    INSERT INTO nodes(user_id, name, parent_id, type,
-                    i_atime, i_mtime, i_ctime, i_crtime)
-                    VALUES($1,$2,$3, 2 ,$4,$4,$4,$4)
-                    RETURNING id
-                    """,
-                    user_id, comp, parent, now
-                )
-                await create_closure(conn, node_id, parent)
-            parent = node_id
+            await create_closure(conn, node_id, parent)
+        parent = node_id
 
 
 
-        # Just in case the file DOES exist
-        check_exists = await conn.fetchval(
-            """
-            SELECT 1 FROM nodes
-            WHERE user_id=$1 AND parent_id=$2 AND name=$3
-            """,
-            user_id, parent, file_name
-        )
-        if check_exists:
-            return "", 420
-        
-
-        node_id = await conn.fetchval(
-            """
-            INSERT INTO nodes(user_id, name, parent_id, type,
-            i_atime, i_mtime, i_ctime, i_crtime)
-            VALUES($1,$2,$3, 1 ,$4,$4,$4,$4)
-            RETURNING id
-            """,
-            user_id, file_name, parent, now)
-        await create_closure(conn, node_id, parent)
+    # Just in case the file DOES exist
+    check_exists = await conn.fetchval(
+        """
+        SELECT 1 FROM nodes
+        WHERE user_id=$1 AND parent_id=$2 AND name=$3
+        """,
+        user_id, parent, file_name
+    )
+    if check_exists:
+        return 420
+    
 
-    return "", 201
+    node_id = await conn.fetchval(
+        """
+        INSERT INTO nodes(user_id, name, parent_id, type,
+        i_atime, i_mtime, i_ctime, i_crtime)
+        VALUES($1,$2,$3, 1 ,$4,$4,$4,$4)
+        RETURNING id
+        """,
+        user_id, file_name, parent, now)
+    await create_closure(conn, node_id, parent)
+    return 201
 
 
 @app.route("/truncate", methods=["POST"])
 async def truncate_file():
+    """
+    POST /truncate?user_id=22&path=foo/bar.txt&size=1234&mtime=123
+
+    Chunks wholly below size stay as they are, the ones past it are dropped
+    and only the chunk holding the new end is rewritten. Growing appends
+    holes, after padding a short last chunk when chunks are fixed size.
+
+    409 when the stored chunks don't make up the file (upload in progress or
+    never finished), reset=1 then drops them all and the client resends.
+    The rewritten chunk is downloaded and sent before the transaction, so no
+    row stays locked across Discord calls.
+    """
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path", "").lstrip("/")
     size = request.args.get("size")
     if not raw_path or size is None:
         return "Missing path or size", 400
-    size = int(size)
+    try:
+        size = int(size)
+        true_mtime = int(request.args.get("mtime", time.time()))
+    except ValueError:
+        return "Invalid size or mtime", 400
+    if size < 0:
+        return "Invalid size", 400
+    reset = request.args.get("reset") == "1"
 
-    async with POOL.acquire() as conn, conn.transaction():
+    async with POOL.acquire() as conn:
         node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+        if not node_id:
+            return "File not found", 520
 
-        rows = await conn.fetch(
-                "SELECT message_id FROM file_chunks WHERE node_id=$1",
-                node_id)
-        channel = discord_client.get_channel(discord_client.channel_id)
+        if reset:
+            async with conn.transaction():
+                await conn.execute("SELECT 1 FROM nodes WHERE id=$1 FOR UPDATE", node_id)
+                rows = await conn.fetch(
+                    "DELETE FROM file_chunks WHERE node_id=$1 RETURNING message_id", node_id
+                )
+                doomed = await release_blobs(conn, [r["message_id"] for r in rows])
+                await conn.execute(
+                    """
+                    UPDATE nodes SET i_mtime=$1, size=$2, chunking=0,
+                                     generation=nextval('node_generation_seq')
+                    WHERE id=$3
+                    """,
+                    true_mtime, size, node_id
+                )
+            drop_messages(doomed)
+            return "", 201
 
-        for r in rows:
+        # Cut chunks are sent with no transaction open and no row locked, the
+        # plan is applied after only if the file is still the version it was made for
+        for _ in range(TRUNCATE_ATTEMPTS):
+            node = await conn.fetchrow(
+                "SELECT size, chunking, generation FROM nodes WHERE id=$1", node_id
+            )
+            if node is None:
+                return "File not found", 520
+            rows = await conn.fetch(
+                """
+                SELECT chunk_index, chunk_size, message_id, codec, hole
+                FROM file_chunks WHERE node_id=$1 ORDER BY chunk_index
+                """,
+                node_id
+            )
+            pending = upload_tracking.get(node_id, (set(), None))[0]
+            complete = (
+                [r["chunk_index"] for r in rows] == list(range(len(rows)))
+                and sum(r["chunk_size"] or 0 for r in rows) == node["size"]
+                and all(r["message_id"] is not None or r["hole"] for r in rows)
+            )
+            if pending or not complete:
+                return "Chunks don't make up the file", 409
+
+            resizes = []  # (row, new size)
+            first_dropped = None
+            start = 0
+            next_index = 0
+            for r in rows:
+                end = start + r["chunk_size"]
+                if start >= size:
+                    first_dropped = r["chunk_index"] if first_dropped is None else first_dropped
+                    continue
+                if end > size:
+                    resizes.append((r, size - start))  # the one chunk holding the new end
+                    end = size
+                elif end < size and r is rows[-1] and node["chunking"] == 0 and r["chunk_size"] < CHUNK_SIZE:
+                    # Fixed chunks have to stay CHUNK_SIZE aligned before holes go after
+                    end = min(start + CHUNK_SIZE, size)
+                    resizes.append((r, end - start))
+                start = end
+                next_index = r["chunk_index"] + 1
+
+            cut = []  # (row, new size, rewrite_chunk result)
             try:
-                msg = await channel.fetch_message(r["message_id"])
-                await msg.delete()
+                for r, new_size in resizes:
+                    cut.append((r, new_size, await rewrite_chunk(discord_client, r, new_size)))
             except Exception:
-                app.logger.exception(f"failed to delete chunk msg: {msg.id}")
-        
-        await conn.execute("DELETE FROM file_chunks WHERE node_id=$1", node_id)
+                app.logger.exception("truncate: chunk rewrite failed")
+                drop_messages([c["message_id"] for _, _, c in cut if c["message_id"]])
+                return "Chunk rewrite failed", 500
+            sent = [c["message_id"] for _, _, c in cut if c["message_id"]]
 
-        await conn.execute("UPDATE nodes SET i_mtime=$1, size=$2 WHERE id=$3",
-                            int(time.time()), size, node_id)
-        
-    return "", 201
+            try:
+                async with conn.transaction():
+                    applied = await _truncate_apply(conn, user_id, node_id, node["generation"],
+                                                    rows, cut, first_dropped, start, next_index,
+                                                    size, true_mtime)
+            except Exception:
+                drop_messages(sent)
+                raise
+            if applied is None:
+                drop_messages(sent)  # changed meanwhile, plan again
+                continue
+            drop_messages(applied)
+            return "", 201
+
+    return "File keeps changing", 409
+
+
+async def _truncate_apply(conn, user_id, node_id, generation, rows, cut, first_dropped,
+                          start, next_index, size, true_mtime):
+    """Second half of /truncate, inside its transaction. Stores the cut chunks
+    and drops the ones past size. Returns the messages to delete once
+    committed, None (nothing written) when the file moved past generation."""
+    current = await conn.fetchval(
+        "SELECT generation FROM nodes WHERE id=$1 FOR UPDATE", node_id
+    )
+    if current != generation or upload_tracking.get(node_id, (set(), None))[0]:
+        return None
+
+    released = [r["message_id"] for r in rows if first_dropped is not None
+                and r["chunk_index"] >= first_dropped]
+    extra = []  # sent messages the chunk store already had a copy of
+    for r, new_size, new in cut:
+        message_id, codec, stored_size = new["message_id"], new["codec"], new["stored_size"]
+        if message_id is not None:
+            message_id, codec, stored_size, duplicate = await store_blob(
+                conn, user_id, new["message_id"], new["hash"], new_size, codec, stored_size,
+                new["crc32c"])
+            if duplicate:
+                extra.append(new["message_id"])
+        await conn.execute(
+            """
+            UPDATE file_chunks
+            SET chunk_size=$3, message_id=$4, hash=$5, codec=$6, stored_size=$7, hole=$8,
+                crc32c=$9
+            WHERE node_id=$1 AND chunk_index=$2
+            """,
+            node_id, r["chunk_index"], new_size, message_id, new["hash"],
+            codec, stored_size, new["hole"], new["crc32c"]
+        )
+        released.append(r["message_id"])
+
+    if first_dropped is not None:
+        await conn.execute(
+            "DELETE FROM file_chunks WHERE node_id=$1 AND chunk_index>=$2",
+            node_id, first_dropped
+        )
+
+    # Grown part is all zeros
+    holes = []
+    while start < size:
+        hole_size = min(CHUNK_SIZE, size - start)
+        holes.append((node_id, next_index, hole_size))
+        next_index += 1
+        start += hole_size
+    await conn.executemany(
+        """
+        INSERT INTO file_chunks(node_id, chunk_index, chunk_size, stored_size, hole)
+        VALUES($1,$2,$3,0,TRUE)
+        """,
+        holes
+    )
+
+    doomed = await release_blobs(conn, released)
+    await conn.execute(
+        """
+        UPDATE nodes SET i_mtime=$1, size=$2, generation=nextval('node_generation_seq')
+        WHERE id=$3
+        """,
+        true_mtime, size, node_id
+    )
+    return doomed + extra
 
 
 @app.route("/unlink", methods=["POST"])
 async def unlink():
     user_id = await validate_user(POOL)
     raw_path = request.args.get("path")
-    channel = discord_client.get_channel(discord_client.channel_id)
 
-    async with POOL.acquire() as conn:
-        node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+    doomed = []
+    async with POOL.acquire() as conn, conn.transaction():
+        status = await apply_unlink(conn, user_id, raw_path, doomed)
 
-        if not node_id:
-            return "", 520
-        
-        rows = await conn.fetch(
-            "SELECT message_id FROM file_chunks WHERE node_id=$1",
-              node_id)
+    drop_messages(doomed)
+    return "", status
 
-    
-    message_ids = [r["message_id"] for r in rows if r["message_id"] is not None]
-    await delete_messages(channel, message_ids)
 
-    async with POOL.acquire() as conn, conn.transaction():
-        await conn.execute("DELETE FROM nodes WHERE id = $1", node_id)
-    return "", 201
+async def apply_unlink(conn, user_id: int, raw_path: str, doomed: list) -> int:
+    """Body of /unlink, also run by /batch. Chunk messages no file uses anymore
+    are added to doomed, for the caller to drop once committed."""
+    node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
+
+    if not node_id:
+        return 520
+
+    rows = await conn.fetch(
+        "SELECT message_id FROM file_chunks WHERE node_id=$1",
+          node_id)
+    # Chunks shared with other files stay in the chunk store
+    doomed.extend(await release_blobs(conn, [r["message_id"] for r in rows]))
+    await conn.execute("DELETE FROM nodes WHERE id = $1", node_id)
+    supersede_upload(node_id)  # readers waiting on its chunks give up now
+    return 201
 
 
 @app.route("/rmdir", methods=["POST"])
@@ -679,24 +1384,168 @@ async def rmdir():
     raw_path = request.args.get("path")
 
     async with POOL.acquire() as conn:
-        # ensure dir is empty
-        dir_id = await resolve_node(conn, user_id, raw_path, expected_type=2)
+        status = await apply_rmdir(conn, user_id, raw_path)
+    return '', status
 
-        if not dir_id:
-            return "", 520
 
-        child = await conn.fetchval(
-            "SELECT 1 FROM nodes WHERE parent_id=$1 LIMIT 1", dir_id
-        )
-        if child:
-            return "", 404
+async def apply_rmdir(conn, user_id: int, raw_path: str) -> int:
+    """Body of /rmdir, also run by /batch. Returns the route's status"""
+    # ensure dir is empty
+    dir_id = await resolve_node(conn, user_id, raw_path, expected_type=2)
 
-        await conn.execute("DELETE FROM nodes WHERE id=$1", dir_id)
-    return '', 201
+    if not dir_id:
+        return 520
+
+    child = await conn.fetchval(
+        "SELECT 1 FROM nodes WHERE parent_id=$1 LIMIT 1", dir_id
+    )
+    if child:
+        return 404
+
+    await conn.execute("DELETE FROM nodes WHERE id=$1", dir_id)
+    return 201
     
         
 
 
+@app.route("/clone", methods=["POST"])
+async def clone():
+    """
+    Server side copy for copy_file_range.
+    POST /clone?user_id=22&src=foo/a.bin&dst=foo/b.bin
+
+    dst (already created) gets rows pointing at the messages src is stored
+    in, each one taking a reference in the chunk store. No chunk moves.
+    409 while src is still being uploaded.
+    """
+    user_id = await validate_user(POOL)
+    src_path = request.args.get("src", "").lstrip("/")
+    dst_path = request.args.get("dst", "").lstrip("/")
+    if not src_path or not dst_path:
+        return "Missing src or dst", 400
+
+    async with POOL.acquire() as conn, conn.transaction():
+        src_id = await resolve_node(conn, user_id, src_path, expected_type=1)
+        dst_id = await resolve_node(conn, user_id, dst_path, expected_type=1)
+        if not src_id or not dst_id:
+            return "File not found", 520
+        if src_id == dst_id:
+            return "Same file", 400
+
+        src = await conn.fetchrow(
+            "SELECT size, ready, chunking FROM nodes WHERE id=$1 FOR SHARE", src_id
+        )
+        if not src["ready"]:
+            return "Source is still uploading", 409
+
+        rows = await conn.fetch(
+            """
+            SELECT chunk_index, chunk_size, message_id, hash, codec, stored_size, hole, crc32c
+            FROM file_chunks WHERE node_id=$1
+            """,
+            src_id
+        )
+        message_ids = [r["message_id"] for r in rows]
+        await adopt_blobs(conn, user_id, message_ids)
+
+        old_chunks = await conn.fetch(
+            "DELETE FROM file_chunks WHERE node_id=$1 RETURNING message_id", dst_id
+        )
+        await conn.executemany(
+            """
+            INSERT INTO file_chunks(node_id, chunk_index, chunk_size, message_id, hash,
+                                    codec, stored_size, hole, crc32c)
+            VALUES($1,$2,$3,$4,$5,$6,$7,$8,$9)
+            """,
+            [(dst_id, r["chunk_index"], r["chunk_size"], r["message_id"], r["hash"],
+              r["codec"], r["stored_size"], r["hole"], r["crc32c"]) for r in rows]
+        )
+        await acquire_blobs(conn, message_ids)
+        doomed = await release_blobs(conn, [r["message_id"] for r in old_chunks])
+
+        now = int(time.time())
+        await conn.execute(
+            """
+            UPDATE nodes
+            SET size = $1, ready = TRUE, chunking = $2, i_mtime = $3, i_ctime = $3,
+                generation = nextval('node_generation_seq')
+            WHERE id = $4
+            """,
+            src["size"], src["chunking"], now, dst_id
+        )
+
+        # Supersedes an upload of dst still in progress
+        supersede_upload(dst_id)
+
+    drop_messages(doomed)
+    return "", 201
+
+
+@app.route("/replace", methods=["POST"])
+async def replace():
+    """
+    Atomic save, renames file a over the existing file b.
+    POST /replace?user_id=22&a=foo/.bar.swp&b=foo/bar.txt
+
+    b keeps its node and takes over a's chunks and times in one
+    transaction, a is gone afterwards. Nothing is uploaded again, b's old
+    chunks are released and their messages deleted in the background.
+    404 when b doesn't exist (plain rename instead), 400 when either side
+    isn't a file, 409 while a is still being uploaded.
+    """
+    user_id = await validate_user(POOL)
+    a_path = request.args.get("a", "").strip("/")
+    b_path = request.args.get("b", "").strip("/")
+
+    if not a_path or not b_path:
+        return "Missing a or b paths", 400
+    if a_path == b_path:
+        return "", 201
+
+    async with POOL.acquire() as conn, conn.transaction():
+        a_row = await node_info(conn, user_id, a_path)
+        if not a_row:
+            return "No such file", 520
+        b_row = await node_info(conn, user_id, b_path)
+        if not b_row:
+            return "Destination not found", 404
+        if a_row["type"] != 1 or b_row["type"] != 1:
+            return "Not a file", 400
+        a_id, b_id = a_row["id"], b_row["id"]
+
+        if a_id in upload_tracking and upload_tracking[a_id][0]:
+            return "Source is still uploading", 409
+        src = await conn.fetchrow(
+            "SELECT size, ready, chunking, generation FROM nodes WHERE id=$1 FOR UPDATE", a_id
+        )
+
+        old_chunks = await conn.fetch(
+            "DELETE FROM file_chunks WHERE node_id=$1 RETURNING message_id", b_id
+        )
+        await conn.execute("UPDATE file_chunks SET node_id=$1 WHERE node_id=$2", b_id, a_id)
+        now = int(time.time())
+        await conn.execute(
+            """
+            UPDATE nodes
+            SET size = $1, ready = $2, chunking = $3,
+                i_atime = $4, i_mtime = $5, i_crtime = $6, i_ctime = $7,
+                generation = $9
+            WHERE id = $8
+            """,
+            src["size"], src["ready"], src["chunking"],
+            a_row["i_atime"], a_row["i_mtime"], a_row["i_crtime"], now, b_id,
+            src["generation"]
+        )
+        await conn.execute("DELETE FROM nodes WHERE id=$1", a_id)
+        doomed = await release_blobs(conn, [r["message_id"] for r in old_chunks])
+
+        # Supersedes an upload of b still in progress
+        supersede_upload(b_id)
+
+    drop_messages(doomed)
+    return "", 201
+
+
 # Simply, rename.
 @app.route("/rename", methods=["POST"])
 async def rename():
@@ -907,13 +1756,162 @@ async def modi_mtime():
     
 
     async with POOL.acquire() as conn, conn.transaction():
-        node_id = await resolve_node(conn, user_id, raw_path, expected_type=1)
-        if node_id is None:
-            return "Invalid destination(doesn't exist)", 520
-        await conn.execute("UPDATE nodes SET i_mtime=$1 WHERE id=$2",
-                            new_mtime, node_id)
-        
-    return "", 201
+        status = await apply_mtime(conn, user_id, raw_path, new_mtime)
+    if status == 520:
+        return "Invalid destination(doesn't exist)", 520
+    return "", status
+
+
+async def apply_mtime(conn, user_id: int, raw_path: str, new_mtime: int) -> int:
+    """Body of /modi_mtime, also run by /batch. Returns the route's status.
+    Directories take it too, tar sets theirs after extracting into them."""
+    node_id = await resolve_node(conn, user_id, raw_path.lstrip("/"), expected_type=None)
+    if node_id is None:
+        return 520
+    await conn.execute("UPDATE nodes SET i_mtime=$1 WHERE id=$2",
+                        new_mtime, node_id)
+    return 201
+
+
+class OpFailed(Exception):
+    """Rolls a /batch op back to its savepoint"""
+    def __init__(self, status: int):
+        self.status = status
+
+
+@app.route("/batch", methods=["POST"])
+async def batch():
+    """
+    POST /batch?user_id=22 with {"ops": [{"op": "mkdir", "path": "a"},
+                                         {"op": "create", "path": "a/b"},
+                                         {"op": "utimens", "path": "a/b", "mtime": 123}, ...]}
+    op is one of mkdir, create, unlink, rmdir, utimens.
+
+    Applies the ops in order in one transaction, each under its own
+    savepoint, so one failing leaves the others be. Answers
+    {"results": [status, ...]}, what each op's own route would have
+    answered. Later ops see what earlier ones did, dependencies hold.
+    """
+    user_id = await validate_user(POOL)
+    body = await request.get_json(silent=True) or {}
+    ops = body.get("ops")
+    if not isinstance(ops, list) or len(ops) > BATCH_OPS_MAX:
+        return "Invalid op list", 400
+
+    results = []
+    doomed = []
+    async with POOL.acquire() as conn, conn.transaction():
+        for op in ops:
+            try:
+                kind = op["op"]
+                path = str(op["path"]).lstrip("/")
+                mtime = int(op.get("mtime", 0))
+            except (TypeError, KeyError, ValueError):
+                results.append(400)
+                continue
+            try:
+                async with conn.transaction():
+                    if kind == "mkdir":
+                        status = await apply_mkdir(conn, user_id, path)
+                    elif kind == "create":
+                        status = await apply_create(conn, user_id, path)
+                    elif kind == "unlink":
+                        status = await apply_unlink(conn, user_id, path, doomed)
+                    elif kind == "rmdir":
+                        status = await apply_rmdir(conn, user_id, path)
+                    elif kind == "utimens" and mtime >= 0:
+                        status = await apply_mtime(conn, user_id, path, mtime)
+                    else:
+                        status = 400
+                    if status != 201:
+                        raise OpFailed(status)
+            except OpFailed as e:
+                status = e.status
+            results.append(status)
+
+    drop_messages(doomed)
+    for op, status in zip(ops, results):
+        if status == 201:
+            note_change(user_id, str(op["path"]), op["op"] == "rmdir")
+    return jsonify({"results": results}), 201
+
+
+@app.route("/lease", methods=["POST"])
+async def lease():
+    """
+    POST /lease?user_id=22&path=foo/&subtree=1&mode=read[&id=<lease id>]
+
+    Grants (or with id, renews) a lease for LEASE_TTL seconds, answered with
+    {"id", "ttl", "seq", "boot"}. seq is where the holder's /changes reading
+    has to start for its cache to be covered. release=1 gives it back.
+    A lease in the way of another client answers 409 with Retry-After.
+    """
+    user_id = await validate_user(POOL)
+    path = "/" + request.args.get("path", "").strip("/")
+    subtree = request.args.get("subtree") == "1"
+    mode = request.args.get("mode", "read")
+    lease_id = request.args.get("id") or os.urandom(8).hex()
+    client = request_client()
+    if mode not in ("read", "write"):
+        return "Invalid mode", 400
+
+    held = leases[user_id]
+    if request.args.get("release") == "1":
+        if held.get(lease_id, (None,))[0] == client:
+            del held[lease_id]
+        return "", 201
+
+    wait = lease_conflict(user_id, client, path, subtree, mode)
+    if wait > 0:
+        return "", 409, {"Retry-After": str(int(wait) + 1)}
+
+    held[lease_id] = (client, path, subtree, mode, time.monotonic() + LEASE_TTL)
+    return jsonify({"id": lease_id, "ttl": LEASE_TTL,
+                    "seq": change_seq[user_id], "boot": BOOT_ID}), 201
+
+
+@app.route("/changes", methods=["GET"])
+async def changes():
+    """
+    GET /changes?user_id=22&since=41&wait=20
+
+    Long-polls the user's change feed, answers as soon as there are changes
+    after since, or empty after wait seconds:
+    {"seq", "boot", "reset", "changes": [{"seq", "path", "tree", "own"}]}
+    own marks changes made by the asking client. reset means changes after
+    since were lost (restart, or too far behind), everything is suspect.
+    """
+    user_id = await validate_user(POOL)
+    try:
+        since = int(request.args.get("since", "0"))
+        wait = min(float(request.args.get("wait", "0")), CHANGES_WAIT_MAX)
+    except ValueError:
+        return "Invalid since or wait", 400
+
+    loop = asyncio.get_running_loop()
+    deadline = loop.time() + wait
+    while change_seq[user_id] <= since:
+        left = deadline - loop.time()
+        if left <= 0:
+            break
+        event = change_events.setdefault(user_id, asyncio.Event())
+        try:
+            await asyncio.wait_for(event.wait(), timeout=left)
+        except asyncio.TimeoutError:
+            break
+
+    log = change_logs[user_id]
+    seq = change_seq[user_id]
+    oldest = log[0][0] if log else seq + 1
+    client = request_client()
+    result = {
+        "seq": seq,
+        "boot": BOOT_ID,
+        "reset": since > seq or since + 1 < oldest,
+        "changes": [{"seq": c_seq, "path": path, "tree": tree, "own": origin == client}
+                    for c_seq, path, tree, origin in log if c_seq > since]
+    }
+    return jsonify(result), 201
 
 
 @app.route("/ping", methods=["GET"])
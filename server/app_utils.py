@@ -2,10 +2,15 @@ import asyncio
 import os
 import tempfile
 import time
+import hashlib
+from collections import Counter
 import aioconsole
+import zstandard
+from crc32c import crc32c
 from discord import File
 from quart import abort, request
-from server._config import NOTIFICATIONS_ID
+from server._config import NOTIFICATIONS_ID, CHUNK_SIZE
+from server.discord_api import delete_messages
 
 
 current_vault = 1  # channel used for storage, on 1 currently for simplicity. TBD!
@@ -43,9 +48,130 @@ async def validate_user(POOL):
     return uid
 
 
-async def dispatch_upload(POOL, discord_client, user_id, file_path: str, chunk, chunk_size, tmp_name):
+async def acquire_blobs(conn, message_ids):
+    """
+    One more reference per entry on chunks tracked in chunk_blobs.
+    """
+    for mid, n in Counter(m for m in message_ids if m is not None).items():
+        await conn.execute(
+            "UPDATE chunk_blobs SET refcount = refcount + $2 WHERE message_id=$1", mid, n
+        )
+
+
+async def adopt_blobs(conn, user_id, message_ids):
+    """
+    Gives messages stored before the chunk store an entry, counting the rows
+    that use them, so they can be shared from here on. Their hash is a
+    placeholder that never matches a real one.
+    """
+    await conn.execute(
+        """
+        INSERT INTO chunk_blobs(message_id, user_id, hash, chunk_size, refcount, codec,
+                                stored_size, crc32c)
+        SELECT message_id, $1, 'msg:' || message_id, MAX(chunk_size), COUNT(*),
+               MAX(codec), MAX(stored_size), MAX(crc32c)
+        FROM file_chunks
+        WHERE message_id = ANY($2::bigint[])
+        GROUP BY message_id
+        ON CONFLICT DO NOTHING
+        """,
+        user_id, list({m for m in message_ids if m is not None})
+    )
+
+
+async def release_blobs(conn, message_ids) -> list[int]:
+    """
+    Drops one reference per entry, returns the messages nobody references anymore.
+    Messages without a chunk_blobs entry predate the chunk store and go right away.
+    """
+    doomed = []
+    for mid, n in Counter(m for m in message_ids if m is not None).items():
+        left = await conn.fetchval(
+            "UPDATE chunk_blobs SET refcount = refcount - $2 WHERE message_id=$1 RETURNING refcount",
+            mid, n
+        )
+        if left is None:
+            doomed.append(mid)
+        elif left <= 0:
+            await conn.execute("DELETE FROM chunk_blobs WHERE message_id=$1", mid)
+            doomed.append(mid)
+    return doomed
+
+
+async def store_blob(conn, user_id, message_id, chunk_hash, chunk_size, codec, stored_size,
+                     chunk_crc=None):
+    """
+    Registers a freshly sent message in the user's chunk store with one
+    reference. If the same bytes got stored meanwhile that copy is referenced
+    instead, returns (message_id, codec, stored_size, duplicate) of the copy to use.
+    """
+    stored = await conn.fetchval(
+        """
+        INSERT INTO chunk_blobs(message_id, user_id, hash, chunk_size, refcount,
+                                codec, stored_size, crc32c)
+        VALUES($1,$2,$3,$4,1,$5,$6,$7)
+        ON CONFLICT (user_id, hash) DO NOTHING
+        RETURNING message_id
+        """,
+        message_id, user_id, chunk_hash, chunk_size, codec, stored_size, chunk_crc
+    )
+    if stored is not None:
+        return message_id, codec, stored_size, False
+
+    blob = await conn.fetchrow(
+        """
+        UPDATE chunk_blobs SET refcount = refcount + 1
+        WHERE user_id=$1 AND hash=$2 RETURNING message_id, codec, stored_size
+        """,
+        user_id, chunk_hash
+    )
+    return blob["message_id"], blob["codec"], blob["stored_size"], True
+
+
+async def rewrite_chunk(discord_client, row, new_size: int):
+    """
+    Cuts or zero-pads one stored chunk to new_size bytes and sends the result
+    as a new message, in the codec the old one had. Touches no table, so it
+    can run outside a transaction. row holds message_id, codec, hole.
+    Returns {message_id, hash, codec, stored_size, hole, crc32c}, message_id
+    is the sent message (None for a hole) and still has to go through
+    store_blob, or be deleted if it never does.
+    """
+    if row["hole"]:
+        return {"message_id": None, "hash": None, "codec": 0, "stored_size": 0, "hole": True,
+                "crc32c": None}
+
+    data = await discord_client.download_attachment(row["message_id"])
+    if row["codec"] == 1:
+        data = zstandard.ZstdDecompressor().decompress(data, max_output_size=CHUNK_SIZE)
+    data = data[:new_size].ljust(new_size, b"\0")
+    if not data.strip(b"\0"):
+        return {"message_id": None, "hash": None, "codec": 0, "stored_size": 0, "hole": True,
+                "crc32c": None}
+
+    chunk_hash = hashlib.sha256(data).hexdigest()
+    chunk_crc = crc32c(data)
+    codec = row["codec"]
+    payload = zstandard.ZstdCompressor().compress(data) if codec == 1 else data
+
+    with tempfile.NamedTemporaryFile(delete=False) as tmp:
+        tmp.write(payload)
+    try:
+        channel = discord_client.get_channel(discord_client.channel_id)
+        msg = await channel.send(file=File(tmp.name))
+    finally:
+        os.unlink(tmp.name)
+    return {"message_id": msg.id, "hash": chunk_hash, "codec": codec,
+            "stored_size": len(payload), "hole": False, "crc32c": chunk_crc}
+
+
+async def dispatch_upload(POOL, discord_client, user_id, file_path: str, chunk, chunk_size, tmp_name,
+                          chunk_hash: str | None = None, codec: int = 0, chunk_crc: int | None = None):
     """
     Upload one chunk file to Discord and record message_id in DB.
+    With chunk_hash the message also goes into the user's chunk store.
+    chunk_size is the decoded size, tmp_name may hold fewer bytes under a codec.
+    chunk_crc is the CRC-32C of the decoded bytes.
     """
     await discord_client.wait_until_ready()
 
@@ -78,24 +204,48 @@ async def dispatch_upload(POOL, discord_client, user_id, file_path: str, chunk,
     # Send to discord
     channel = discord_client.get_channel(discord_client.channel_id)
     msg = await channel.send(file=File(tmp_name))
-
-    # Insert into db
-    async with POOL.acquire() as conn:
+    stored_size = os.path.getsize(tmp_name)
+
+    # Insert into db, a retried chunk replaces the copy that already made it
+    doomed = []
+    async with POOL.acquire() as conn, conn.transaction():
+        message_id = msg.id
+        if chunk_hash:
+            # Same bytes may have been stored meanwhile, keep that copy (and its codec)
+            message_id, codec, stored_size, duplicate = await store_blob(
+                conn, user_id, msg.id, chunk_hash, chunk_size, codec, stored_size, chunk_crc)
+            if duplicate:
+                doomed.append(msg.id)
+
+        old_id = await conn.fetchval(
+            "SELECT message_id FROM file_chunks WHERE node_id=$1 AND chunk_index=$2 FOR UPDATE",
+            node_id, chunk
+        )
         await conn.execute(
             """
-            INSERT INTO file_chunks(node_id, chunk_index, chunk_size, message_id)
-            VALUES($1,$2,$3,$4)
-            ON CONFLICT (node_id, chunk_index) DO NOTHING
+            INSERT INTO file_chunks(node_id, chunk_index, chunk_size, message_id, hash,
+                                    codec, stored_size, crc32c)
+            VALUES($1,$2,$3,$4,$5,$6,$7,$8)
+            ON CONFLICT (node_id, chunk_index)
+            DO UPDATE SET chunk_size = EXCLUDED.chunk_size, message_id = EXCLUDED.message_id,
+                          hash = EXCLUDED.hash, codec = EXCLUDED.codec,
+                          stored_size = EXCLUDED.stored_size, hole = FALSE,
+                          crc32c = EXCLUDED.crc32c
             """,
-            node_id, chunk, chunk_size, msg.id
+            node_id, chunk, chunk_size, message_id, chunk_hash, codec, stored_size, chunk_crc
         )
+        if old_id is not None:
+            doomed += await release_blobs(conn, [old_id])
 
-        # update access time
+        # update access time, mtime stays what the client sent in prep_upload
         await conn.execute(
-            "UPDATE nodes SET i_mtime=$1 WHERE id=$2",
+            "UPDATE nodes SET i_atime=$1 WHERE id=$2",
             int(time.time()), node_id
         )
 
+    if doomed:
+        asyncio.create_task(delete_messages(channel, doomed))
+
 
     try:
         os.unlink(tmp_name)
@@ -32,4 +32,22 @@ Expected: ${EXPECTED_SUB[*]}
 Got:      ${SUB_ENTRIES[*]}"
 fi
 
+note "Checking ls -l and stat against the sizes written"
+SIZES_DIR="$SANDBOX/sizes"
+declare -A WANT=([empty]=0 [small]=5 [page]=4096 [odd]=70001)
+mkdir -p "$SIZES_DIR"
+for name in "${!WANT[@]}"; do
+    head -c "${WANT[$name]}" /dev/urandom > "$SIZES_DIR/$name"
+done
+COUNT=0
+while read -r size name; do
+    [ -n "${WANT[$name]+x}" ] || die "Unexpected entry $name in $SIZES_DIR"
+    [ "$size" = "${WANT[$name]}" ] || die "ls -l size of $name is $size, wrote ${WANT[$name]}"
+    got=$(stat -c %s "$SIZES_DIR/$name")
+    [ "$got" = "${WANT[$name]}" ] || die "stat size of $name is $got, wrote ${WANT[$name]}"
+    COUNT=$((COUNT + 1))
+done < <(ls -l "$SIZES_DIR" | awk 'NR > 1 {print $5, $9}')
+[ "$COUNT" -eq "${#WANT[@]}" ] || die "ls -l listed $COUNT of ${#WANT[@]} files"
+rm -r "$SIZES_DIR"
+
 pass
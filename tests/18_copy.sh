@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+init_test
+
+SRC="$SANDBOX/copy_src.bin"
+DST="$SANDBOX/copy_dst.bin"
+PART="$SANDBOX/copy_part.bin"
+TMP_LOCAL="/tmp/disfs_copy_local.bin"
+
+note "Writing 25 MB source file"
+head -c 26214400 /dev/urandom > "$TMP_LOCAL"
+ORIG_HASH=$(sha256sum "$TMP_LOCAL" | awk '{print $1}')
+cp "$TMP_LOCAL" "$SRC"
+sync "$SRC" || true
+
+note "Copying inside the mount (server side clone)"
+cp --reflink=auto "$SRC" "$DST"
+sync "$DST" || true
+[[ "$(sha256sum "$DST" | awk '{print $1}')" == "$ORIG_HASH" ]] || die "Copy differs from source"
+
+note "Source survives removing the copy"
+rm -f "$DST"
+[[ "$(sha256sum "$SRC" | awk '{print $1}')" == "$ORIG_HASH" ]] || die "Source damaged by removing its copy"
+
+note "Copy survives removing the source"
+cp "$SRC" "$DST"
+sync "$DST" || true
+rm -f "$SRC"
+[[ "$(sha256sum "$DST" | awk '{print $1}')" == "$ORIG_HASH" ]] || die "Copy damaged by removing its source"
+
+note "Partial copies fall back to copying bytes"
+# dd would never reach copy_file_range, python calls it with offsets and a count
+copy_range() {
+    python3 - "$@" <<'PYEOF'
+import os, sys
+src, dst, off_in, off_out, count = sys.argv[1], sys.argv[2], *map(int, sys.argv[3:])
+i = os.open(src, os.O_RDONLY)
+o = os.open(dst, os.O_WRONLY | os.O_CREAT, 0o644)
+while count > 0:
+    n = os.copy_file_range(i, o, count, off_in, off_out)
+    if n <= 0:
+        sys.exit("copy_file_range stopped short")
+    off_in += n; off_out += n; count -= n
+os.close(i)
+os.close(o)
+PYEOF
+}
+PART_LOCAL="/tmp/disfs_copy_part.bin"
+
+copy_range "$DST" "$PART" 3145728 0 5242880
+copy_range "$TMP_LOCAL" "$PART_LOCAL" 3145728 0 5242880
+sync "$PART" || true
+[[ "$(sha256sum "$PART" | awk '{print $1}')" == "$(sha256sum "$PART_LOCAL" | awk '{print $1}')" ]] \
+    || die "Partial copy differs"
+
+note "Partial copy into a non-empty destination keeps the bytes around it"
+head -c 8388608 /dev/urandom > "$PART_LOCAL"
+cp "$PART_LOCAL" "$PART"
+sync "$PART" || true
+copy_range "$DST" "$PART" 1000000 2500000 3000000
+copy_range "$TMP_LOCAL" "$PART_LOCAL" 1000000 2500000 3000000
+sync "$PART" || true
+[[ "$(sha256sum "$PART" | awk '{print $1}')" == "$(sha256sum "$PART_LOCAL" | awk '{print $1}')" ]] \
+    || die "Partial copy into existing file differs"
+
+rm -f "$DST" "$PART" "$TMP_LOCAL" "$PART_LOCAL"
+
+pass
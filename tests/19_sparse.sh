@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+init_test
+
+TARGET="$SANDBOX/sparse.img"
+TMP_LOCAL="/tmp/disfs_sparse_local.img"
+TMP_READBACK="/tmp/disfs_sparse_readback.img"
+SIZE=$((64 * 1024 * 1024))   # 64 MB, mostly holes
+
+# Restarts the daemon without the local copy, reads have to go to the server
+remount_cold() {
+    fusermount3 -uz "$MNT" 2>/dev/null || true
+    while pgrep -f "main $MNT" >/dev/null; do sleep 0.1; done
+    rm -f "$HOME"/.cache/disfs/*/tests/sparse.img
+    ./main "$MNT" &
+    for _ in $(seq 1 50); do
+        [ -d "$MNT/.command" ] && break
+        sleep 0.1
+    done
+    check_login
+}
+
+# Chunks of sparse.img the server stores as holes
+hole_rows() {
+    psql "$DATABASE_URL" -tAc "
+        SELECT count(*) FROM file_chunks c
+        JOIN nodes f ON f.id = c.node_id
+        JOIN nodes d ON d.id = f.parent_id
+        JOIN nodes r ON r.id = d.parent_id AND r.parent_id IS NULL
+        JOIN users u ON u.id = f.user_id
+        WHERE u.username = '$USER' AND d.name = 'tests' AND f.name = 'sparse.img'
+          AND c.hole AND c.message_id IS NULL"
+}
+
+note "Building a sparse image locally"
+rm -f "$TMP_LOCAL"
+truncate -s "$SIZE" "$TMP_LOCAL"
+head -c 1048576 /dev/urandom | dd of="$TMP_LOCAL" bs=1M seek=30 conv=notrunc status=none
+ORIG_HASH=$(sha256sum "$TMP_LOCAL" | awk '{print $1}')
+
+note "Same image inside DISFS"
+truncate -s "$SIZE" "$TARGET"
+dd if="$TMP_LOCAL" of="$TARGET" bs=1M skip=30 seek=30 count=1 conv=notrunc status=none
+sync "$TARGET" || true
+
+NEW_SIZE=$(stat -c %s "$TARGET")
+[ "$NEW_SIZE" -eq "$SIZE" ] || die "Size incorrect (expected $SIZE, got $NEW_SIZE)"
+
+note "Zero chunks went up as holes"
+HOLES=$(hole_rows)
+[ "$HOLES" -ge 5 ] || die "Expected at least 5 hole chunks on the server, found $HOLES"
+
+note "Reading it back from the server, holes come back as zeros"
+remount_cold
+cp "$TARGET" "$TMP_READBACK"
+READ_HASH=$(sha256sum "$TMP_READBACK" | awk '{print $1}')
+[[ "$READ_HASH" == "$ORIG_HASH" ]] || die "Checksum mismatch on sparse file"
+
+note "Writing into a hole"
+printf 'hello' | dd of="$TARGET" bs=1 seek=$((50 * 1024 * 1024)) conv=notrunc status=none
+sync "$TARGET" || true
+[ "$(hole_rows)" -eq $((HOLES - 1)) ] || die "Hole written into is still a hole on the server"
+remount_cold
+[[ "$(dd if="$TARGET" bs=1 skip=$((50 * 1024 * 1024)) count=5 status=none)" == "hello" ]] \
+    || die "Data written into a hole lost"
+
+rm -f "$TARGET" "$TMP_LOCAL" "$TMP_READBACK"
+
+pass
@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+init_test
+
+TARGET="$SANDBOX/atomic.txt"
+TEMP="$SANDBOX/.atomic.txt.tmp"
+OTHER_DIR="$SANDBOX/atomic_dir"
+
+note "Saving the first version"
+echo "version 1" > "$TARGET"
+sync "$TARGET" || true
+
+note "Write temp file, then rename over the target"
+for v in 2 3 4; do
+    echo "version $v" > "$TEMP"
+    mv -f "$TEMP" "$TARGET"
+done
+[ ! -e "$TEMP" ] || die "Temp file still around after rename"
+[[ "$(cat "$TARGET")" == "version 4" ]] || die "Target doesn't hold the last save"
+[ "$(ls -a "$SANDBOX" | grep -c '^atomic.txt$')" -eq 1 ] || die "Target listed more than once"
+
+note "Replacing across directories"
+mkdir -p "$OTHER_DIR"
+echo "from elsewhere" > "$OTHER_DIR/.incoming"
+mv -f "$OTHER_DIR/.incoming" "$TARGET"
+[ ! -e "$OTHER_DIR/.incoming" ] || die "Source still around after move"
+[[ "$(cat "$TARGET")" == "from elsewhere" ]] || die "Cross-directory replace lost data"
+
+note "Renaming onto a directory fails"
+echo "nope" > "$TEMP"
+if mv -fT "$TEMP" "$OTHER_DIR" 2>/dev/null; then
+    die "File replaced a directory"
+fi
+rm -f "$TEMP"
+rmdir "$OTHER_DIR"
+
+rm -f "$TARGET"
+
+pass
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+init_test
+
+TARGET="$SANDBOX/shared.bin"
+
+note "Two writers and a reader on the same file, closed in turns"
+head -c 4096 /dev/zero > "$TARGET"
+python3 - "$TARGET" <<'PYEOF'
+import os, sys
+path = sys.argv[1]
+a = os.open(path, os.O_WRONLY)
+b = os.open(path, os.O_WRONLY)
+r = os.open(path, os.O_RDONLY)
+os.pwrite(a, b"A" * 1024, 0)
+os.pwrite(b, b"B" * 1024, 2048)
+os.close(a)                     # b still writing, nothing ships yet
+os.pwrite(b, b"b" * 16, 4096)   # grows the file past what a saw
+os.close(b)                     # last writer, everything goes up
+if os.pread(r, 16, 4096) != b"b" * 16:
+    sys.exit("reader doesn't see the last write")
+os.close(r)
+PYEOF
+sync "$TARGET" || true
+
+EXPECT=$( { head -c 1024 /dev/zero | tr '\0' 'A'; head -c 1024 /dev/zero;
+            head -c 1024 /dev/zero | tr '\0' 'B'; head -c 1024 /dev/zero;
+            head -c 16 /dev/zero | tr '\0' 'b'; } | sha256sum | awk '{print $1}')
+[ "$(stat -c %s "$TARGET")" -eq 4112 ] || die "Size incorrect after shared writes"
+[[ "$(sha256sum "$TARGET" | awk '{print $1}')" == "$EXPECT" ]] || die "Writes of one handle lost"
+
+rm -f "$TARGET"
+
+pass
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+# Many small namespace changes in a row, run with DISFS_ASYNC_META=1 so the
+# op log, /batch and the shadowing of unconfirmed ops are what answers
+
+init_test
+
+ROOT="$SANDBOX/bulk"
+REPLAY="$SANDBOX/bulk_replay"
+DIRS=10
+FILES=20
+OPLOG="${PROJECT_ROOT:-$PWD}/oplog"
+
+# Restarts the daemon on $MNT with extra environment, queued work drains on the way out
+remount() {
+    fusermount3 -uz "$MNT" 2>/dev/null || true
+    while pgrep -f "main $MNT" >/dev/null; do sleep 0.1; done
+    env "$@" ./main "$MNT" &
+    for _ in $(seq 1 50); do
+        [ -d "$MNT/.command" ] && break
+        sleep 0.1
+    done
+    check_login
+}
+trap remount EXIT
+
+note "Remounting with the metadata log"
+remount DISFS_ASYNC_META=1
+grep -q "Mode: asynchronous" "$MNT/.command/stats" || die "Metadata log not enabled"
+
+note "Creating $DIRS dirs of $FILES files"
+mkdir -p "$ROOT"
+for d in $(seq 1 $DIRS); do
+    mkdir "$ROOT/d$d"
+    for f in $(seq 1 $FILES); do
+        echo "$d/$f" > "$ROOT/d$d/f$f"
+    done
+    touch -d @1000000000 "$ROOT/d$d/f1"
+done
+
+note "Checking the tree as listed"
+COUNT=$(find "$ROOT" -type f | wc -l)
+[ "$COUNT" -eq $((DIRS * FILES)) ] || die "Expected $((DIRS * FILES)) files, found $COUNT"
+[ "$(cat "$ROOT/d3/f7")" = "3/7" ] || die "d3/f7 has the wrong content"
+[ "$(stat -c %Y "$ROOT/d2/f1")" -eq 1000000000 ] || die "mtime of d2/f1 not kept"
+
+note "Waiting for it to reach the server"
+sync "$ROOT/d1/f1" || die "fsync reported a failed namespace change"
+grep -q "Queued: 0" "$MNT/.command/stats" || die "Ops still queued after fsync"
+grep -q "Rejected by server: 0" "$MNT/.command/stats" || die "Server rejected logged ops"
+
+note "Server has the tree without the log (fresh mount)"
+remount DISFS_ASYNC_META=0
+COUNT=$(find "$ROOT" -type f | wc -l)
+[ "$COUNT" -eq $((DIRS * FILES)) ] || die "Server has $COUNT files, expected $((DIRS * FILES))"
+[ "$(stat -c %Y "$ROOT/d2/f1")" -eq 1000000000 ] || die "mtime of d2/f1 not on the server"
+
+note "Removing it again"
+remount DISFS_ASYNC_META=1
+rm -r "$ROOT"
+[ ! -e "$ROOT" ] || die "$ROOT still there after rm -r"
+mkdir "$ROOT"
+touch "$ROOT/after"
+sync "$ROOT/after" || die "fsync reported a failed namespace change"
+[ -z "$(ls "$ROOT" | grep -v '^after$')" ] || die "Removed entries came back"
+rm -r "$ROOT"
+
+note "Ops left in the log are replayed on the next mount"
+mkdir -p "$REPLAY"
+touch "$REPLAY/existing"
+sync "$REPLAY/existing" || die "fsync reported a failed namespace change"
+USER_DIR=$(dirname "$(ls -d "$HOME"/.cache/disfs/*/tests | head -n 1)")
+USER_ID=$(basename "$USER_DIR")
+fusermount3 -uz "$MNT" 2>/dev/null || true
+while pgrep -f "main $MNT" >/dev/null; do sleep 0.1; done
+# A create the server applied before the crash comes back as EEXIST, it must not fail fsync
+cat > "$OPLOG" <<LOG
+O 1 $USER_ID 0 0 /tests/bulk_replay/dir
+O 2 $USER_ID 1 0 /tests/bulk_replay/dir/file
+O 3 $USER_ID 1 0 /tests/bulk_replay/existing
+LOG
+remount DISFS_ASYNC_META=1
+[ -d "$REPLAY/dir" ] || die "Replayed mkdir missing"
+[ -f "$REPLAY/dir/file" ] || die "Replayed create missing"
+touch "$REPLAY/after"
+sync "$REPLAY/after" || die "fsync failed over an op the server had already applied"
+grep -q "Queued: 0" "$MNT/.command/stats" || die "Replayed ops never confirmed"
+rm -r "$REPLAY"
+
+pass
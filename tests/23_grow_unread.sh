@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+set -euo pipefail
+source "$(dirname "$0")/common.sh"
+
+init_test
+
+SRC="$SANDBOX/grow_src.bin"
+DST="$SANDBOX/grow_dst.bin"
+CHECK="$SANDBOX/grow_check.bin"
+TMP_LOCAL="/tmp/disfs_grow_local.bin"
+
+note "Writing a 15 MB file, its last chunk is partial"
+head -c 15728640 /dev/urandom > "$TMP_LOCAL"
+cp "$TMP_LOCAL" "$SRC"
+sync "$SRC" || true
+
+note "Server side copy, none of its chunks are local"
+cp --reflink=auto "$SRC" "$DST"
+sync "$DST" || true
+
+note "Growing the copy past its unread last chunk"
+# The old last chunk has to go up again from the server's copy, which the
+# upload itself is replacing. fsync returns once the upload is through.
+python3 - "$DST" "$TMP_LOCAL" <<'PYEOF'
+import os, sys, time
+tail = b"grown past the old end" * 1000
+for path in sys.argv[1:]:
+    fd = os.open(path, os.O_WRONLY)
+    os.pwrite(fd, tail, 25 * 1024 * 1024)
+    started = time.monotonic()
+    os.fsync(fd)
+    os.close(fd)
+    if time.monotonic() - started > 30:
+        sys.exit("Upload of the grown file stalled")
+PYEOF
+EXPECT=$(sha256sum "$TMP_LOCAL" | awk '{print $1}')
+[[ "$(sha256sum "$DST" | awk '{print $1}')" == "$EXPECT" ]] || die "Grown file differs locally"
+
+note "Server copy matches (read through a fresh clone)"
+cp --reflink=auto "$DST" "$CHECK"
+[[ "$(sha256sum "$CHECK" | awk '{print $1}')" == "$EXPECT" ]] || die "Grown file differs on the server"
+
+rm -f "$SRC" "$DST" "$CHECK" "$TMP_LOCAL"
+
+pass